@@ -10,6 +10,7 @@
 #include "prefab.h"
 #include "gltf_loader.h"
 #include "renderer.h"
+#include "glstate.h"
 
 #include <cmath>
 #include <string>
@@ -86,14 +87,18 @@ void Application::render(void)
 	//be sure no errors present in opengl before start
 	checkGLErrors();
 
+	//the uniform upload and GL state counters start again every frame
+	Shader::resetUniformStats();
+	GLState::resetStats();
+
 	//set the camera as default (used by some functions in the framework)
 	camera->enable();
 
 	//set default flags
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
     
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 	if(render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	else
@@ -110,7 +115,7 @@ void Application::render(void)
 	if(render_grid)
 		drawGrid();
 
-    glDisable(GL_DEPTH_TEST);
+    GLState::disable(GL_DEPTH_TEST);
     //render anything in the gui after this
 
 	//the swap buffers is done in the main loop after this function
@@ -238,10 +243,7 @@ void Application::renderDebugGizmo()
 	ImGuiIO& io = ImGui::GetIO();
 	ImGuizmo::SetRect(0, 0, io.DisplaySize.x, io.DisplaySize.y);
 
-	if(selected_entity->visible)
-		ImGuizmo::Manipulate(camera->view_matrix.m, camera->projection_matrix.m, mCurrentGizmoOperation, mCurrentGizmoMode, matrix.m, NULL, useSnap ? &snap.x : NULL, 0,0, &scene->entity_tracker);
-	else
-		ImGuizmo::Manipulate(camera->view_matrix.m, camera->projection_matrix.m, mCurrentGizmoOperation, mCurrentGizmoMode, matrix.m, NULL, useSnap ? &snap.x : NULL, 0, 0);
+	ImGuizmo::Manipulate(camera->view_matrix.m, camera->projection_matrix.m, mCurrentGizmoOperation, mCurrentGizmoMode, matrix.m, NULL, useSnap ? &snap.x : NULL, 0, 0);
 
 	#endif
 }
@@ -258,21 +260,81 @@ void Application::renderDebugGUI(void)
 	ImGui::Checkbox("Wireframe", &render_wireframe);
 	ImGui::Checkbox("Grid", &render_grid);
 	ImGui::Checkbox("Alpha sorting", &scene->alpha_sorting);
+	ImGui::Checkbox("Sort keys", &scene->key_sorting);
+	if (scene->key_sorting) ImGui::Text("State changes saved: %d", renderer->state_changes_saved);
+	ImGui::Checkbox("Multithreaded traversal", &scene->multithreaded_traversal);
+	ImGui::Text("Traversal: %.3f ms, instances updated: %d", renderer->traversal_time, renderer->instances_updated);
+	ImGui::Checkbox("BVH culling", &scene->bvh_culling);
+	if (scene->bvh_culling)
+		ImGui::Text("BVH nodes: %d, visited: %d, refit: %d%s", renderer->scene_bvh.getNumNodes(), renderer->scene_bvh.nodes_visited, renderer->scene_bvh.nodes_refit, renderer->scene_bvh.rebuilt ? " (rebuilt)" : "");
+	if (ImGui::Button("Benchmark frustum culling")) renderer->benchmarkFrustumCulling(camera, 100);
+	ImGui::Text("Scalar: %.4f ms, %s: %.4f ms", renderer->culling_benchmark_scalar, Camera::getBatchCullingPath(), renderer->culling_benchmark_batch);
+	if (renderer->culling_benchmark_mismatch != -1) ImGui::Text("Different results from box %d", renderer->culling_benchmark_mismatch);
+	if (ImGui::Button("Benchmark transforms")) renderer->benchmarkTransforms(100);
+	ImGui::Text("Scalar: %.4f ms, SIMD: %.4f ms", renderer->transforms_benchmark_scalar, renderer->transforms_benchmark_simd);
+	ImGui::Checkbox("Instancing", &scene->instancing);
+	if (scene->instancing) ImGui::Text("Draw calls saved: %d", renderer->draw_calls_saved);
+	ImGui::Checkbox("Light culling", &scene->light_culling);
+	if (scene->light_culling) ImGui::Text("Light passes saved: %d", renderer->light_passes_saved);
+	ImGui::Checkbox("Occlusion culling", &scene->occlusion_culling);
+	if (scene->occlusion_culling) ImGui::Text("Queries: %d  Culled: %d  Latency: %d frames", renderer->occlusion_culler.queries_issued, renderer->occlusion_culler.objects_culled, renderer->occlusion_culler.max_latency);
+	if (scene->render_type != GTR::Deferred)
+	{
+		ImGui::Checkbox("Depth pre-pass", &scene->depth_prepass);
+		ImGui::Text("Total shaded fragments (opaque, all passes): %d (%.2f per pixel)", renderer->shaded_fragments, renderer->shaded_fragments / (float)(window_width * window_height));
+		if (scene->depth_prepass) ImGui::Text("Pre-pass fragments: %d", renderer->prepass_fragments);
+		//only comparable when every opaque object is shaded in a single pass
+		if (scene->depth_prepass && scene->render_type == GTR::Clustered) ImGui::Text("Overdraw saved: %d fragments", renderer->prepass_fragments - renderer->shaded_fragments);
+	}
 	ImGui::Checkbox("Emissive materials", &scene->emissive_materials);
 	ImGui::Checkbox("Occlussion texture", &scene->occlusion);
 	ImGui::Checkbox("Specular light", &scene->specular_light);
 	ImGui::Checkbox("Normal map", &scene->normal_mapping);
 	ImGui::Checkbox("Shadow atlas", &scene->show_atlas);
 	ImGui::Checkbox("Shadow sorting", &scene->shadow_sorting);
+	if (scene->fbo) ImGui::Text("Atlas %dx%d, maps: %d, dropped: %d, repacks: %d", scene->fbo->width, scene->fbo->height, renderer->shadow_atlas.num_maps, renderer->shadow_atlas.num_dropped, renderer->shadow_atlas.num_repacks);
+	if (scene->fbo) ImGui::Text("Maps per tier: %d %d %d %d", renderer->shadow_atlas.maps_per_tier[0], renderer->shadow_atlas.maps_per_tier[1], renderer->shadow_atlas.maps_per_tier[2], renderer->shadow_atlas.maps_per_tier[3]);
+	ImGui::Checkbox("Static shadow cache", &scene->static_shadows);
+	ImGui::Checkbox("Multi-view shadows", &scene->multiview_shadows);
+	if (scene->multiview_shadows && !renderer->supportsMultiViewShadows()) ImGui::Text("Viewport arrays not supported");
+	if (scene->fbo) ImGui::Text("Shadow maps rendered: %d, texels: %d, empty faces: %d (changes: %d static, %d dynamic)", renderer->shadow_maps_rendered, renderer->shadow_texels_rendered, renderer->shadow_faces_culled, (int)renderer->static_shadow_changes.size(), (int)renderer->dynamic_shadow_changes.size());
+	if (scene->fbo) ImGui::Text("Shadow draw calls: %d, multi-view passes: %d", renderer->shadow_draw_calls, renderer->multiview_passes);
+	for (int i = 0; i < renderer->shadow_lights_rendered.size(); ++i)
+		ImGui::BulletText("%s", renderer->shadow_lights_rendered[i]->name.c_str());
+
+	//Uniform uploads of each shader in the last frame
+	if (ImGui::TreeNode("Uniform uploads"))
+	{
+		for (std::map<std::string, Shader*>::iterator it = Shader::s_Shaders.begin(); it != Shader::s_Shaders.end(); ++it)
+			if (it->second->last_frame_uniform_uploads || it->second->last_frame_uniform_uploads_skipped)
+				ImGui::BulletText("%s: %d issued, %d skipped", it->first.c_str(), it->second->last_frame_uniform_uploads, it->second->last_frame_uniform_uploads_skipped);
+		ImGui::TreePop();
+	}
+
+	//Uniform buffer ring: bytes written in the last frame and frames that had to wait for the GPU
+	ImGui::Text("Uniform blocks: %d / %d bytes, %d waits%s, %d light blocks", renderer->uniform_ring.used, renderer->uniform_ring.frame_size, renderer->uniform_ring.waits, renderer->uniform_ring.persistent ? " (persistent)" : "", (int)renderer->light_block_offsets.size());
+
+	//GL state changes that reached the driver and the ones filtered by the cache in the last frame
+	if (ImGui::TreeNode("GL state changes"))
+	{
+		ImGui::Checkbox("Validate (slow)", &GLState::validation);
+		for (int i = 0; i < GLState::NUM_CATEGORIES; ++i)
+			ImGui::BulletText("%s: %d issued, %d skipped", GLState::getCategoryName(i), GLState::last_frame_changes[i], GLState::last_frame_skipped[i]);
+		ImGui::Text("Validation errors: %d", GLState::validation_errors);
+		ImGui::TreePop();
+	}
 
 	//Shadow resolution
 	scene->shadow_resolution_tracker = ImGui::Combo("Shadow Resolution", &scene->atlas_resolution_index, shadow_resolutions, IM_ARRAYSIZE(shadow_resolutions));
 
 	//Render type
 	switch (scene->render_type) {
-		case(GTR::Singlepass): ImGui::SliderInt("Render Type", &scene->render_type, GTR::Singlepass, GTR::Multipass, "SinglePass"); break;
-		case(GTR::Multipass): ImGui::SliderInt("Render Type", &scene->render_type, GTR::Singlepass, GTR::Multipass, "Multipass"); break;
+		case(GTR::Singlepass): ImGui::SliderInt("Render Type", &scene->render_type, GTR::Singlepass, GTR::Deferred, "SinglePass"); break;
+		case(GTR::Multipass): ImGui::SliderInt("Render Type", &scene->render_type, GTR::Singlepass, GTR::Deferred, "Multipass"); break;
+		case(GTR::Clustered): ImGui::SliderInt("Render Type", &scene->render_type, GTR::Singlepass, GTR::Deferred, "Clustered"); break;
+		case(GTR::Deferred): ImGui::SliderInt("Render Type", &scene->render_type, GTR::Singlepass, GTR::Deferred, "Deferred"); break;
 	}
+	if (scene->render_type == GTR::Clustered) ImGui::Text("Cluster light indices: %d", renderer->light_clusters.num_light_indices);
 
 	//Scene Color
 	ImGui::ColorEdit3("BG color", scene->background_color.v);
@@ -396,7 +458,7 @@ void Application::onMouseWheel(SDL_MouseWheelEvent event)
 void Application::onResize(int width, int height)
 {
     std::cout << "window resized: " << width << "," << height << std::endl;
-	glViewport( 0,0, width, height );
+	GLState::viewport( 0,0, width, height );
 	camera->aspect =  width / (float)height;
 	window_width = width;
 	window_height = height;
@@ -0,0 +1,281 @@
+#include "bvh.h"
+#include "camera.h"
+#include "renderlist.h"
+#include <algorithm>
+
+using namespace GTR;
+
+static float getAxis(const Vector3& v, int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static bool sameBox(const BoundingBox& a, const BoundingBox& b)
+{
+	return a.center.x == b.center.x && a.center.y == b.center.y && a.center.z == b.center.z &&
+		a.halfsize.x == b.halfsize.x && a.halfsize.y == b.halfsize.y && a.halfsize.z == b.halfsize.z;
+}
+
+//Axis where the centers are more spread
+static int getSplitAxis(const Vector3& centers_min, const Vector3& centers_max)
+{
+	Vector3 extent = centers_max - centers_min;
+	if (extent.x >= extent.y && extent.x >= extent.z) return 0;
+	return extent.y >= extent.z ? 1 : 2;
+}
+
+GTR::SceneBVH::SceneBVH()
+{
+	rebuilt = false;
+	nodes_refit = 0;
+	nodes_visited = 0;
+}
+
+void GTR::SceneBVH::update(const RenderList& render_list)
+{
+	rebuilt = false;
+	nodes_refit = 0;
+	nodes_visited = 0;
+
+	//Different calls: the tree has to be built again
+	if (render_list.size() != boxes.size() || render_list.groups != groups || render_list.group_owners != group_owners)
+	{
+		build(render_list);
+		rebuilt = true;
+		return;
+	}
+
+	//Same calls: only the groups whose boxes were recomputed are read, and the leaves of the boxes that changed are marked
+	bool changed = false;
+	for (int i = 0; i < render_list.changed_groups.size(); ++i)
+	{
+		int group = render_list.changed_groups[i];
+		int group_end = group + 1 < groups.size() ? groups[group + 1] : (int)boxes.size();
+		for (int call = groups[group]; call < group_end; ++call)
+		{
+			const BoundingBox& box = render_list.world_bounding_boxes[call];
+			if (sameBox(box, boxes[call]))
+				continue;
+			boxes[call] = box;
+			call_boxes.set(position_of_call[call], box);
+			nodes[leaf_of_call[call]].dirty = true;
+			changed = true;
+		}
+	}
+
+	if (changed)
+		refit();
+}
+
+void GTR::SceneBVH::clear()
+{
+	nodes.clear();
+	groups.clear();
+	group_owners.clear();
+	boxes.clear();
+}
+
+void GTR::SceneBVH::refit()
+{
+	//The children are always created after their parent, so going backwards every node is refit after its children
+	for (int i = (int)nodes.size() - 1; i >= 0; --i)
+	{
+		Node& node = nodes[i];
+		if (!node.dirty)
+			continue;
+
+		node.box = node.left == -1 ? computeCallsBox(node.first, node.count) : mergeBoundingBoxes(nodes[node.left].box, nodes[node.right].box);
+		node.dirty = false;
+		if (node.parent != -1)
+			nodes[node.parent].dirty = true;
+		nodes_refit++;
+	}
+}
+
+void GTR::SceneBVH::build(const RenderList& render_list)
+{
+	int num_calls = render_list.size();
+	groups = render_list.groups;
+	group_owners = render_list.group_owners;
+	boxes = render_list.world_bounding_boxes;
+
+	nodes.clear();
+	calls.clear();
+	leaf_of_call.assign(num_calls, -1);
+	if (num_calls == 0)
+		return;
+
+	//Calls added before the first group form a group too
+	group_starts.clear();
+	if (groups.empty() || groups[0] != 0)
+		group_starts.push_back(0);
+	group_starts.insert(group_starts.end(), groups.begin(), groups.end());
+	group_starts.push_back(num_calls);
+
+	//Box of each non empty group
+	int num_groups = (int)group_starts.size() - 1;
+	group_indices.clear();
+	group_boxes.resize(num_groups);
+	for (int i = 0; i < num_groups; ++i)
+	{
+		int count = group_starts[i + 1] - group_starts[i];
+		if (count == 0)
+			continue;
+		group_boxes[i] = boxes[group_starts[i]];
+		for (int j = 1; j < count; ++j)
+			group_boxes[i] = mergeBoundingBoxes(group_boxes[i], boxes[group_starts[i] + j]);
+		group_indices.push_back(i);
+	}
+
+	buildGroups(0, (int)group_indices.size(), -1);
+
+	position_of_call.resize(num_calls);
+	call_boxes.resize(num_calls);
+	for (int i = 0; i < num_calls; ++i)
+	{
+		position_of_call[calls[i]] = i;
+		call_boxes.set(i, boxes[calls[i]]);
+	}
+}
+
+int GTR::SceneBVH::addNode(int parent, int first)
+{
+	Node node;
+	node.parent = parent;
+	node.left = -1;
+	node.right = -1;
+	node.first = first;
+	node.count = 0;
+	node.dirty = false;
+	nodes.push_back(node);
+	return (int)nodes.size() - 1;
+}
+
+//Top levels: median split of the groups by the center of their boxes
+int GTR::SceneBVH::buildGroups(int first, int last, int parent)
+{
+	//Only one group: split its calls
+	if (last - first == 1)
+	{
+		int group = group_indices[first];
+		int calls_begin = (int)calls.size();
+		for (int i = group_starts[group]; i < group_starts[group + 1]; ++i)
+			calls.push_back(i);
+		return buildCalls(calls_begin, (int)calls.size(), parent);
+	}
+
+	int node = addNode(parent, (int)calls.size());
+
+	Vector3 centers_min = group_boxes[group_indices[first]].center;
+	Vector3 centers_max = centers_min;
+	for (int i = first + 1; i < last; ++i)
+	{
+		centers_min.setMin(group_boxes[group_indices[i]].center);
+		centers_max.setMax(group_boxes[group_indices[i]].center);
+	}
+	int axis = getSplitAxis(centers_min, centers_max);
+
+	int middle = (first + last) / 2;
+	std::nth_element(group_indices.begin() + first, group_indices.begin() + middle, group_indices.begin() + last, [&](int a, int b) {
+		return getAxis(group_boxes[a].center, axis) < getAxis(group_boxes[b].center, axis);
+	});
+
+	//nodes may be reallocated while building the children: don't keep references
+	int left = buildGroups(first, middle, node);
+	int right = buildGroups(middle, last, node);
+	nodes[node].left = left;
+	nodes[node].right = right;
+	nodes[node].count = (int)calls.size() - nodes[node].first;
+	nodes[node].box = mergeBoundingBoxes(nodes[left].box, nodes[right].box);
+	return node;
+}
+
+//Lower levels: median split of the calls of a group
+int GTR::SceneBVH::buildCalls(int first, int last, int parent)
+{
+	int node = addNode(parent, first);
+	nodes[node].count = last - first;
+
+	if (last - first <= MAX_LEAF_CALLS)
+	{
+		nodes[node].box = computeCallsBox(first, last - first);
+		for (int i = first; i < last; ++i)
+			leaf_of_call[calls[i]] = node;
+		return node;
+	}
+
+	Vector3 centers_min = boxes[calls[first]].center;
+	Vector3 centers_max = centers_min;
+	for (int i = first + 1; i < last; ++i)
+	{
+		centers_min.setMin(boxes[calls[i]].center);
+		centers_max.setMax(boxes[calls[i]].center);
+	}
+	int axis = getSplitAxis(centers_min, centers_max);
+
+	int middle = (first + last) / 2;
+	std::nth_element(calls.begin() + first, calls.begin() + middle, calls.begin() + last, [&](int a, int b) {
+		return getAxis(boxes[a].center, axis) < getAxis(boxes[b].center, axis);
+	});
+
+	int left = buildCalls(first, middle, node);
+	int right = buildCalls(middle, last, node);
+	nodes[node].left = left;
+	nodes[node].right = right;
+	nodes[node].box = mergeBoundingBoxes(nodes[left].box, nodes[right].box);
+	return node;
+}
+
+BoundingBox GTR::SceneBVH::computeCallsBox(int first, int count) const
+{
+	BoundingBox box = boxes[calls[first]];
+	for (int i = 1; i < count; ++i)
+		box = mergeBoundingBoxes(box, boxes[calls[first + i]]);
+	return box;
+}
+
+int GTR::SceneBVH::cullFrustum(Camera* camera, int* calls_found)
+{
+	if (nodes.empty())
+		return 0;
+
+	int num_inside = 0;
+	stack.clear();
+	stack.push_back(0);
+	while (!stack.empty())
+	{
+		const Node& node = nodes[stack.back()];
+		stack.pop_back();
+		nodes_visited++;
+
+		char result = camera->testBoxInFrustum(node.box.center, node.box.halfsize);
+		if (result == CLIP_OUTSIDE)
+			continue;
+
+		//The whole node is inside: accept all its calls
+		if (result == CLIP_INSIDE)
+		{
+			for (int i = node.first; i < node.first + node.count; ++i)
+				calls_found[num_inside++] = calls[i];
+			continue;
+		}
+
+		//Partially inside leaf: test its calls (contiguous in call_boxes)
+		if (node.left == -1)
+		{
+			uint32 visible_mask;
+			camera->testBoxesInFrustum(call_boxes, node.first, node.count, &visible_mask);
+			for (int i = 0; i < node.count; ++i)
+			{
+				if (!(visible_mask & (1u << i)))
+					continue;
+				calls_found[num_inside++] = calls[node.first + i];
+			}
+			continue;
+		}
+
+		stack.push_back(node.right);
+		stack.push_back(node.left);
+	}
+	return num_inside;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+
+namespace GTR {
+
+	class RenderList;
+
+	//Bounding volume hierarchy over the world bounding boxes of the render calls, used to cull them against camera frustums.
+	//The top levels split the groups of the render list (one per entity), so a whole prefab outside the frustum is rejected
+	//without visiting its nodes, and the levels below split the calls of each group. Every node covers a contiguous range
+	//of the call permutation, so a node fully inside the frustum accepts all its calls without more tests.
+	//The tree is only rebuilt when the calls change; if only some groups changed (an entity moved) the nodes are refit from
+	//the leaves of their calls up to the root, without looking at the other boxes.
+	class SceneBVH
+	{
+	public:
+		static const int MAX_LEAF_CALLS = 8; //The calls of a partially visible leaf are tested in one batch
+
+		//Stats
+		bool rebuilt; //Whether the last update had to rebuild the tree
+		int nodes_refit; //Nodes whose box changed in the last update
+		int nodes_visited; //Nodes tested by the queries since the last update
+
+		SceneBVH();
+
+		//Builds or refits the tree with the calls of the render list (only the boxes of its changed groups are read)
+		void update(const RenderList& render_list);
+
+		//Forgets the tree, the next update builds it again
+		void clear();
+
+		//Writes the calls whose box is (at least partially) inside the camera frustum, in tree order.
+		//Returns the number of calls found
+		int cullFrustum(Camera* camera, int* calls_found);
+
+		int getNumNodes() const { return (int)nodes.size(); }
+
+	private:
+		struct Node {
+			BoundingBox box;
+			int parent;
+			int left; //Children, -1 for leaves
+			int right;
+			int first; //Range of the calls permutation covered by the node
+			int count;
+			bool dirty;
+		};
+
+		std::vector<Node> nodes;
+		std::vector<int> calls; //Call indices, ordered so each node covers a contiguous range
+		std::vector<int> leaf_of_call;
+		std::vector<int> position_of_call; //Index of each call in the permutation
+		BoundingBoxArray call_boxes; //Boxes of the calls in permutation order, for the batch tests of the leaves
+		std::vector<int> groups; //Groups, owners and boxes of the calls used to build the tree, to detect the changes
+		std::vector<const void*> group_owners;
+		std::vector<BoundingBox> boxes;
+		std::vector<int> group_starts; //Temporal storage of the build
+		std::vector<int> group_indices;
+		std::vector<BoundingBox> group_boxes;
+		std::vector<int> stack;
+
+		void build(const RenderList& render_list);
+		void refit();
+		int buildGroups(int first, int last, int parent);
+		int buildCalls(int first, int last, int parent);
+		int addNode(int parent, int first);
+		BoundingBox computeCallsBox(int first, int count) const;
+	};
+
+};
@@ -4,6 +4,18 @@
 #include "includes.h"
 #include <iostream>
 
+//SIMD batch culling is only compiled for x86 (SSE is always there in x64, AVX is detected at runtime)
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	#define CULLING_SIMD
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define TARGET_AVX
+	#else
+		#define TARGET_AVX __attribute__((target("avx")))
+	#endif
+#endif
+
 Camera* Camera::current = NULL;
 
 Camera::Camera()
@@ -393,3 +405,146 @@ char Camera::testBoxInFrustum(const Vector3& center, const Vector3& halfsize)
 	return o == 0 ? CLIP_INSIDE : CLIP_OVERLAP;
 }
 
+
+//Batch frustum culling kernels. They compute exactly the same operations as planeBoxOverlap (in the same order),
+//so every path gives the same result. The mask must be cleared before calling them.
+typedef void (*BoxesCullingKernel)(const float (*planes)[4], const BoundingBoxArray& boxes, int first, int start, int count, uint32* mask);
+
+static void testBoxesScalar(const float (*planes)[4], const BoundingBoxArray& boxes, int first, int start, int count, uint32* mask)
+{
+	for (int i = start; i < count; ++i)
+	{
+		int box = first + i;
+		bool visible = true;
+		for (int p = 0; p < 6 && visible; ++p)
+		{
+			float radius = abs(boxes.halfsize_x[box] * planes[p][0]) + abs(boxes.halfsize_y[box] * planes[p][1]) + abs(boxes.halfsize_z[box] * planes[p][2]);
+			float distance = planes[p][0] * boxes.center_x[box] + planes[p][1] * boxes.center_y[box] + planes[p][2] * boxes.center_z[box] + planes[p][3];
+			visible = distance > -radius;
+		}
+		if (visible)
+			mask[i >> 5] |= 1u << (i & 31);
+	}
+}
+
+#ifdef CULLING_SIMD
+
+static void testBoxesSSE(const float (*planes)[4], const BoundingBoxArray& boxes, int first, int start, int count, uint32* mask)
+{
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	int i = start;
+	for (; i + 4 <= count; i += 4)
+	{
+		int box = first + i;
+		__m128 cx = _mm_loadu_ps(&boxes.center_x[box]);
+		__m128 cy = _mm_loadu_ps(&boxes.center_y[box]);
+		__m128 cz = _mm_loadu_ps(&boxes.center_z[box]);
+		__m128 hx = _mm_loadu_ps(&boxes.halfsize_x[box]);
+		__m128 hy = _mm_loadu_ps(&boxes.halfsize_y[box]);
+		__m128 hz = _mm_loadu_ps(&boxes.halfsize_z[box]);
+
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; ++p)
+		{
+			__m128 nx = _mm_set1_ps(planes[p][0]);
+			__m128 ny = _mm_set1_ps(planes[p][1]);
+			__m128 nz = _mm_set1_ps(planes[p][2]);
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(sign_mask, _mm_mul_ps(hx, nx)), _mm_andnot_ps(sign_mask, _mm_mul_ps(hy, ny))), _mm_andnot_ps(sign_mask, _mm_mul_ps(hz, nz)));
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)), _mm_mul_ps(nz, cz)), _mm_set1_ps(planes[p][3]));
+			outside = _mm_or_ps(outside, _mm_cmple_ps(distance, _mm_xor_ps(radius, sign_mask)));
+		}
+
+		//i is a multiple of 4, so the 4 bits never cross a word
+		uint32 visible = ~_mm_movemask_ps(outside) & 0xF;
+		mask[i >> 5] |= visible << (i & 31);
+	}
+	testBoxesScalar(planes, boxes, first, i, count, mask);
+}
+
+TARGET_AVX static void testBoxesAVX(const float (*planes)[4], const BoundingBoxArray& boxes, int first, int start, int count, uint32* mask)
+{
+	const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+	int i = start;
+	for (; i + 8 <= count; i += 8)
+	{
+		int box = first + i;
+		__m256 cx = _mm256_loadu_ps(&boxes.center_x[box]);
+		__m256 cy = _mm256_loadu_ps(&boxes.center_y[box]);
+		__m256 cz = _mm256_loadu_ps(&boxes.center_z[box]);
+		__m256 hx = _mm256_loadu_ps(&boxes.halfsize_x[box]);
+		__m256 hy = _mm256_loadu_ps(&boxes.halfsize_y[box]);
+		__m256 hz = _mm256_loadu_ps(&boxes.halfsize_z[box]);
+
+		__m256 outside = _mm256_setzero_ps();
+		for (int p = 0; p < 6; ++p)
+		{
+			__m256 nx = _mm256_set1_ps(planes[p][0]);
+			__m256 ny = _mm256_set1_ps(planes[p][1]);
+			__m256 nz = _mm256_set1_ps(planes[p][2]);
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_andnot_ps(sign_mask, _mm256_mul_ps(hx, nx)), _mm256_andnot_ps(sign_mask, _mm256_mul_ps(hy, ny))), _mm256_andnot_ps(sign_mask, _mm256_mul_ps(hz, nz)));
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, cx), _mm256_mul_ps(ny, cy)), _mm256_mul_ps(nz, cz)), _mm256_set1_ps(planes[p][3]));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, _mm256_xor_ps(radius, sign_mask), _CMP_LE_OQ));
+		}
+
+		//i is a multiple of 8, so the 8 bits never cross a word
+		uint32 visible = ~_mm256_movemask_ps(outside) & 0xFF;
+		mask[i >> 5] |= visible << (i & 31);
+	}
+	testBoxesScalar(planes, boxes, first, i, count, mask);
+}
+
+static bool cpuSupportsAVX()
+{
+#ifdef _MSC_VER
+	//AVX instructions and the OS saving the YMM registers
+	int info[4];
+	__cpuid(info, 1);
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	return avx && osxsave && (_xgetbv(0) & 6) == 6;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx");
+#endif
+}
+
+#endif
+
+static BoxesCullingKernel selectBoxesCullingKernel(const char** name)
+{
+#ifdef CULLING_SIMD
+	if (cpuSupportsAVX())
+	{
+		*name = "AVX";
+		return testBoxesAVX;
+	}
+	*name = "SSE";
+	return testBoxesSSE;
+#else
+	*name = "scalar";
+	return testBoxesScalar;
+#endif
+}
+
+//The kernel is chosen once, the first time it is used
+static BoxesCullingKernel getBoxesCullingKernel(const char** name = NULL)
+{
+	static const char* kernel_name = NULL;
+	static BoxesCullingKernel kernel = selectBoxesCullingKernel(&kernel_name);
+	if (name)
+		*name = kernel_name;
+	return kernel;
+}
+
+void Camera::testBoxesInFrustum(const BoundingBoxArray& boxes, int first, int count, uint32* visible_mask)
+{
+	memset(visible_mask, 0, ((count + 31) / 32) * sizeof(uint32));
+	getBoxesCullingKernel()(frustum, boxes, first, 0, count, visible_mask);
+}
+
+const char* Camera::getBatchCullingPath()
+{
+	const char* name = NULL;
+	getBoxesCullingKernel(&name);
+	return name;
+}
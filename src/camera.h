@@ -82,6 +82,11 @@ public:
 	bool testPointInFrustum( Vector3 v );
 	char testSphereInFrustum( const Vector3& v, float radius);
 	char testBoxInFrustum( const Vector3& center, const Vector3& halfsize );
+
+	//batch culling: sets bit i of visible_mask ((count + 31) / 32 words) if the box first + i is not outside the frustum.
+	//Same result as testBoxInFrustum != CLIP_OUTSIDE, testing 8 (AVX) or 4 (SSE) boxes at once when the CPU supports it
+	void testBoxesInFrustum( const BoundingBoxArray& boxes, int first, int count, uint32* visible_mask );
+	static const char* getBatchCullingPath(); //"AVX", "SSE" or "scalar"
 };
 
 
@@ -0,0 +1,217 @@
+#include "clusters.h"
+#include "includes.h"
+#include "camera.h"
+#include "shader.h"
+#include "scene.h"
+#include "application.h"
+#include "glstate.h"
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+using namespace GTR;
+
+GTR::LightClusters::LightClusters()
+{
+	num_global_lights = 0;
+	num_lights = 0;
+	num_light_indices = 0;
+	buffers[0] = buffers[1] = buffers[2] = 0;
+	textures[0] = textures[1] = textures[2] = 0;
+	grid.resize(NUM_CLUSTERS * 2);
+	cluster_count.resize(NUM_CLUSTERS);
+}
+
+GTR::LightClusters::~LightClusters()
+{
+	if (textures[0])
+	{
+		glDeleteTextures(3, textures);
+		GLState::invalidate(GLState::TEXTURE); //their ids can be reused
+		glDeleteBuffers(3, buffers);
+	}
+}
+
+//Depth slice of a view space depth (slices grow exponentially, like the perspective precision)
+static int depthSlice(float depth, float near_plane, float log_far_near)
+{
+	if (depth <= near_plane)
+		return 0;
+	int slice = (int)floor(log(depth / near_plane) / log_far_near * LightClusters::CLUSTERS_Z);
+	return std::min(slice, LightClusters::CLUSTERS_Z - 1);
+}
+
+//Range of tiles covered by [min_value, max_value] at depth 1, or false if it is outside the screen
+static bool tileRange(float min_value, float max_value, float screen_min, float tile_size, int num_tiles, int& first, int& last)
+{
+	first = (int)floor((min_value - screen_min) / tile_size);
+	last = (int)floor((max_value - screen_min) / tile_size);
+	if (last < 0 || first >= num_tiles)
+		return false;
+	first = std::max(first, 0);
+	last = std::min(last, num_tiles - 1);
+	return true;
+}
+
+//Extent at depth 1 of the view space interval [min_value, max_value] seen at the depths [min_depth, max_depth]
+static void projectInterval(float min_value, float max_value, float min_depth, float max_depth, float& projected_min, float& projected_max)
+{
+	projected_min = min_value / (min_value < 0.0f ? min_depth : max_depth);
+	projected_max = max_value / (max_value > 0.0f ? min_depth : max_depth);
+}
+
+void GTR::LightClusters::build(const std::vector<LightEntity*>& lights, Camera* camera, bool shadows)
+{
+	assert(camera->type == Camera::PERSPECTIVE && "clusters need a perspective camera");
+
+	light_data.clear();
+	cluster_lights.clear();
+	num_global_lights = 0;
+	num_lights = 0;
+
+	//Directional lights go first: every fragment iterates over them
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		for (int i = 0; i < lights.size(); ++i)
+		{
+			LightEntity* light = lights[i];
+			bool is_global = light->light_type == DIRECTIONAL;
+			if (is_global != (pass == 0))
+				continue;
+
+			light_data.resize(light_data.size() + LIGHT_TEXELS);
+			light->writeShaderData(&light_data[light_data.size() - LIGHT_TEXELS], shadows);
+
+			if (is_global)
+				num_global_lights++;
+			num_lights++;
+		}
+	}
+
+	//Froxel extents in view space (the camera looks down -Z)
+	float near_plane = camera->near_plane;
+	float log_far_near = log(camera->far_plane / near_plane);
+	float tan_half_fov = tan(camera->fov * 0.5f * DEG2RAD);
+	float tile_height = 2.0f * tan_half_fov / CLUSTERS_Y; //At depth 1
+	float tile_width = 2.0f * tan_half_fov * camera->aspect / CLUSTERS_X;
+
+	//Bin every local light in the froxels overlapped by its sphere of influence
+	for (int i = num_global_lights; i < num_lights; ++i)
+	{
+		const Vector4& position = light_data[i * LIGHT_TEXELS];
+		Vector3 view_position = camera->view_matrix * position.xyz();
+		float radius = position.w;
+		float depth = -view_position.z;
+		if (depth + radius < near_plane || depth - radius > camera->far_plane)
+			continue;
+
+		int first_slice = depthSlice(depth - radius, near_plane, log_far_near);
+		int last_slice = depthSlice(depth + radius, near_plane, log_far_near);
+		for (int z = first_slice; z <= last_slice; ++z)
+		{
+			float slice_near = near_plane * exp(log_far_near * z / CLUSTERS_Z);
+			float slice_far = near_plane * exp(log_far_near * (z + 1) / CLUSTERS_Z);
+
+			//Tiles overlapped by the box of the sphere clipped to the slice, projected at depth 1
+			float min_depth = std::max(slice_near, depth - radius);
+			float max_depth = std::min(slice_far, depth + radius);
+			float min_x, max_x, min_y, max_y;
+			projectInterval(view_position.x - radius, view_position.x + radius, min_depth, max_depth, min_x, max_x);
+			projectInterval(view_position.y - radius, view_position.y + radius, min_depth, max_depth, min_y, max_y);
+			int first_x, last_x, first_y, last_y;
+			if (!tileRange(min_x, max_x, -tan_half_fov * camera->aspect, tile_width, CLUSTERS_X, first_x, last_x) ||
+				!tileRange(min_y, max_y, -tan_half_fov, tile_height, CLUSTERS_Y, first_y, last_y))
+				continue;
+
+			for (int y = first_y; y <= last_y; ++y)
+			{
+				float y0 = -tan_half_fov + y * tile_height;
+				float y1 = y0 + tile_height;
+				for (int x = first_x; x <= last_x; ++x)
+				{
+					float x0 = -tan_half_fov * camera->aspect + x * tile_width;
+					float x1 = x0 + tile_width;
+
+					//AABB of the froxel: the tile scaled at both depths of the slice
+					Vector3 box_min(std::min(x0 * slice_near, x0 * slice_far), std::min(y0 * slice_near, y0 * slice_far), -slice_far);
+					Vector3 box_max(std::max(x1 * slice_near, x1 * slice_far), std::max(y1 * slice_near, y1 * slice_far), -slice_near);
+					BoundingBox box((box_min + box_max) * 0.5f, (box_max - box_min) * 0.5f);
+					if (!BoundingBoxSphereOverlap(box, view_position, radius))
+						continue;
+
+					ClusterLight cluster_light;
+					cluster_light.cluster = (z * CLUSTERS_Y + y) * CLUSTERS_X + x;
+					cluster_light.light = i;
+					cluster_lights.push_back(cluster_light);
+				}
+			}
+		}
+	}
+
+	//Counting sort of the (cluster, light) pairs: offsets and counts of the grid and the light index list
+	std::fill(cluster_count.begin(), cluster_count.end(), 0);
+	for (int i = 0; i < cluster_lights.size(); ++i)
+		cluster_count[cluster_lights[i].cluster]++;
+
+	unsigned int offset = 0;
+	for (int c = 0; c < NUM_CLUSTERS; ++c)
+	{
+		grid[c * 2] = offset;
+		grid[c * 2 + 1] = 0;
+		offset += cluster_count[c];
+	}
+
+	light_indices.resize(std::max((int)cluster_lights.size(), 1));
+	for (int i = 0; i < cluster_lights.size(); ++i)
+	{
+		int cluster = cluster_lights[i].cluster;
+		light_indices[grid[cluster * 2] + grid[cluster * 2 + 1]++] = cluster_lights[i].light;
+	}
+	num_light_indices = (int)cluster_lights.size();
+
+	if (light_data.empty())
+		light_data.push_back(Vector4());
+
+	upload(0, GL_RGBA32F, &light_data[0], light_data.size() * sizeof(Vector4));
+	upload(1, GL_RG32UI, &grid[0], grid.size() * sizeof(unsigned int));
+	upload(2, GL_R32UI, &light_indices[0], light_indices.size() * sizeof(unsigned int));
+}
+
+void GTR::LightClusters::upload(int index, unsigned int internal_format, const void* data, size_t size)
+{
+	if (!buffers[index])
+	{
+		glGenBuffers(1, &buffers[index]);
+		glGenTextures(1, &textures[index]);
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, buffers[index]);
+	glBufferData(GL_TEXTURE_BUFFER, size, NULL, GL_STREAM_DRAW); //orphan the storage used by the previous frame
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	GLState::bindTexture(GL_TEXTURE_BUFFER, textures[index]);
+	glTexBuffer(GL_TEXTURE_BUFFER, internal_format, buffers[index]);
+	GLState::bindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+void GTR::LightClusters::bind(Shader* shader, Camera* camera, int first_slot)
+{
+	//bound for every draw call, so the names are interned once
+	static const UniformID names[3] = { UniformID("u_clusters_lights"), UniformID("u_clusters_grid"), UniformID("u_clusters_indices") };
+	static const UniformID u_view("u_view");
+	static const UniformID u_clusters_near_far("u_clusters_near_far");
+	static const UniformID u_viewport_size("u_viewport_size");
+	static const UniformID u_num_global_lights("u_num_global_lights");
+
+	for (int i = 0; i < 3; ++i)
+	{
+		GLState::bindTexture(first_slot + i, GL_TEXTURE_BUFFER, textures[i]);
+		shader->setUniform(names[i], first_slot + i);
+	}
+
+	shader->setUniform(u_view, camera->view_matrix);
+	shader->setUniform(u_clusters_near_far, Vector2(camera->near_plane, log(camera->far_plane / camera->near_plane)));
+	shader->setUniform(u_viewport_size, Vector2((float)Application::instance->window_width, (float)Application::instance->window_height));
+	shader->setUniform(u_num_global_lights, num_global_lights);
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "framework.h"
+#include "scene.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+class Shader;
+
+namespace GTR {
+
+	class LightEntity;
+
+	//Clustered forward lighting: the view frustum is split in a grid of froxels (screen tiles x exponential depth slices)
+	//and every frame the lights are binned into the froxels they touch. The grid, the light index list and the light data
+	//are uploaded as buffer textures, so the shader only iterates over the lights of the fragment's cluster.
+	class LightClusters
+	{
+	public:
+		static const int CLUSTERS_X = 16;
+		static const int CLUSTERS_Y = 9;
+		static const int CLUSTERS_Z = 24;
+		static const int NUM_CLUSTERS = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+		static const int LIGHT_TEXELS = LIGHT_DATA_TEXELS; //vec4 texels used by each light in the light data buffer
+
+		int num_global_lights; //Directional lights: they reach every cluster and are stored first
+		int num_lights;
+		int num_light_indices; //Size of the light index list of the last build (stats)
+
+		LightClusters();
+		~LightClusters();
+
+		//Bins the lights into the froxels of the camera and uploads the buffers
+		void build(const std::vector<LightEntity*>& lights, Camera* camera, bool shadows);
+
+		//Binds the buffers starting at texture slot first_slot (uses three slots) and uploads the grid uniforms
+		void bind(Shader* shader, Camera* camera, int first_slot);
+
+	private:
+		struct ClusterLight {
+			int cluster;
+			int light;
+		};
+
+		std::vector<Vector4> light_data;
+		std::vector<unsigned int> grid; //offset and count of each cluster in the light index list
+		std::vector<unsigned int> light_indices;
+		std::vector<ClusterLight> cluster_lights;
+		std::vector<int> cluster_count;
+
+		unsigned int buffers[3];
+		unsigned int textures[3];
+
+		void upload(int index, unsigned int internal_format, const void* data, size_t size);
+	};
+
+};
@@ -1,6 +1,7 @@
 #include "fbo.h"
 #include <cassert>
 #include "utils.h"
+#include "glstate.h"
 
 FBO::FBO()
 {
@@ -14,13 +15,17 @@ FBO::FBO()
 	owns_textures = false;
 	width = 0;
 	height = 0;
+	memset(previous_viewport, 0, sizeof(previous_viewport));
 }
 
 FBO::~FBO()
 {
 	freeTextures();
 	if (fbo_id)
+	{
 		glDeleteFramebuffers(1, &fbo_id);
+		GLState::invalidate(GLState::FRAMEBUFFER); //its id can be reused
+	}
 	if (renderbuffer_color)
 		glDeleteRenderbuffersEXT(1, &renderbuffer_color);
 	if (renderbuffer_depth)
@@ -64,7 +69,7 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 	for (int i = 0; i < num_textures; ++i)
 	{
 		Texture* colortex = textures[i] = new Texture(width, height, format, type, false); //,NULL, format == GL_RGBA ? GL_RGBA8 : GL_RGB8 
-		glBindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
+		GLState::bindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	//set the min filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   //set the mag filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -116,7 +121,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 	//create and bind FBO
 	if(fbo_id == 0)
 		glGenFramebuffersEXT(1, &fbo_id);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	GLState::bindFramebuffer(GL_FRAMEBUFFER, fbo_id);
 	checkGLErrors();
 
 	if (depth_texture)
@@ -186,7 +191,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 		assert(0);
 		return false;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	checkGLErrors();
 	return true;
@@ -199,7 +204,7 @@ bool FBO::setDepthOnly(int width, int height)
 	num_color_textures = 0;
 
 	glGenFramebuffersEXT(1, &fbo_id);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	GLState::bindFramebuffer(GL_FRAMEBUFFER, fbo_id);
 
 	glGenRenderbuffersEXT(1, &renderbuffer_color);
 	glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, renderbuffer_color);
@@ -217,7 +222,7 @@ bool FBO::setDepthOnly(int width, int height)
 		std::cout << "Error: Framebuffer object is not completed" << std::endl;
 		return false;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
 	return true;
 }
 
@@ -226,11 +231,11 @@ void FBO::bind()
 	assert(glGetError() == GL_NO_ERROR);
 	Texture* tex = color_textures[0] ? color_textures[0] : depth_texture;
 	assert(tex && "framebuffer without texture");
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	GLState::bindFramebuffer(GL_FRAMEBUFFER, fbo_id);
 	checkGLErrors();
-	glPushAttrib(GL_VIEWPORT_BIT);
+	GLState::getViewport(previous_viewport);
 	glDrawBuffers(4, bufs);
-	glViewport(0, 0, (int)tex->width, (int)tex->height);
+	GLState::viewport(0, 0, (int)tex->width, (int)tex->height);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
@@ -239,8 +244,8 @@ GLenum one_buffer = GL_BACK;
 void FBO::unbind()
 {
 	// output goes to the FBO and its attached buffers
-	glPopAttrib();
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::viewport(previous_viewport[0], previous_viewport[1], previous_viewport[2], previous_viewport[3]);
+	GLState::bindFramebuffer(GL_FRAMEBUFFER, 0);
 	//glDrawBuffers(1, &one_buffer);
 	assert(glGetError() == GL_NO_ERROR);
 }
@@ -21,6 +21,8 @@ public:
 	GLuint renderbuffer_color;
 	GLuint renderbuffer_depth;//not used
 
+	int previous_viewport[4]; //restored by unbind
+
 	FBO();
 	~FBO();
 
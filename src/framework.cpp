@@ -4,12 +4,19 @@
 
 #include <cassert>
 #include <cmath> //for sqrt (square root) function
+#include <cfloat>
 #include <math.h> //atan2
 #include <vector>
 #include <cstring>
 #include <algorithm>
 #include <iostream>
 
+//SIMD versions of the matrix operations (SSE2 is always available in x86-64 and in the x86 targets we build)
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	#define MATH_SIMD
+	#include <emmintrin.h>
+#endif
+
 #define M_PI_2 1.57079632679489661923
 
 using namespace std;
@@ -301,7 +308,7 @@ void Matrix44::setTranslation(float x, float y, float z)
 	m[14] = z;
 }
 
-Vector3 Matrix44::getTranslation()
+Vector3 Matrix44::getTranslation() const
 {
 	return Vector3(m[12],m[13],m[14]);
 }
@@ -448,8 +455,51 @@ Vector3 Matrix44::project(const Vector3& v)
 }
 
 
+#ifdef MATH_SIMD
+//Each row of the result is a combination of the rows of the second matrix (same operations and order as the scalar loop)
+static inline void multiplyMatricesSSE(const float* a, const float* b, float* result)
+{
+	__m128 b0 = _mm_loadu_ps(b);
+	__m128 b1 = _mm_loadu_ps(b + 4);
+	__m128 b2 = _mm_loadu_ps(b + 8);
+	__m128 b3 = _mm_loadu_ps(b + 12);
+	for (int i = 0; i < 4; ++i)
+	{
+		const float* row = a + i * 4;
+		__m128 r = _mm_mul_ps(_mm_set1_ps(row[0]), b0);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(row[1]), b1));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(row[2]), b2));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(row[3]), b3));
+		_mm_storeu_ps(result + i * 4, r);
+	}
+}
+#endif
+
 //Multiply a matrix by another and returns the result
 Matrix44 Matrix44::operator*(const Matrix44& matrix) const
+{
+#ifdef MATH_SIMD
+	Matrix44 ret;
+	multiplyMatricesSSE(m, matrix.m, ret.m);
+	return ret;
+#else
+	return multiplyScalar(matrix);
+#endif
+}
+
+void multiplyMatrices(const Matrix44* a, const Matrix44* b, Matrix44* result, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+#ifdef MATH_SIMD
+		multiplyMatricesSSE(a[i].m, b[i].m, result[i].m);
+#else
+		result[i] = a[i].multiplyScalar(b[i]);
+#endif
+	}
+}
+
+Matrix44 Matrix44::multiplyScalar(const Matrix44& matrix) const
 {
 	Matrix44 ret;
 
@@ -559,7 +609,98 @@ void Matrix44::setFrontAndOrthonormalize(Vector3 front)
 	
 }
 
+#ifdef MATH_SIMD
+#define SHUFFLE_MASK(x, y, z, w) ((x) | ((y) << 2) | ((z) << 4) | ((w) << 6))
+#define SWIZZLE(v, x, y, z, w) _mm_castsi128_ps(_mm_shuffle_epi32(_mm_castps_si128(v), SHUFFLE_MASK(x, y, z, w)))
+#define SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps(a, b, SHUFFLE_MASK(x, y, z, w))
+
+//2x2 matrices stored in a vector as (m00, m01, m10, m11)
+static inline __m128 mat2Mul(__m128 a, __m128 b) //A * B
+{
+	return _mm_add_ps(_mm_mul_ps(a, SWIZZLE(b, 0, 3, 0, 3)), _mm_mul_ps(SWIZZLE(a, 1, 0, 3, 2), SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+static inline __m128 mat2AdjMul(__m128 a, __m128 b) //adjugate(A) * B
+{
+	return _mm_sub_ps(_mm_mul_ps(SWIZZLE(a, 3, 3, 0, 0), b), _mm_mul_ps(SWIZZLE(a, 1, 1, 2, 2), SWIZZLE(b, 2, 3, 0, 1)));
+}
+
+static inline __m128 mat2MulAdj(__m128 a, __m128 b) //A * adjugate(B)
+{
+	return _mm_sub_ps(_mm_mul_ps(a, SWIZZLE(b, 3, 0, 3, 0)), _mm_mul_ps(SWIZZLE(a, 1, 0, 3, 2), SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+//Inverse by cofactors, splitting the matrix in four 2x2 blocks | A B ; C D |
+//(the inverse of the transpose is the transpose of the inverse, so it works with the rows as they are stored)
+//Returns false, without writing the result, if the matrix is singular
+static bool inverseSSE(const float* m, float* result)
+{
+	__m128 row0 = _mm_loadu_ps(m);
+	__m128 row1 = _mm_loadu_ps(m + 4);
+	__m128 row2 = _mm_loadu_ps(m + 8);
+	__m128 row3 = _mm_loadu_ps(m + 12);
+
+	__m128 A = _mm_movelh_ps(row0, row1);
+	__m128 B = _mm_movehl_ps(row1, row0);
+	__m128 C = _mm_movelh_ps(row2, row3);
+	__m128 D = _mm_movehl_ps(row3, row2);
+
+	//determinants of the blocks (|A|, |B|, |C|, |D|)
+	__m128 det_sub = _mm_sub_ps(
+		_mm_mul_ps(SHUFFLE(row0, row2, 0, 2, 0, 2), SHUFFLE(row1, row3, 1, 3, 1, 3)),
+		_mm_mul_ps(SHUFFLE(row0, row2, 1, 3, 1, 3), SHUFFLE(row1, row3, 0, 2, 0, 2)));
+	__m128 det_A = SWIZZLE(det_sub, 0, 0, 0, 0);
+	__m128 det_B = SWIZZLE(det_sub, 1, 1, 1, 1);
+	__m128 det_C = SWIZZLE(det_sub, 2, 2, 2, 2);
+	__m128 det_D = SWIZZLE(det_sub, 3, 3, 3, 3);
+
+	__m128 D_C = mat2AdjMul(D, C);
+	__m128 A_B = mat2AdjMul(A, B);
+	__m128 X = _mm_sub_ps(_mm_mul_ps(det_D, A), mat2Mul(B, D_C));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(det_A, D), mat2Mul(C, A_B));
+	__m128 Y = _mm_sub_ps(_mm_mul_ps(det_B, C), mat2MulAdj(D, A_B));
+	__m128 Z = _mm_sub_ps(_mm_mul_ps(det_C, B), mat2MulAdj(A, D_C));
+
+	//|M| = |A||D| + |B||C| - trace(adj(A)B adj(D)C)
+	__m128 trace = _mm_mul_ps(A_B, SWIZZLE(D_C, 0, 2, 1, 3));
+	trace = _mm_add_ps(trace, SWIZZLE(trace, 2, 3, 0, 1));
+	trace = _mm_add_ps(trace, SWIZZLE(trace, 1, 0, 3, 2));
+	__m128 det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(det_A, det_D), _mm_mul_ps(det_B, det_C)), trace);
+
+	//the reciprocal would overflow
+	float det_value = _mm_cvtss_f32(det);
+	if (fabsf(det_value) < FLT_MIN || !std::isfinite(det_value))
+		return false;
+
+	__m128 inv_det = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), det);
+	X = _mm_mul_ps(X, inv_det);
+	Y = _mm_mul_ps(Y, inv_det);
+	Z = _mm_mul_ps(Z, inv_det);
+	W = _mm_mul_ps(W, inv_det);
+
+	//adjugate of the blocks and back to rows
+	_mm_storeu_ps(result, SHUFFLE(X, Y, 3, 1, 3, 1));
+	_mm_storeu_ps(result + 4, SHUFFLE(X, Y, 2, 0, 2, 0));
+	_mm_storeu_ps(result + 8, SHUFFLE(Z, W, 3, 1, 3, 1));
+	_mm_storeu_ps(result + 12, SHUFFLE(Z, W, 2, 0, 2, 0));
+	return true;
+}
+
+#undef SHUFFLE
+#undef SWIZZLE
+#undef SHUFFLE_MASK
+#endif
+
 bool Matrix44::inverse()
+{
+#ifdef MATH_SIMD
+	return inverseSSE(m, m);
+#else
+	return inverseScalar();
+#endif
+}
+
+bool Matrix44::inverseScalar()
 {
    unsigned int i, j, k, swap;
    float t;
@@ -1320,10 +1461,47 @@ float signedDistanceToPlane( const Vector4& plane, const Vector3& point )
 
 const Vector3 corners[] = { {1,1,1},  {1,1,-1},  {1,-1,1},  {1,-1,-1},  {-1,1,1},  {-1,1,-1},  {-1,-1,1},  {-1,-1,-1} };
 
+//Arvo's method: the center is transformed as a point and each axis of the new halfsize is the sum of the halfsizes
+//scaled by the absolute values of the matrix (no need to transform the eight corners)
 BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
 {
-	Vector3 box_min(10000000.0f,1000000.0f, 1000000.0f);
-	Vector3 box_max(-10000000.0f, -1000000.0f, -1000000.0f);
+#ifdef MATH_SIMD
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	__m128 row0 = _mm_loadu_ps(m.m);
+	__m128 row1 = _mm_loadu_ps(m.m + 4);
+	__m128 row2 = _mm_loadu_ps(m.m + 8);
+	__m128 row3 = _mm_loadu_ps(m.m + 12);
+
+	__m128 center = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(row0, _mm_set1_ps(box.center.x)), _mm_mul_ps(row1, _mm_set1_ps(box.center.y))), _mm_mul_ps(row2, _mm_set1_ps(box.center.z))), row3);
+	__m128 halfsize = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_andnot_ps(sign_mask, row0), _mm_set1_ps(box.halfsize.x)),
+		_mm_mul_ps(_mm_andnot_ps(sign_mask, row1), _mm_set1_ps(box.halfsize.y))),
+		_mm_mul_ps(_mm_andnot_ps(sign_mask, row2), _mm_set1_ps(box.halfsize.z)));
+
+	float c[4], h[4];
+	_mm_storeu_ps(c, center);
+	_mm_storeu_ps(h, halfsize);
+	return BoundingBox(Vector3(c[0], c[1], c[2]), Vector3(h[0], h[1], h[2]));
+#else
+	Vector3 center = m * box.center;
+	Vector3 halfsize;
+	halfsize.x = fabsf(m.m[0]) * box.halfsize.x + fabsf(m.m[4]) * box.halfsize.y + fabsf(m.m[8]) * box.halfsize.z;
+	halfsize.y = fabsf(m.m[1]) * box.halfsize.x + fabsf(m.m[5]) * box.halfsize.y + fabsf(m.m[9]) * box.halfsize.z;
+	halfsize.z = fabsf(m.m[2]) * box.halfsize.x + fabsf(m.m[6]) * box.halfsize.y + fabsf(m.m[10]) * box.halfsize.z;
+	return BoundingBox(center, halfsize);
+#endif
+}
+
+void transformBoundingBoxes(const Matrix44* m, const BoundingBox* boxes, BoundingBox* result, int count)
+{
+	for (int i = 0; i < count; ++i)
+		result[i] = transformBoundingBox(m[i], boxes[i]);
+}
+
+BoundingBox transformBoundingBoxScalar(const Matrix44& m, const BoundingBox& box)
+{
+	Vector3 box_min(10000000.0f, 10000000.0f, 10000000.0f);
+	Vector3 box_max(-10000000.0f, -10000000.0f, -10000000.0f);
 
 	for (int i = 0; i < 8; ++i)
 	{
@@ -1339,6 +1517,40 @@ BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
 	return BoundingBox(box_max - halfsize, halfsize );
 }
 
+void BoundingBoxArray::clear()
+{
+	center_x.clear(); center_y.clear(); center_z.clear();
+	halfsize_x.clear(); halfsize_y.clear(); halfsize_z.clear();
+}
+
+void BoundingBoxArray::resize(int size)
+{
+	center_x.resize(size); center_y.resize(size); center_z.resize(size);
+	halfsize_x.resize(size); halfsize_y.resize(size); halfsize_z.resize(size);
+}
+
+void BoundingBoxArray::push_back(const BoundingBox& box)
+{
+	center_x.push_back(box.center.x); center_y.push_back(box.center.y); center_z.push_back(box.center.z);
+	halfsize_x.push_back(box.halfsize.x); halfsize_y.push_back(box.halfsize.y); halfsize_z.push_back(box.halfsize.z);
+}
+
+void BoundingBoxArray::set(int index, const BoundingBox& box)
+{
+	center_x[index] = box.center.x; center_y[index] = box.center.y; center_z[index] = box.center.z;
+	halfsize_x[index] = box.halfsize.x; halfsize_y[index] = box.halfsize.y; halfsize_z[index] = box.halfsize.z;
+}
+
+void BoundingBoxArray::append(const BoundingBoxArray& other)
+{
+	center_x.insert(center_x.end(), other.center_x.begin(), other.center_x.end());
+	center_y.insert(center_y.end(), other.center_y.begin(), other.center_y.end());
+	center_z.insert(center_z.end(), other.center_z.begin(), other.center_z.end());
+	halfsize_x.insert(halfsize_x.end(), other.halfsize_x.begin(), other.halfsize_x.end());
+	halfsize_y.insert(halfsize_y.end(), other.halfsize_y.begin(), other.halfsize_y.end());
+	halfsize_z.insert(halfsize_z.end(), other.halfsize_z.begin(), other.halfsize_z.end());
+}
+
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b)
 {
 	BoundingBox result;
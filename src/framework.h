@@ -21,6 +21,7 @@ typedef unsigned short uint16;
 typedef short int16;
 typedef int int32;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 
 inline float clamp(float v, float a, float b) { return v < a ? a : (v > b ? b : v); }
 inline float lerp(float a, float b, float v ) { return a*(1.0f-v) + b*v; }
@@ -229,7 +230,7 @@ class Matrix44
 		Vector3 topVector() { return Vector3(m[4],m[5],m[6]); }
 		Vector3 frontVector() { return Vector3(m[8],m[9],m[10]); }
 
-		bool inverse();
+		bool inverse(); //SIMD (cofactors of 2x2 blocks) when available
 		void setUpAndOrthonormalize(Vector3 up);
 		void setFrontAndOrthonormalize(Vector3 front);
 
@@ -252,7 +253,7 @@ class Matrix44
 		void setRotation( float angle_in_rad, const Vector3& axis );
 		void setScale(float x, float y, float z);
 
-		Vector3 getTranslation();
+		Vector3 getTranslation() const;
 
 		bool getXYZ(float* euler) const;
 
@@ -266,9 +267,16 @@ class Matrix44
 		void multGL();
 		void loadGL();
 
-		Matrix44 operator * (const Matrix44& matrix) const;
+		Matrix44 operator * (const Matrix44& matrix) const; //SIMD when available
+
+		//scalar versions (reference for the SIMD ones and fallback in other architectures)
+		Matrix44 multiplyScalar(const Matrix44& matrix) const;
+		bool inverseScalar(); //Gauss-Jordan elimination
 };
 
+//batch versions: result[i] = a[i] * b[i]
+void multiplyMatrices(const Matrix44* a, const Matrix44* b, Matrix44* result, int count);
+
 //Operators, they are our friends
 //Matrix44 operator * ( const Matrix44& a, const Matrix44& b );
 Vector3 operator * (const Matrix44& matrix, const Vector3& v);
@@ -364,6 +372,21 @@ public:
 	float getArea() { return halfsize.x * halfsize.y * halfsize.z * 2.0f; }
 };
 
+//Bounding boxes stored as separated arrays of components (structure of arrays), for the batch frustum tests
+class BoundingBoxArray
+{
+public:
+	std::vector<float> center_x, center_y, center_z;
+	std::vector<float> halfsize_x, halfsize_y, halfsize_z;
+
+	int size() const { return (int)center_x.size(); }
+	void clear();
+	void resize(int size);
+	void push_back(const BoundingBox& box);
+	void set(int index, const BoundingBox& box);
+	void append(const BoundingBoxArray& other);
+};
+
 class Ray
 {
 public:
@@ -373,7 +396,9 @@ public:
 
 //applies a transform to a AABB from object to world
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b);
-BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box);
+BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box); //Arvo's method (SIMD when available)
+BoundingBox transformBoundingBoxScalar(const Matrix44& m, const BoundingBox& box); //transforms the eight corners
+void transformBoundingBoxes(const Matrix44* m, const BoundingBox* boxes, BoundingBox* result, int count); //result[i] = transformBoundingBox(m[i], boxes[i])
 
 float signedDistanceToPlane(const Vector4& plane, const Vector3& point);
 int planeBoxOverlap( const Vector4& plane, const Vector3& center, const Vector3& halfsize );
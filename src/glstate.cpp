@@ -0,0 +1,341 @@
+#include "glstate.h"
+#include <cstring>
+#include <iostream>
+
+static const int UNKNOWN = -1; //the cache doesn't know the value, the next call must reach GL
+
+int GLState::changes[NUM_CATEGORIES] = {};
+int GLState::skipped[NUM_CATEGORIES] = {};
+int GLState::last_frame_changes[NUM_CATEGORIES] = {};
+int GLState::last_frame_skipped[NUM_CATEGORIES] = {};
+int GLState::validation_errors = 0;
+bool GLState::validation = false;
+
+//Capabilities and texture targets with a cached state
+static const GLenum capabilities[] = { GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST, GL_SCISSOR_TEST };
+static const int NUM_CAPABILITIES = sizeof(capabilities) / sizeof(GLenum);
+static const GLenum texture_targets[] = { GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_3D, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BUFFER };
+static const GLenum texture_target_bindings[] = { GL_TEXTURE_BINDING_2D, GL_TEXTURE_BINDING_CUBE_MAP, GL_TEXTURE_BINDING_3D, GL_TEXTURE_BINDING_2D_ARRAY, GL_TEXTURE_BINDING_BUFFER };
+static const int NUM_TEXTURE_TARGETS = sizeof(texture_targets) / sizeof(GLenum);
+
+//The cached state (everything starts unknown)
+static int enabled_capabilities[NUM_CAPABILITIES] = { UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN };
+static int depth_func = UNKNOWN;
+static int depth_mask = UNKNOWN;
+static int blend_src = UNKNOWN;
+static int blend_dst = UNKNOWN;
+static int scissor_box[4] = { UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN }; //a negative width never matches a real box
+static int viewport_box[4] = { UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN };
+static int current_program = UNKNOWN;
+static int active_unit = UNKNOWN;
+static int bound_textures[GLState::MAX_TEXTURE_UNITS][NUM_TEXTURE_TARGETS];
+static int draw_framebuffer = UNKNOWN;
+static int read_framebuffer = UNKNOWN;
+static int vertex_array = UNKNOWN;
+static bool textures_known = false; //bound_textures has been filled with UNKNOWN
+
+static int getCapabilityIndex(GLenum capability)
+{
+	for (int i = 0; i < NUM_CAPABILITIES; ++i)
+		if (capabilities[i] == capability)
+			return i;
+	return -1;
+}
+
+static int getTextureTargetIndex(GLenum target)
+{
+	for (int i = 0; i < NUM_TEXTURE_TARGETS; ++i)
+		if (texture_targets[i] == target)
+			return i;
+	return -1;
+}
+
+//Records the value and returns true if it has to reach GL
+static bool updateState(int& cached, int value, GLState::eCategory category)
+{
+	if (GLState::validation)
+		GLState::validate(category);
+	if (cached == value)
+	{
+		GLState::skipped[category]++;
+		return false;
+	}
+	cached = value;
+	GLState::changes[category]++;
+	return true;
+}
+
+static bool updateBox(int* cached, int x, int y, int width, int height, GLState::eCategory category)
+{
+	if (GLState::validation)
+		GLState::validate(category);
+	int box[4] = { x, y, width, height };
+	if (memcmp(cached, box, sizeof(box)) == 0)
+	{
+		GLState::skipped[category]++;
+		return false;
+	}
+	memcpy(cached, box, sizeof(box));
+	GLState::changes[category]++;
+	return true;
+}
+
+static void setActiveUnit(int unit)
+{
+	if (active_unit == unit)
+		return;
+	glActiveTexture(GL_TEXTURE0 + unit);
+	active_unit = unit;
+	GLState::changes[GLState::TEXTURE]++;
+}
+
+const char* GLState::getCategoryName(int category)
+{
+	static const char* names[NUM_CATEGORIES] = { "Capabilities", "Depth", "Blend function", "Scissor", "Viewport", "Program", "Textures", "Framebuffer", "Vertex array" };
+	return names[category];
+}
+
+void GLState::setEnabled(GLenum capability, bool enabled)
+{
+	//capabilities without a cached state always reach GL
+	int index = getCapabilityIndex(capability);
+	if (index == -1)
+		changes[CAPABILITY]++;
+	else if (!updateState(enabled_capabilities[index], enabled, CAPABILITY))
+		return;
+
+	if (enabled) glEnable(capability);
+	else glDisable(capability);
+}
+
+void GLState::depthFunc(GLenum func)
+{
+	if (updateState(depth_func, func, DEPTH))
+		glDepthFunc(func);
+}
+
+void GLState::depthMask(bool mask)
+{
+	if (updateState(depth_mask, mask, DEPTH))
+		glDepthMask(mask);
+}
+
+void GLState::blendFunc(GLenum src, GLenum dst)
+{
+	if (validation)
+		validate(BLEND_FUNC);
+	if (blend_src == (int)src && blend_dst == (int)dst)
+	{
+		skipped[BLEND_FUNC]++;
+		return;
+	}
+	blend_src = src;
+	blend_dst = dst;
+	changes[BLEND_FUNC]++;
+	glBlendFunc(src, dst);
+}
+
+void GLState::scissor(int x, int y, int width, int height)
+{
+	if (updateBox(scissor_box, x, y, width, height, SCISSOR))
+		glScissor(x, y, width, height);
+}
+
+void GLState::viewport(int x, int y, int width, int height)
+{
+	if (updateBox(viewport_box, x, y, width, height, VIEWPORT))
+		glViewport(x, y, width, height);
+}
+
+void GLState::getViewport(int* viewport)
+{
+	if (viewport_box[2] == UNKNOWN)
+		glGetIntegerv(GL_VIEWPORT, viewport_box);
+	memcpy(viewport, viewport_box, sizeof(viewport_box));
+}
+
+void GLState::useProgram(GLuint program)
+{
+	if (updateState(current_program, program, PROGRAM))
+		glUseProgram(program);
+}
+
+void GLState::bindTexture(int unit, GLenum target, GLuint texture)
+{
+	if (!textures_known)
+		invalidate(TEXTURE);
+
+	int target_index = getTextureTargetIndex(target);
+	if (unit >= MAX_TEXTURE_UNITS || target_index == -1)
+	{
+		setActiveUnit(unit);
+		glBindTexture(target, texture);
+		changes[TEXTURE]++;
+		return;
+	}
+
+	//the active unit is only changed when the binding does
+	if (validation)
+		validate(TEXTURE);
+	int& bound = bound_textures[unit][target_index];
+	if (bound == (int)texture)
+	{
+		skipped[TEXTURE]++;
+		return;
+	}
+	setActiveUnit(unit);
+	glBindTexture(target, texture);
+	bound = texture;
+	changes[TEXTURE]++;
+}
+
+void GLState::bindTexture(GLenum target, GLuint texture)
+{
+	if (active_unit == UNKNOWN)
+	{
+		GLint unit = 0;
+		glGetIntegerv(GL_ACTIVE_TEXTURE, &unit);
+		active_unit = unit - GL_TEXTURE0;
+	}
+	bindTexture(active_unit, target, texture);
+}
+
+void GLState::bindFramebuffer(GLenum target, GLuint framebuffer)
+{
+	if (validation)
+		validate(FRAMEBUFFER);
+	bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+	bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+	if ((!draw || draw_framebuffer == (int)framebuffer) && (!read || read_framebuffer == (int)framebuffer))
+	{
+		skipped[FRAMEBUFFER]++;
+		return;
+	}
+	if (draw) draw_framebuffer = framebuffer;
+	if (read) read_framebuffer = framebuffer;
+	changes[FRAMEBUFFER]++;
+	glBindFramebuffer(target, framebuffer);
+}
+
+void GLState::bindVertexArray(GLuint vertex_array_id)
+{
+	if (updateState(vertex_array, vertex_array_id, VERTEX_ARRAY))
+		glBindVertexArray(vertex_array_id);
+}
+
+void GLState::invalidate(eCategory category)
+{
+	switch (category)
+	{
+	case CAPABILITY:
+		for (int i = 0; i < NUM_CAPABILITIES; ++i)
+			enabled_capabilities[i] = UNKNOWN;
+		break;
+	case DEPTH: depth_func = depth_mask = UNKNOWN; break;
+	case BLEND_FUNC: blend_src = blend_dst = UNKNOWN; break;
+	case SCISSOR:
+	case VIEWPORT:
+		for (int i = 0; i < 4; ++i)
+			(category == SCISSOR ? scissor_box : viewport_box)[i] = UNKNOWN;
+		break;
+	case PROGRAM: current_program = UNKNOWN; break;
+	case TEXTURE:
+		active_unit = UNKNOWN;
+		for (int i = 0; i < MAX_TEXTURE_UNITS; ++i)
+			for (int j = 0; j < NUM_TEXTURE_TARGETS; ++j)
+				bound_textures[i][j] = UNKNOWN;
+		textures_known = true;
+		break;
+	case FRAMEBUFFER: draw_framebuffer = read_framebuffer = UNKNOWN; break;
+	case VERTEX_ARRAY: vertex_array = UNKNOWN; break;
+	default: break;
+	}
+}
+
+//Compares a known value with the one of GL
+static int compareState(int cached, GLenum name, int* gl_value = NULL)
+{
+	if (cached == UNKNOWN)
+		return 0;
+	GLint value = 0;
+	glGetIntegerv(name, &value);
+	if (gl_value)
+		*gl_value = value;
+	return cached != value ? 1 : 0;
+}
+
+int GLState::validate(eCategory category)
+{
+	int errors = 0;
+	switch (category)
+	{
+	case CAPABILITY:
+		for (int i = 0; i < NUM_CAPABILITIES; ++i)
+			if (enabled_capabilities[i] != UNKNOWN && enabled_capabilities[i] != (int)glIsEnabled(capabilities[i]))
+				errors++;
+		break;
+	case DEPTH:
+		errors += compareState(depth_func, GL_DEPTH_FUNC);
+		errors += compareState(depth_mask, GL_DEPTH_WRITEMASK);
+		break;
+	case BLEND_FUNC:
+		errors += compareState(blend_src, GL_BLEND_SRC_RGB);
+		errors += compareState(blend_dst, GL_BLEND_DST_RGB);
+		break;
+	case SCISSOR:
+	case VIEWPORT:
+	{
+		int* cached = category == SCISSOR ? scissor_box : viewport_box;
+		GLint box[4];
+		glGetIntegerv(category == SCISSOR ? GL_SCISSOR_BOX : GL_VIEWPORT, box);
+		if (cached[2] != UNKNOWN && memcmp(cached, box, sizeof(box)) != 0)
+			errors++;
+		break;
+	}
+	case PROGRAM: errors += compareState(current_program, GL_CURRENT_PROGRAM); break;
+	case TEXTURE:
+	{
+		if (!textures_known)
+			break;
+		GLint unit = 0;
+		glGetIntegerv(GL_ACTIVE_TEXTURE, &unit);
+		if (active_unit != UNKNOWN && active_unit != unit - GL_TEXTURE0)
+			errors++;
+		for (int i = 0; i < MAX_TEXTURE_UNITS; ++i)
+			for (int j = 0; j < NUM_TEXTURE_TARGETS; ++j)
+				if (bound_textures[i][j] != UNKNOWN)
+				{
+					glActiveTexture(GL_TEXTURE0 + i);
+					errors += compareState(bound_textures[i][j], texture_target_bindings[j]);
+				}
+		glActiveTexture(unit);
+		break;
+	}
+	case FRAMEBUFFER:
+		errors += compareState(draw_framebuffer, GL_DRAW_FRAMEBUFFER_BINDING);
+		errors += compareState(read_framebuffer, GL_READ_FRAMEBUFFER_BINDING);
+		break;
+	case VERTEX_ARRAY: errors += compareState(vertex_array, GL_VERTEX_ARRAY_BINDING); break;
+	default: break;
+	}
+
+	if (errors)
+	{
+		std::cout << "GL state cache: " << getCategoryName(category) << " changed without going through the cache" << std::endl;
+		validation_errors += errors;
+		invalidate(category);
+	}
+	return errors;
+}
+
+void GLState::resetStats()
+{
+	if (validation)
+		for (int i = 0; i < NUM_CATEGORIES; ++i)
+			validate((eCategory)i);
+
+	memcpy(last_frame_changes, changes, sizeof(changes));
+	memcpy(last_frame_skipped, skipped, sizeof(skipped));
+	memset(changes, 0, sizeof(changes));
+	memset(skipped, 0, sizeof(skipped));
+}
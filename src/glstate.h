@@ -0,0 +1,59 @@
+#pragma once
+#include "includes.h"
+
+//Mirror of the GL state that changes between draw calls, so only the real changes reach the driver.
+//The engine changes that state only through here (ImGui saves and restores what it touches). Code that changes it
+//behind the cache (indexed viewports, deleted objects) must invalidate the category, then the next call always reaches GL.
+//The validation mode compares the cache against glGet* before every call and at the end of the frame.
+class GLState
+{
+public:
+	enum eCategory {
+		CAPABILITY, //GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST and GL_SCISSOR_TEST
+		DEPTH, //depth function and depth mask
+		BLEND_FUNC,
+		SCISSOR,
+		VIEWPORT,
+		PROGRAM,
+		TEXTURE, //active unit and the texture of each unit and target
+		FRAMEBUFFER,
+		VERTEX_ARRAY,
+		NUM_CATEGORIES
+	};
+	static const int MAX_TEXTURE_UNITS = 16;
+
+	//Stats: calls that reached the driver and calls filtered by the cache
+	static int changes[NUM_CATEGORIES];
+	static int skipped[NUM_CATEGORIES];
+	static int last_frame_changes[NUM_CATEGORIES];
+	static int last_frame_skipped[NUM_CATEGORIES];
+	static int validation_errors; //since the start
+
+	static bool validation; //very slow, every call reads the state back from GL
+
+	static const char* getCategoryName(int category);
+
+	static void setEnabled(GLenum capability, bool enabled);
+	static void enable(GLenum capability) { setEnabled(capability, true); }
+	static void disable(GLenum capability) { setEnabled(capability, false); }
+	static void depthFunc(GLenum func);
+	static void depthMask(bool mask);
+	static void blendFunc(GLenum src, GLenum dst);
+	static void scissor(int x, int y, int width, int height);
+	static void viewport(int x, int y, int width, int height);
+	static void getViewport(int* viewport); //x, y, width and height (read from GL if unknown)
+	static void useProgram(GLuint program);
+	static void bindTexture(int unit, GLenum target, GLuint texture);
+	static void bindTexture(GLenum target, GLuint texture); //to the active unit (creation and uploads of textures)
+	static void bindFramebuffer(GLenum target, GLuint framebuffer); //GL_FRAMEBUFFER binds the draw and the read ones
+	static void bindVertexArray(GLuint vertex_array);
+
+	//Forgets the state of a category
+	static void invalidate(eCategory category);
+
+	//Compares the known state of a category with the one of GL, returns the number of differences (and forgets them)
+	static int validate(eCategory category);
+
+	//Keeps the stats of the last frame and starts counting again (and validates every category in validation mode)
+	static void resetStats();
+};
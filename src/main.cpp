@@ -17,8 +17,11 @@
 #include "application.h"
 #include "scene.h"
 #include "task.h"
+#include "glstate.h"
+#include "transformstest.h"
 
 #include <iostream> //to output
+#include <cstring>
 
 long last_time = 0; //this is used to calcule the elapsed time between frames
 
@@ -113,7 +116,7 @@ void renderDebug(SDL_Window* window, Application * app)
 	// Rendering
 	ImGui::EndFrame();
 	ImGui::Render();
-	glViewport(0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y);
+	GLState::viewport(0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y);
 	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 	#endif
 }
@@ -215,6 +218,11 @@ void mainLoop(SDL_Window* window)
 
 int main(int argc, char **argv)
 {
+	//Checks of the SIMD math against the scalar code, without opening the window (exits with 1 if any result differs)
+	for (int i = 1; i < argc; ++i)
+		if (strcmp(argv[i], "--test-transforms") == 0)
+			return testTransforms() ? 1 : 0;
+
 	std::cout << "Initiating app..." << std::endl;
 
 	//prepare SDL
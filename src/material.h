@@ -41,6 +41,8 @@ namespace GTR {
 		static std::map<std::string, Material*> sMaterials;
 		static Material* Get(const char* name);
 		std::string name;
+		static int s_MaterialID;
+		int m_Id; //used to batch render calls that share the material
 		void registerMaterial(const char* name);
 
 		//parameters to control transparency
@@ -65,7 +67,7 @@ namespace GTR {
 		Sampler normal_texture;	//normalmap
 
 		//ctors
-		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
+		Material() : m_Id(s_MaterialID++), alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
 		}
 		Material(Texture* texture) : Material() { color_texture.texture = texture; }
@@ -12,6 +12,7 @@
 
 #include "camera.h"
 #include "texture.h"
+#include "glstate.h"
 //#include "animation.h"
 #include "extra/coldet/coldet.h"
 
@@ -24,6 +25,7 @@ bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved arr
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+int Mesh::s_MeshID = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -32,8 +34,10 @@ long Mesh::num_triangles_rendered = 0;
 
 Mesh::Mesh()
 {
+	m_Id = s_MeshID++;
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	vao_id = instanced_vao_id = 0;
 	collision_model = NULL;
 
 	clear();
@@ -91,6 +95,7 @@ void Mesh::clear()
 
 	//VBOs ids
 	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	deleteVertexArrays();
 
 	//buffers
 	vertices.clear();
@@ -255,6 +260,91 @@ void Mesh::enableBuffers(Shader* sh)
 
 }
 
+void Mesh::bindAttributeLocations(unsigned int program)
+{
+	glBindAttribLocation(program, VERTEX_ATTRIBUTE, "a_vertex");
+	glBindAttribLocation(program, NORMAL_ATTRIBUTE, "a_normal");
+	glBindAttribLocation(program, UV_ATTRIBUTE, "a_coord");
+	glBindAttribLocation(program, UV1_ATTRIBUTE, "a_coord1");
+	glBindAttribLocation(program, COLOR_ATTRIBUTE, "a_color");
+	glBindAttribLocation(program, BONES_ATTRIBUTE, "a_bones");
+	glBindAttribLocation(program, WEIGHTS_ATTRIBUTE, "a_weights");
+	glBindAttribLocation(program, INSTANCE_MODEL_ATTRIBUTE, "u_model"); //only when it is an attribute (instancing)
+}
+
+//sets one attribute of the bound vertex array (a buffer of the mesh, or the interleaved one with its offset)
+static void setVertexAttribute(int location, unsigned int buffer_id, int size, GLenum type, int stride, size_t offset)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, buffer_id);
+	glEnableVertexAttribArray(location);
+	glVertexAttribPointer(location, size, type, GL_FALSE, stride, (void*)offset);
+}
+
+GLuint instances_buffer_id = 0; //shared by all the meshes, the instanced vertex arrays read it
+
+unsigned int Mesh::getVertexArray(bool instanced)
+{
+	if (!vertices_vbo_id && !interleaved_vbo_id)
+		return 0;
+
+	unsigned int& vao = instanced ? instanced_vao_id : vao_id;
+	if (vao)
+		return vao;
+
+	//the attributes are at the same locations in every shader, so enabling all the buffers of the mesh works with any of them
+	glGenVertexArrays(1, &vao);
+	GLState::bindVertexArray(vao);
+	if (interleaved_vbo_id)
+	{
+		int spacing = sizeof(tInterleaved);
+		setVertexAttribute(VERTEX_ATTRIBUTE, interleaved_vbo_id, 3, GL_FLOAT, spacing, 0);
+		setVertexAttribute(NORMAL_ATTRIBUTE, interleaved_vbo_id, 3, GL_FLOAT, spacing, sizeof(Vector3));
+		setVertexAttribute(UV_ATTRIBUTE, interleaved_vbo_id, 2, GL_FLOAT, spacing, sizeof(Vector3) + sizeof(Vector3));
+	}
+	else
+	{
+		setVertexAttribute(VERTEX_ATTRIBUTE, vertices_vbo_id, 3, GL_FLOAT, 0, 0);
+		if (normals_vbo_id) setVertexAttribute(NORMAL_ATTRIBUTE, normals_vbo_id, 3, GL_FLOAT, 0, 0);
+		if (uvs_vbo_id) setVertexAttribute(UV_ATTRIBUTE, uvs_vbo_id, 2, GL_FLOAT, 0, 0);
+	}
+	if (uvs1_vbo_id) setVertexAttribute(UV1_ATTRIBUTE, uvs1_vbo_id, 2, GL_FLOAT, 0, 0);
+	if (colors_vbo_id) setVertexAttribute(COLOR_ATTRIBUTE, colors_vbo_id, 4, GL_FLOAT, 0, 0);
+	if (bones_vbo_id) setVertexAttribute(BONES_ATTRIBUTE, bones_vbo_id, 4, GL_UNSIGNED_BYTE, 0, 0);
+	if (weights_vbo_id) setVertexAttribute(WEIGHTS_ATTRIBUTE, weights_vbo_id, 4, GL_FLOAT, 0, 0);
+
+	//mat4 count as 4 different attributes of vec4, one per instance
+	if (instanced)
+	{
+		assert(instances_buffer_id && "instanced models must be uploaded first");
+		for (int k = 0; k < 4; ++k)
+		{
+			setVertexAttribute(INSTANCE_MODEL_ATTRIBUTE + k, instances_buffer_id, 4, GL_FLOAT, sizeof(Matrix44), sizeof(float) * 4 * k);
+			glVertexAttribDivisor(INSTANCE_MODEL_ATTRIBUTE + k, 1);
+		}
+	}
+
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+
+	GLState::bindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	checkGLErrors();
+	return vao;
+}
+
+void Mesh::deleteVertexArrays()
+{
+	if (vao_id)
+		glDeleteVertexArrays(1, &vao_id);
+	if (instanced_vao_id)
+		glDeleteVertexArrays(1, &instanced_vao_id);
+	vao_id = instanced_vao_id = 0;
+	GLState::invalidate(GLState::VERTEX_ARRAY); //their ids can be reused
+}
+
+static bool vertex_array_bound = false; //the draw call finds the indices in the vertex array
+
 void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 {
     //return;
@@ -267,7 +357,20 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	}
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
-	//bind buffers to attribute locations
+	//meshes in VRAM only bind their vertex array (and leave it bound, the next mesh binds its own)
+	unsigned int vao = getVertexArray(num_instances > 0);
+	if (vao)
+	{
+		GLState::bindVertexArray(vao);
+		vertex_array_bound = true;
+		drawCall(primitive, submesh_id, num_instances);
+		vertex_array_bound = false;
+		checkGLErrors();
+		return;
+	}
+
+	//bind buffers to attribute locations (of the default vertex array, not the one of the last mesh)
+	GLState::bindVertexArray(0);
 	enableBuffers(shader);
 	checkGLErrors();
 
@@ -304,22 +407,18 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			if (!vertex_array_bound) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+			glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)), num_instances);
+			if (!vertex_array_bound) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
 		{
 			if (indices_vbo_id)
 			{
 				/*if (size != 90)*/ {
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+					if (!vertex_array_bound) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+					if (!vertex_array_bound) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
 			}
@@ -330,13 +429,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	else
 	{
 		if (num_instances > 0)
-		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-		}
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		else
 			glDrawArrays(primitive, start, size);
 	}
@@ -358,50 +451,70 @@ void Mesh::disableBuffers(Shader* shader)
 	checkGLErrors();
 }
 
-GLuint instances_buffer_id = 0;
-
 //should be faster but in some system it is slower
 void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
 {
 	if (!num_instances)
 		return;
 
-	#ifdef OPENGL_ES3
-		Shader* shader = Shader::current;
-		assert(shader && "shader must be enabled");
+	uploadInstancedModels(instanced_models, num_instances);
+	renderInstanced(primitive, num_instances);
+}
 
-		if (instances_buffer_id == 0)
-			glGenBuffersARB(1, &instances_buffer_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
+void Mesh::uploadInstancedModels(const Matrix44* instanced_models, int num_instances)
+{
+	if (instances_buffer_id == 0)
+		glGenBuffers(1, &instances_buffer_id);
+
+	//orphan the previous storage so we don't wait for draws that still read it
+	glBindBuffer(GL_ARRAY_BUFFER, instances_buffer_id);
+	glBufferData(GL_ARRAY_BUFFER, num_instances * sizeof(Matrix44), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, num_instances * sizeof(Matrix44), instanced_models);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-		int attribLocation = shader->getAttribLocation("u_model");
-		assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
-		if (attribLocation == -1)
-			return; //this shader doesnt support instanced model
+void Mesh::renderInstanced(unsigned int primitive, int num_instances)
+{
+	if (!num_instances)
+		return;
 
-		//mat4 count as 4 different attributes of vec4... (thanks opengl...)
-		for (int k = 0; k < 4; ++k)
-		{
-			glEnableVertexAttribArray(attribLocation + k );
-			int offset = sizeof(float) * 4 * k;
-			const Uint8* addr = (Uint8*) offset;
-			glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
-			glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
-		}
+	Shader* shader = Shader::current;
+	assert(shader && "shader must be enabled");
+	assert(instances_buffer_id && "instanced models must be uploaded first");
 
-		//regular render
-		render(primitive, 0, num_instances);
+	//the instanced vertex array already reads the instance buffer
+	if (getVertexArray(true))
+	{
+		render(primitive, -1, num_instances);
+		return;
+	}
 
-		//disable instanced attribs
-		for (int k = 0; k < 4; ++k)
-		{
-			glDisableVertexAttribArray(attribLocation + k);
-			glVertexAttribDivisor(attribLocation + k, 0);
-		}
-    #else
-		assert(0 && "not supported");
-    #endif
+	int attribLocation = shader->getAttribLocation("u_model");
+	assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
+	if (attribLocation == -1)
+		return; //this shader doesnt support instanced model
+
+	//mat4 count as 4 different attributes of vec4... (thanks opengl...)
+	GLState::bindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, instances_buffer_id);
+	for (int k = 0; k < 4; ++k)
+	{
+		glEnableVertexAttribArray(attribLocation + k );
+		int offset = sizeof(float) * 4 * k;
+		glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), (const void*)(size_t)offset);
+		glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//regular render
+	render(primitive, -1, num_instances);
+
+	//disable instanced attribs
+	for (int k = 0; k < 4; ++k)
+	{
+		glDisableVertexAttribArray(attribLocation + k);
+		glVertexAttribDivisor(attribLocation + k, 0);
+	}
 }
 
 //super obsolete rendering method, do not use
@@ -503,6 +616,9 @@ void Mesh::uploadToVRAM()
 {
 	assert(vertices.size() || interleaved.size());
 
+	//the vertex arrays are created again with the new buffers
+	deleteVertexArrays();
+
 	if (glGenBuffersARB == nullptr)
 	{
 		std::cout << "Error: your graphics cards dont support VBOs. Sorry." << std::endl;
@@ -579,7 +695,8 @@ void Mesh::uploadToVRAM()
 
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
-	// Indices
+	// Indices (the element buffer binding belongs to the bound vertex array)
+	GLState::bindVertexArray(0);
 	if (m_indices.size())
 	{
 		if (indices_vbo_id == 0)
@@ -1556,6 +1673,18 @@ Mesh* Mesh::getQuad()
 	return quad;
 }
 
+Mesh* Mesh::getCube()
+{
+	static Mesh* cube = NULL;
+	if (!cube)
+	{
+		cube = new Mesh();
+		cube->createCube();
+		cube->uploadToVRAM();
+	}
+	return cube;
+}
+
 Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 {
 	assert(filename);
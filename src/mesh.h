@@ -19,6 +19,18 @@ struct BoneInfo {
 	Matrix44 bind_pose;
 };
 
+//Attribute locations shared by all the shaders (bound before linking them), so the vertex arrays of a mesh work with any shader
+enum eAttributeLocation {
+	VERTEX_ATTRIBUTE = 0,
+	NORMAL_ATTRIBUTE = 1,
+	UV_ATTRIBUTE = 2,
+	UV1_ATTRIBUTE = 3,
+	COLOR_ATTRIBUTE = 4,
+	BONES_ATTRIBUTE = 5,
+	WEIGHTS_ATTRIBUTE = 6,
+	INSTANCE_MODEL_ATTRIBUTE = 8 //mat4, uses 4 locations
+};
+
 struct sSubmeshInfo
 {
 	char name[64];
@@ -36,8 +48,10 @@ public:
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static int s_MeshID;
 
 	std::string name;
+	int m_Id; //used to batch render calls that share the mesh
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
 
@@ -80,6 +94,10 @@ public:
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	//vertex array objects with all the buffers of the mesh bound, created on the first render from VRAM
+	unsigned int vao_id;
+	unsigned int instanced_vao_id; //also reads the models of the shared instance buffer
+
 	Mesh();
 	~Mesh();
 
@@ -87,6 +105,8 @@ public:
 
 	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0 );
 	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
+	void renderInstanced(unsigned int primitive, int number); //uses the models of the last uploadInstancedModels
+	static void uploadInstancedModels(const Matrix44* instanced_models, int number); //fills the shared instance stream buffer
 	void renderBounding( const Matrix44& model, bool world_bounding = true );
 	void renderFixedPipeline(int primitive); //sloooooooow
 	//void renderAnimated(unsigned int primitive, Skeleton *sk);
@@ -94,6 +114,9 @@ public:
 	void enableBuffers(Shader* shader);
 	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
 	void disableBuffers(Shader* shader);
+	unsigned int getVertexArray(bool instanced); //0 if the mesh is not in VRAM
+	void deleteVertexArrays();
+	static void bindAttributeLocations(unsigned int program); //must be called before linking the program
 
 	bool readBin(const char* filename, bool bFromNetwork);
 	bool writeBin(const char* filename);
@@ -122,6 +145,7 @@ public:
 	void createGrid(float dist);
 	void displace(Image* heightmap, float altitude);
 	static Mesh* getQuad(); //get global quad
+	static Mesh* getCube(); //get global solid cube (from -1 to 1)
 
 	void updateBoundingBox();
 
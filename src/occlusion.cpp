@@ -0,0 +1,135 @@
+#include "occlusion.h"
+#include "includes.h"
+#include "camera.h"
+#include "shader.h"
+#include "mesh.h"
+#include "renderlist.h"
+#include "glstate.h"
+#include <cmath>
+#include <algorithm>
+
+using namespace GTR;
+
+GTR::OcclusionCuller::OcclusionCuller()
+{
+	queries_issued = 0;
+	objects_culled = 0;
+	max_latency = 0;
+	frame = 0;
+}
+
+GTR::OcclusionCuller::~OcclusionCuller()
+{
+	reset();
+}
+
+void GTR::OcclusionCuller::reset()
+{
+	for (int i = 0; i < states.size(); ++i)
+		if (states[i].query)
+			glDeleteQueries(1, &states[i].query);
+	states.clear();
+}
+
+void GTR::OcclusionCuller::beginFrame(int num_calls)
+{
+	frame++;
+	queries_issued = 0;
+	objects_culled = 0;
+	max_latency = 0;
+
+	//The render calls changed: the indices don't identify the same objects anymore
+	if (num_calls != states.size())
+	{
+		reset();
+		State state;
+		state.query = 0;
+		state.pending = false;
+		state.occluded = false;
+		state.issue_frame = 0;
+		states.resize(num_calls, state);
+		return;
+	}
+
+	//Read the results that are ready, the rest keep their last visibility
+	for (int i = 0; i < states.size(); ++i)
+	{
+		State& state = states[i];
+		if (!state.pending)
+			continue;
+
+		GLuint available = 0;
+		glGetQueryObjectuiv(state.query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			continue;
+
+		GLuint any_samples = 0;
+		glGetQueryObjectuiv(state.query, GL_QUERY_RESULT, &any_samples);
+		state.occluded = any_samples == 0;
+		state.pending = false;
+		max_latency = std::max(max_latency, frame - state.issue_frame);
+	}
+
+	for (int i = 0; i < states.size(); ++i)
+		if (states[i].occluded)
+			objects_culled++;
+}
+
+void GTR::OcclusionCuller::issueQueries(const int* calls, int num_calls, const RenderList& render_list, Camera* camera)
+{
+	Shader* shader = Shader::Get("depth");
+	if (!shader)
+		return;
+
+	//Only the depth test matters: no color, no depth writes and both faces of the box
+	glColorMask(false, false, false, false);
+	GLState::depthMask(false);
+	GLState::depthFunc(GL_LEQUAL);
+	GLState::disable(GL_CULL_FACE);
+	GLState::disable(GL_BLEND);
+
+	shader->enable();
+	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setUniform("u_alpha_cutoff", 0.0f);
+	Mesh* cube = Mesh::getCube();
+	static const UniformID u_model("u_model"); //set for every query
+
+	for (int i = 0; i < num_calls; ++i)
+	{
+		int call = calls[i];
+		State& state = states[call];
+		if (state.pending)
+			continue;
+
+		//If the camera is inside the box (or so close that the near plane clips it) the box can't be used as a proxy
+		const BoundingBox& box = render_list.world_bounding_boxes[call];
+		Vector3 distance = camera->eye - box.center;
+		float margin = camera->near_plane * 2.0f;
+		if (fabs(distance.x) < box.halfsize.x + margin && fabs(distance.y) < box.halfsize.y + margin && fabs(distance.z) < box.halfsize.z + margin)
+		{
+			state.occluded = false;
+			continue;
+		}
+
+		Matrix44 box_model;
+		box_model.translate(box.center.x, box.center.y, box.center.z);
+		box_model.scale(box.halfsize.x, box.halfsize.y, box.halfsize.z);
+		shader->setUniform(u_model, box_model);
+
+		if (!state.query)
+			glGenQueries(1, &state.query);
+		glBeginQuery(GL_ANY_SAMPLES_PASSED, state.query);
+		cube->render(GL_TRIANGLES);
+		glEndQuery(GL_ANY_SAMPLES_PASSED);
+
+		state.pending = true;
+		state.issue_frame = frame;
+		queries_issued++;
+	}
+	shader->disable();
+
+	//set the render state as it was before to avoid problems with future renders
+	glColorMask(true, true, true, true);
+	GLState::depthMask(true);
+	GLState::depthFunc(GL_LESS);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+
+namespace GTR {
+
+	class RenderList;
+
+	//Hardware occlusion culling with temporal coherence.
+	//Every frame the bounding boxes of the candidate render calls are drawn against the depth of the opaque geometry inside
+	//GL_ANY_SAMPLES_PASSED queries. The results are read a frame later (never waiting for the GPU), and a call whose box was
+	//hidden is skipped until a later query finds its box visible again.
+	//Calls are identified by their index in the render list, which is stable while the scene doesn't change: if the number of
+	//calls changes, all the states are reset.
+	class OcclusionCuller
+	{
+	public:
+		//Stats of the last frame
+		int queries_issued;
+		int objects_culled;
+		int max_latency; //Frames between issuing a query and reading its result
+
+		OcclusionCuller();
+		~OcclusionCuller();
+
+		//Reads the results that are available. Must be called once per frame before isOccluded
+		void beginFrame(int num_calls);
+
+		//Whether the box of the call was hidden in the last result
+		bool isOccluded(int call) const { return call < states.size() && states[call].occluded; }
+
+		//Draws the boxes of the calls that have no query in flight, against the current depth buffer
+		void issueQueries(const int* calls, int num_calls, const RenderList& render_list, Camera* camera);
+
+		//Forgets all the results (everything is visible again)
+		void reset();
+
+	private:
+		struct State {
+			unsigned int query;
+			bool pending;
+			bool occluded;
+			int issue_frame;
+		};
+
+		std::vector<State> states;
+		int frame;
+	};
+
+};
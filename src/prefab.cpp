@@ -98,9 +98,12 @@ bool Node::testRay(const Ray& ray, Vector3& result, int layers, float max_dist)
 	Vector3 collision;
 	Vector3 normal;
 	bool collided = false;
+
+	//the parent has just updated its global matrix
+	getGlobalMatrix(true);
 	if (mesh)
 	{
-		collided = mesh->testRayCollision( getGlobalMatrix(), ray.origin, ray.direction, collision, normal, max_dist );
+		collided = mesh->testRayCollision( global_model, ray.origin, ray.direction, collision, normal, max_dist );
 		if (collided)
 			max_dist = ray.origin.distance(collision);
 	}
@@ -179,6 +182,7 @@ void Node::renderInMenu()
 
 Prefab::Prefab()
 {
+	version = 0;
 }
 
 Prefab::~Prefab()
@@ -218,6 +222,7 @@ Prefab* Prefab::Get(const char* filename)
 	std::string name = filename;
 	prefab->registerPrefab(name);
 	prefab->updateBounding();
+	prefab->flatten();
 	return prefab;
 }
 
@@ -236,6 +241,68 @@ Node* Prefab::getNodeByName(const char* name)
 }
 
 
+static void flattenInDepth(Prefab* prefab, Node* node, int parent)
+{
+	int index = (int)prefab->flat_nodes.size();
+	prefab->flat_nodes.push_back(node);
+	prefab->flat_parents.push_back(parent);
+	for (int i = 0; i < node->children.size(); ++i)
+		flattenInDepth(prefab, node->children[i], index);
+}
+
+void Prefab::flatten()
+{
+	flat_nodes.clear();
+	flat_parents.clear();
+	flattenInDepth(this, &root, -1);
+
+	//everything is dirty so the first update computes all the matrices
+	int num_nodes = (int)flat_nodes.size();
+	flat_local_models.resize(num_nodes);
+	flat_meshes.assign(num_nodes, NULL);
+	flat_local_visible.assign(num_nodes, 0);
+	flat_visible.assign(num_nodes, 0);
+	flat_dirty.assign(num_nodes, 1);
+	for (int i = 0; i < num_nodes; ++i)
+		flat_local_models[i] = flat_nodes[i]->model;
+	updateGlobalMatrices();
+}
+
+bool Prefab::updateGlobalMatrices()
+{
+	if (flat_nodes.empty())
+		flatten();
+
+	bool changed = false;
+	for (int i = 0; i < flat_nodes.size(); ++i)
+	{
+		Node* node = flat_nodes[i];
+		int parent = flat_parents[i];
+
+		//dirty if the node was edited or its parent was updated (parents are always processed before)
+		bool dirty = flat_dirty[i] || (parent != -1 && flat_dirty[parent]) || node->mesh != flat_meshes[i] || node->visible != (bool)flat_local_visible[i] ||
+			memcmp(node->model.m, flat_local_models[i].m, sizeof(Matrix44)) != 0;
+		if (!dirty)
+			continue;
+
+		flat_dirty[i] = 1;
+		flat_local_models[i] = node->model;
+		flat_meshes[i] = node->mesh;
+		flat_local_visible[i] = node->visible;
+		flat_visible[i] = node->visible && (parent == -1 || flat_visible[parent]);
+		node->global_model = parent == -1 ? node->model : node->model * flat_nodes[parent]->global_model;
+		changed = true;
+	}
+
+	//the flags of this update aren't needed anymore: clear them for the next one
+	if (changed)
+	{
+		std::fill(flat_dirty.begin(), flat_dirty.end(), 0);
+		version++;
+	}
+	return changed;
+}
+
 void updateInDepth(std::map<std::string, GTR::Node*>& container, GTR::Node* node)
 {
 	if (node->name.size())
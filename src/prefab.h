@@ -82,6 +82,7 @@ namespace GTR {
 			return global_model;
 		}
 
+		//the global matrices are computed top-down during the recursion, so it must be called from the root
 		bool testRay(const Ray& ray, Vector3& result, int layers = 0xFF, float max_dist = 3.4e+38F);
 		Vector3 localToGlobal(Vector3 v) { return global_model * v; }
 
@@ -102,12 +103,29 @@ namespace GTR {
 		Node root;
 		BoundingBox bounding;
 
+		//Flattened tree: the nodes in depth-first order, so a parent is always before its children and a subtree is contiguous
+		std::vector<Node*> flat_nodes;
+		std::vector<int> flat_parents; //index of the parent in flat_nodes, -1 for the root
+		std::vector<Matrix44> flat_local_models; //local matrices, meshes and visibilities of the last update, to detect the changes
+		std::vector<Mesh*> flat_meshes;
+		std::vector<uint8> flat_local_visible;
+		std::vector<uint8> flat_visible; //the node and all its ancestors are visible
+		std::vector<uint8> flat_dirty; //must be recomputed in the next update (set for all the nodes after flatten)
+		int version; //incremented every time an update changes something, so the instances know they must update too
+
 		//dtor
 		Prefab();
 		~Prefab();
 
 		void updateBounding();
 		void updateNodesByName();
+
+		//Builds the flattened tree (must be called again if nodes are added or removed)
+		void flatten();
+
+		//Recomputes the global matrices of the nodes that changed and their subtrees in one linear pass
+		//(Node::global_model is kept up to date). Returns true if something changed
+		bool updateGlobalMatrices();
 		Node* getNodeByName(const char* name);
 
 				//Manager to cache loaded prefabs
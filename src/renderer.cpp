@@ -11,22 +11,75 @@
 #include "application.h"
 #include "fbo.h"
 #include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include "task.h"
+#include "glstate.h"
 
 constexpr int SHOW_ATLAS_RESOLUTION = 300;
 
+//Sort key layout (from the most significant bit):
+//opaque calls:  pass(2) | blend bucket(2) | shader(8) | material(16) | mesh(16) | depth(20) -> batched by state, front to back
+//blended calls: pass(2) | blend bucket(2) | inverted depth(20) | shader(8) | material(16) | mesh(16) -> back to front
+constexpr int SORT_KEY_DEPTH_BITS = 20;
+constexpr uint64 SORT_KEY_DEPTH_MAX = (1ull << SORT_KEY_DEPTH_BITS) - 1;
+
+//Uniforms uploaded in every draw call, interned once so the shaders find them with an array lookup
+namespace uniforms {
+	static const UniformID u_color_texture("u_color_texture");
+	static const UniformID u_emissive_texture("u_emissive_texture");
+	static const UniformID u_omr_texture("u_omr_texture");
+	static const UniformID u_normal_texture("u_normal_texture");
+	static const UniformID u_model("u_model");
+	static const UniformID u_viewprojection("u_viewprojection");
+	static const UniformID u_color("u_color");
+	static const UniformID u_alpha_cutoff("u_alpha_cutoff");
+	static const UniformID u_num_views("u_num_views");
+	static const UniformID u_view_mask("u_view_mask");
+	static const UniformID u_first_iteration("u_first_iteration");
+	static const UniformID u_last_iteration("u_last_iteration");
+	static const UniformID u_light_indices("u_light_indices");
+	static const UniformID u_light_index("u_light_index");
+	static const UniformID u_num_lights("u_num_lights");
+	static const UniformID u_shadow_atlas("u_shadow_atlas");
+	static const UniformID u_light_type("u_light_type");
+	static const UniformID u_cast_shadows("u_cast_shadows");
+	static const UniformID u_light_position("u_light_position");
+	static const UniformID u_light_color("u_light_color");
+	static const UniformID u_light_intensity("u_light_intensity");
+	static const UniformID u_light_max_distance("u_light_max_distance");
+	static const UniformID u_spot_direction("u_spot_direction");
+	static const UniformID u_spot_cone("u_spot_cone");
+	static const UniformID u_directional_front("u_directional_front");
+	static const UniformID u_area_size("u_area_size");
+	static const UniformID u_shadow_bias("u_shadow_bias");
+	static const UniformID u_shadow_vp("u_shadow_vp");
+	static const UniformID u_shadow_rect("u_shadow_rect");
+	static const UniformID u_cascade_scale_offset("u_cascade_scale_offset");
+	static const UniformID u_cascade_scroll("u_cascade_scroll");
+	static const UniformID u_viewprojections("u_viewprojections");
+}
+
 using namespace GTR;
 using namespace std;
 
-bool sortRenderCall(const RenderCall* rc1, const RenderCall* rc2)
+//Orders the render calls of a render list: opaque calls front to back and then blended calls back to front
+struct RenderCallComparator
 {
-	eAlphaMode rc1_alpha = rc1->material->alpha_mode;
-	eAlphaMode rc2_alpha = rc2->material->alpha_mode;
-	if (rc1_alpha == eAlphaMode::BLEND && rc2_alpha != eAlphaMode::BLEND) return false;
-	else if (rc1_alpha != eAlphaMode::BLEND && rc2_alpha == eAlphaMode::BLEND) return true;
-	else if (rc1_alpha == eAlphaMode::BLEND && rc2_alpha == eAlphaMode::BLEND) return rc1->distance_to_camera > rc2->distance_to_camera;	
-	else if (rc1_alpha != eAlphaMode::BLEND && rc2_alpha != eAlphaMode::BLEND) return rc1->distance_to_camera < rc2->distance_to_camera;	
-	else return true;
-}
+	const RenderList* list;
+
+	RenderCallComparator(const RenderList* list) { this->list = list; }
+
+	bool operator()(int rc1, int rc2) const
+	{
+		eAlphaMode rc1_alpha = list->materials[rc1]->alpha_mode;
+		eAlphaMode rc2_alpha = list->materials[rc2]->alpha_mode;
+		if (rc1_alpha == eAlphaMode::BLEND && rc2_alpha != eAlphaMode::BLEND) return false;
+		else if (rc1_alpha != eAlphaMode::BLEND && rc2_alpha == eAlphaMode::BLEND) return true;
+		else if (rc1_alpha == eAlphaMode::BLEND && rc2_alpha == eAlphaMode::BLEND) return list->distances_to_camera[rc1] > list->distances_to_camera[rc2];
+		else return list->distances_to_camera[rc1] < list->distances_to_camera[rc2];
+	}
+};
 
 bool sortLight(const LightEntity* l1, const LightEntity* l2) 
 {
@@ -51,36 +104,64 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	checkGLErrors();
 
-	//Clear the render calls vector and the lights vector
-	render_calls.clear();
+	//Clear the render list and the lights vector (they keep their memory) and rewind the frame arena
+	render_list.clear();
 	lights.clear();
+	frame_arena.reset();
+	draw_calls_saved = 0;
+	light_passes_saved = 0;
 
-	//Generate render calls and fill lights vector
+	//Fill lights vector
 	for (int i = 0; i < scene->entities.size(); ++i)
 	{
 		BaseEntity* ent = scene->entities[i];
-		if (!ent->visible)
-			continue;
+		if (ent->visible && ent->entity_type == LIGHT)
+			lights.push_back((LightEntity*)ent);
+	}
 
-		//is a prefab!
-		if (ent->entity_type == PREFAB)
-		{
-			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
-			if(pent->prefab)
-				processPrefab(ent->model, pent->prefab, camera);
-		}
+	//Generate render calls: once the prefabs are updated the traversal only reads shared data, so it can be split between several threads
+	auto traversal_start = std::chrono::high_resolution_clock::now();
+	updatePrefabs();
+	if (scene->multithreaded_traversal)
+		instances_updated = processEntitiesParallel(camera);
+	else
+		instances_updated = processEntities(0, (int)scene->entities.size(), camera, render_list);
+	auto traversal_end = std::chrono::high_resolution_clock::now();
+	traversal_time = std::chrono::duration<float, std::milli>(traversal_end - traversal_start).count();
 
-		if (ent->entity_type == LIGHT) {
-			LightEntity* light = (LightEntity*)ent;
-			lights.push_back(light);
-		}
-	}
+	//Shaders are chosen on this thread (getting a shader may compile it)
+	for (int i = 0; i < render_list.size(); ++i)
+		render_list.shaders[i] = getRenderShader(render_list.materials[i]);
+
+	//Update the hierarchy used to cull the calls against the camera and the shadow cameras
+	//(it only sees the changes of the frames it is updated, so it is dropped while it isn't used)
+	if (scene->bvh_culling) scene_bvh.update(render_list);
+	else scene_bvh.clear();
 
 	//If there aren't lights in the scene don't render nothing
 	if (lights.empty()) return;
 
-	//Now we sort the RenderCalls vector according to the boolean method sortRenderCall
-	if (scene->alpha_sorting) std::sort(render_calls.begin(), render_calls.end(), sortRenderCall);
+	//Now we sort the submission order of the render list: by packed sort keys (radix sort) or according to RenderCallComparator
+	if (scene->key_sorting)
+	{
+		computeSortKeys(camera);
+		int unsorted_state_changes = render_list.countStateChanges();
+		render_list.sortByKeys();
+		state_changes_saved = unsorted_state_changes - render_list.countStateChanges();
+	}
+	else
+	{
+		if (scene->alpha_sorting) std::sort(render_list.order.begin(), render_list.order.end(), RenderCallComparator(&render_list));
+		state_changes_saved = 0;
+	}
+
+	//Position of each call in the submission order, to sort the calls found by the BVH
+	if (scene->bvh_culling)
+	{
+		call_ranks = frame_arena.alloc<int>(render_list.size());
+		for (int i = 0; i < render_list.size(); ++i)
+			call_ranks[render_list.order[i]] = i;
+	}
 
 	//Now we sort the Light vector according to the boolean method sortLight
 	if (scene->shadow_sorting) std::sort(lights.begin(), lights.end(), sortLight);
@@ -94,123 +175,632 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 		cout << "Resolution successfully changed" << endl;
 	}
 
-	//Compute the number of shadows of the scene and the shadow index of each light
-	if (scene->shadow_visibility_tracker)
+	//Shadow atlas: a square texture of fixed size where each shadowed light gets a rectangle of the resolution of its tier
+	int atlas_size = getShadowAtlasSize();
+	bool atlas_changed = shadow_atlas.update(lights, camera, shadow_map_resolution, atlas_size);
+	scene->num_shadows = shadow_atlas.num_maps;
+	if (scene->num_shadows == 0 && scene->fbo) deleteShadowAtlas();
+	else if (scene->num_shadows > 0 && (!scene->fbo || scene->fbo->width != atlas_size || scene->static_shadows != (static_shadow_fbo != NULL)))
 	{
-		scene->num_shadows = 0;
-		int shadow_index = 0;
-		for (int i = 0; i < lights.size(); i++)
-		{
-			if (lights[i]->cast_shadows)
-			{
-				//Assign a shadow slot for shadow atlas
-				lights[i]->shadow_index = shadow_index;
-
-				//Update
-				scene->num_shadows++;
-				shadow_index++;
-			}
-		}
+		createShadowAtlas(atlas_size);
+		atlas_changed = true;
 	}
 
-	//Create Shadow Atlas: We create a dynamic atlas to be resizable
-	if (scene->shadow_visibility_tracker || scene->shadow_resolution_tracker) createShadowAtlas();
-
-	//Compute Shadow Atlas
-	if (scene->fbo || scene->shadow_atlas)
+	//Compute Shadow Atlas: a map is only rendered again if its light changed or some entity changed inside its frustum
+	findShadowChanges();
+	shadow_maps_rendered = 0;
+	shadow_texels_rendered = 0;
+	shadow_faces_culled = 0;
+	shadow_draw_calls = 0;
+	multiview_passes = 0;
+	shadow_lights_rendered.clear();
+	queue_shadow_views = scene->fbo && scene->multiview_shadows && supportsMultiViewShadows();
+	if (scene->fbo)
 	{
 		//Iterate over light vector
 		for (int i = 0; i < lights.size(); i++)
 		{
 			//Current light
 			LightEntity* light = lights[i];
+			if (!light->cast_shadows || light->shadow_tier == -1)
+				continue;
+
+			//The whole light has to be rendered again if it moved or its maps were moved in the atlas
+			bool light_changed = atlas_changed || !light->light_camera || memcmp(light->model.m, light->shadow_model.m, sizeof(Matrix44)) != 0;
+			int maps_rendered = 0;
 
-			//Booleans
-			bool compute_spot = light->light_type == SPOT && light->cast_shadows && (scene->entity_tracker || light->spot_shadow_tracker || scene->shadow_visibility_tracker || scene->shadow_resolution_tracker);
-			bool compute_directional = light->light_type == DIRECTIONAL && light->cast_shadows && (scene->entity_tracker || light->directional_shadow_tracker || scene->shadow_visibility_tracker || scene->shadow_resolution_tracker || camera->camera_tracker);
-			
 			//Shadow Map
-			if (compute_spot)
+			if (light->light_type == SPOT)
 			{
-				computeSpotShadowMap(light);
+				bool static_changed = light_changed || light->spot_shadow_tracker || isShadowInvalidated(light->light_camera, static_shadow_changes);
+				if (static_changed || isShadowInvalidated(light->light_camera, dynamic_shadow_changes))
+				{
+					computeSpotShadowMap(light, static_changed);
+					maps_rendered = 1;
+				}
 				light->spot_shadow_tracker = false;
 			}
-			if (compute_directional)
+			else if (light->light_type == DIRECTIONAL)
 			{
-				computeDirectionalShadowMap(light);
+				maps_rendered = computeDirectionalShadowMap(light, light_changed || light->directional_shadow_tracker);
 				light->directional_shadow_tracker = false;
 			}
+			else if (light->light_type == POINT)
+			{
+				maps_rendered = computePointShadowMap(light, light_changed || light->point_shadow_tracker);
+				light->point_shadow_tracker = false;
+			}
+			light->shadow_model = light->model;
+
+			if (maps_rendered)
+			{
+				shadow_maps_rendered += maps_rendered;
+				shadow_lights_rendered.push_back(light);
+			}
 		}
 	}
 
+	//Multi-view path: render all the maps queued by the lights together
+	if (queue_shadow_views)
+	{
+		renderShadowViews();
+		queue_shadow_views = false;
+	}
+
 	//Enable view camera after computing shadow maps
 	camera->enable();
 
-	//Final render
-	for (int i = 0; i < render_calls.size(); i++)
+	//Bin the lights in the view froxels (after the shadow maps, as it stores the light cameras)
+	if (scene->render_type == Clustered) light_clusters.build(lights, camera, scene->shadow_atlas != NULL);
+
+	//Occlusion culling: read the query results of previous frames
+	if (scene->occlusion_culling) occlusion_culler.beginFrame(render_list.size());
+	else occlusion_culler.reset();
+
+	//Final render: gather the calls inside the frustum (keeping the sorted order) and the ones that aren't occluded
+	frustum_calls = frame_arena.alloc<int>(render_list.size());
+	num_frustum_calls = 0;
+	int* visible_calls = frame_arena.alloc<int>(render_list.size());
+	int num_visible_calls = 0;
+	num_frustum_calls = gatherFrustumCalls(camera, false, frustum_calls);
+	for (int i = 0; i < num_frustum_calls; i++)
 	{
-		RenderCall* rc = render_calls[i];
-		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(rc->world_bounding_box.center, rc->world_bounding_box.halfsize))
+		int call = frustum_calls[i];
+		if (!scene->occlusion_culling || !occlusion_culler.isOccluded(call))
+			visible_calls[num_visible_calls++] = call;
+	}
+
+	//Camera, scene, lights and materials of the color passes
+	writeUniformBlocks(visible_calls, num_visible_calls, camera);
+	if (scene->render_type == Deferred) renderDeferred(visible_calls, num_visible_calls, camera);
+	else
+	{
+		//Split the calls: the occlusion queries are tested against the opaque depth only
+		int* opaque_calls = frame_arena.alloc<int>(num_visible_calls);
+		int* blended_calls = frame_arena.alloc<int>(num_visible_calls);
+		int num_opaque_calls = 0;
+		int num_blended_calls = 0;
+		for (int i = 0; i < num_visible_calls; ++i)
 		{
-			renderDrawCall(render_calls[i], camera); 	
+			if (render_list.materials[visible_calls[i]]->alpha_mode == eAlphaMode::BLEND) blended_calls[num_blended_calls++] = visible_calls[i];
+			else opaque_calls[num_opaque_calls++] = visible_calls[i];
 		}
+
+		//Opaque depth pre-pass: afterwards the color passes only shade the visible fragments
+		if (scene->depth_prepass) renderDepthPrepass(opaque_calls, num_opaque_calls, camera);
+		else prepass_fragments = 0;
+
+		beginFragmentsQuery(1);
+		renderCalls(opaque_calls, num_opaque_calls, camera, false);
+		endFragmentsQuery();
+		depth_prepass_done = false;
+
+		issueOcclusionQueries(camera);
+		renderCalls(blended_calls, num_blended_calls, camera, false);
 	}
 
 	//Debug shadow maps
 	if (scene->show_atlas) showShadowAtlas();
 
 	//Reset trackers
-	if (scene->entity_tracker) scene->entity_tracker = false;
 	if (scene->shadow_visibility_tracker) scene->shadow_visibility_tracker = false;
 	if (camera->camera_tracker) camera->camera_tracker = false;
 
+	//The ring region of this frame is reused when the GPU has finished it
+	uniform_ring.endFrame();
+}
+
+//Updates the global matrices of the prefabs used by the visible entities (each prefab once, on this thread: the
+//prefabs are shared between entities, so they can't be updated by the workers)
+void Renderer::updatePrefabs()
+{
+	updated_prefabs.clear();
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (ent->visible && ent->entity_type == PREFAB && ((PrefabEntity*)ent)->prefab)
+			updated_prefabs.push_back(((PrefabEntity*)ent)->prefab);
+	}
+	std::sort(updated_prefabs.begin(), updated_prefabs.end());
+	updated_prefabs.erase(std::unique(updated_prefabs.begin(), updated_prefabs.end()), updated_prefabs.end());
+
+	for (int i = 0; i < updated_prefabs.size(); ++i)
+		updated_prefabs[i]->updateGlobalMatrices();
+}
+
+//Adds the render calls of a range of entities to a render list, returns the number of instances whose transforms were recomputed
+int Renderer::processEntities(int first_entity, int last_entity, Camera* camera, RenderList& list)
+{
+	int instances_updated = 0;
+	for (int i = first_entity; i < last_entity; ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (!ent->visible)
+			continue;
+
+		//is a prefab!
+		if (ent->entity_type == PREFAB)
+		{
+			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+			if (pent->prefab)
+			{
+				list.beginGroup(pent);
+				if (processPrefab(pent, camera, list))
+				{
+					list.markGroupChanged();
+					instances_updated++;
+				}
+			}
+		}
+	}
+	return instances_updated;
+}
+
+//Splits the entities in contiguous ranges, one per worker, and merges the lists in order (same result as the serial traversal)
+int Renderer::processEntitiesParallel(Camera* camera)
+{
+	WorkerPool& pool = WorkerPool::global;
+	if (pool.getNumWorkers() == 1)
+		pool.start(std::max((int)std::thread::hardware_concurrency(), 1));
+
+	int num_workers = pool.getNumWorkers();
+	int num_entities = (int)scene->entities.size();
+	worker_render_lists.resize(num_workers);
+	int* worker_instances_updated = frame_arena.alloc<int>(num_workers);
+
+	pool.run([&](int worker) {
+		RenderList& list = worker_render_lists[worker];
+		list.clear();
+		int first_entity = num_entities * worker / num_workers;
+		int last_entity = num_entities * (worker + 1) / num_workers;
+		worker_instances_updated[worker] = processEntities(first_entity, last_entity, camera, list);
+	});
+
+	int instances_updated = 0;
+	for (int i = 0; i < num_workers; ++i)
+	{
+		render_list.append(worker_render_lists[i]);
+		instances_updated += worker_instances_updated[i];
+	}
+	return instances_updated;
+}
+
+//Adds the render calls of the visible nodes of a prefab entity, returns true if its transforms were recomputed
+bool Renderer::processPrefab(GTR::PrefabEntity* entity, Camera* camera, RenderList& list)
+{
+	assert(entity->prefab && "PREFAB IS NULL");
+
+	//The world matrices and boxes of the nodes are cached in the entity, they only change if the entity or the prefab change.
+	//This way the same prefab is in memory once, and each instance keeps its own transforms
+	bool updated = entity->updateNodeTransforms();
+
+	Prefab* prefab = entity->prefab;
+	for (int i = 0; i < prefab->flat_nodes.size(); ++i)
+	{
+		//does this node have a mesh? then we must render it
+		Node* node = prefab->flat_nodes[i];
+		if (!prefab->flat_visible[i] || !node->mesh || !node->material)
+			continue;
+
+		//Add a render call for each node to the render list (no allocation once the list has grown)
+		const BoundingBox& world_bounding = entity->node_bounding_boxes[i];
+		list.add(node->mesh, node->material, entity->node_models[i], world_bounding, world_bounding.center.distance(camera->eye), entity->is_static);
+	}
+	return updated;
+}
+
+//Chooses the shader that renders a material
+Shader* GTR::Renderer::getRenderShader(Material* material, bool instanced)
+{
+	switch (scene->render_type) {
+	case(Singlepass): return Shader::Get(instanced ? "singlepass_instanced" : "singlepass");
+	case(Multipass): return Shader::Get(instanced ? "multipass_instanced" : "multipass");
+	case(Clustered): return Shader::Get(instanced ? "clustered_instanced" : "clustered");
+	case(Deferred):
+		//Blended materials can't be stored in the G-buffers: they are rendered forward afterwards
+		if (material->alpha_mode == eAlphaMode::BLEND) return Shader::Get(instanced ? "singlepass_instanced" : "singlepass");
+		return Shader::Get(instanced ? "gbuffers_instanced" : "gbuffers");
+	}
+	return NULL;
+}
+
+//Compute the sort key of each render call
+void GTR::Renderer::computeSortKeys(Camera* camera)
+{
+	for (int i = 0; i < render_list.size(); ++i)
+	{
+		Material* material = render_list.materials[i];
+		Shader* shader = render_list.shaders[i];
+
+		//Key fields
+		uint64 pass = material->alpha_mode == eAlphaMode::BLEND ? 1 : 0;
+		uint64 blend_bucket = material->alpha_mode;
+		uint64 shader_id = shader ? (shader->m_Id & 0xFF) : 0;
+		uint64 material_id = material->m_Id & 0xFFFF;
+		uint64 mesh_id = render_list.meshes[i]->m_Id & 0xFFFF;
+
+		//Quantized depth in [0, SORT_KEY_DEPTH_MAX]
+		float normalized_depth = clamp(render_list.distances_to_camera[i] / camera->far_plane, 0.0f, 1.0f);
+		uint64 depth = (uint64)(normalized_depth * SORT_KEY_DEPTH_MAX);
+
+		//Opaque calls are batched by state and then sorted front to back, blended calls must be sorted back to front
+		if (pass == 0)
+			render_list.sort_keys[i] = (pass << 62) | (blend_bucket << 60) | (shader_id << 52) | (material_id << 36) | (mesh_id << 20) | depth;
+		else
+		{
+			//Without alpha sorting the blended calls are only batched by state, like the opaque ones without depth
+			uint64 blend_depth = scene->alpha_sorting ? SORT_KEY_DEPTH_MAX - depth : 0;
+			render_list.sort_keys[i] = (pass << 62) | (blend_bucket << 60) | (blend_depth << 40) | (shader_id << 32) | (material_id << 16) | mesh_id;
+		}
+	}
+}
+
+//Fills the frame, light and material blocks of the visible calls in the uniform ring and binds the ranges of the frame and the first lights
+void GTR::Renderer::writeUniformBlocks(const int* calls, int num_calls, Camera* camera)
+{
+	static_assert(sizeof(sFrameBlock) == 112 && sizeof(sMaterialBlock) == 32, "the blocks must match the std140 layout of the shader atlas");
+
+	//The lights are split in light blocks of MAX_BLOCK_LIGHTS (the whole block is bound, whatever the number of lights)
+	int lights_size = MAX_BLOCK_LIGHTS * LIGHT_DATA_TEXELS * sizeof(Vector4);
+	int num_light_blocks = max(((int)lights.size() + MAX_BLOCK_LIGHTS - 1) / MAX_BLOCK_LIGHTS, 1);
+
+	//Space of the frame in the ring: every block may need a whole alignment of padding, with a material per call at most
+	int padding = max(uniform_ring.alignment, 256);
+	int num_blocks = 1 + num_light_blocks + num_calls;
+	uniform_ring.beginFrame(sizeof(sFrameBlock) + num_light_blocks * lights_size + num_calls * sizeof(sMaterialBlock) + num_blocks * padding);
+
+	//Frame block
+	sFrameBlock* frame_block = NULL;
+	int frame_offset = uniform_ring.alloc(sizeof(sFrameBlock), (void**)&frame_block);
+	frame_block->viewprojection = camera->viewprojection_matrix;
+	frame_block->camera_position = camera->eye;
+	frame_block->time = (float)getTime();
+	frame_block->ambient_light = scene->ambient_light;
+	frame_block->occlusion = scene->occlusion;
+	frame_block->specular_light = scene->specular_light;
+	frame_block->shadows = scene->shadow_atlas != NULL;
+
+	//Light blocks: every light of the frame, the forward passes bind the block of their lights and only upload their indices
+	light_block_offsets.resize(num_light_blocks);
+	for (int i = 0; i < num_light_blocks; ++i)
+	{
+		Vector4* block_data = NULL;
+		light_block_offsets[i] = uniform_ring.alloc(lights_size, (void**)&block_data);
+		for (int j = i * MAX_BLOCK_LIGHTS; j < min((i + 1) * MAX_BLOCK_LIGHTS, (int)lights.size()); ++j)
+		{
+			lights[j]->block_index = j;
+			lights[j]->writeShaderData(block_data + (j % MAX_BLOCK_LIGHTS) * LIGHT_DATA_TEXELS, scene->shadow_atlas != NULL);
+		}
+	}
+
+	//Material blocks: one for each material of the calls
+	material_block_offsets.clear();
+	for (int i = 0; i < num_calls; ++i)
+	{
+		Material* material = render_list.materials[calls[i]];
+		if (!material || material_block_offsets.count(material))
+			continue;
+
+		sMaterialBlock* material_block = NULL;
+		material_block_offsets[material] = uniform_ring.alloc(sizeof(sMaterialBlock), (void**)&material_block);
+		material_block->color = material->color;
+		material_block->alpha_cutoff = material->alpha_mode == eAlphaMode::MASK ? material->alpha_cutoff : 0; //this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+		material_block->normal_mapping = scene->normal_mapping && material->normal_texture.texture;
+	}
+
+	//The draw calls only bind the range of their material
+	uniform_ring.flush();
+	uniform_ring.bindRange(FRAME_BLOCK_BINDING, frame_offset, sizeof(sFrameBlock));
+	uniform_ring.bindRange(LIGHT_BLOCK_BINDING, light_block_offsets[0], lights_size);
+	bound_light_block = 0;
+	bound_material_offset = -1;
+}
+
+//Binds the light block that contains a light and returns the index of the light in it
+int GTR::Renderer::bindLightBlock(LightEntity* light)
+{
+	int light_block = light->block_index / MAX_BLOCK_LIGHTS;
+	if (light_block != bound_light_block)
+	{
+		uniform_ring.bindRange(LIGHT_BLOCK_BINDING, light_block_offsets[light_block], MAX_BLOCK_LIGHTS * LIGHT_DATA_TEXELS * sizeof(Vector4));
+		bound_light_block = light_block;
+	}
+	return light->block_index % MAX_BLOCK_LIGHTS;
+}
+
+int GTR::Renderer::renderCalls(const int* calls, int num_calls, Camera* camera, bool depth_only)
+{
+	int num_draw_calls = 0;
+	int i = 0;
+	while (i < num_calls)
+	{
+		int call = calls[i];
+		Mesh* mesh = render_list.meshes[call];
+		Material* material = render_list.materials[call];
+
+		//Consecutive calls with the same mesh and material form a batch (the sort keys place them together)
+		int batch_end = i + 1;
+		if (scene->instancing)
+			while (batch_end < num_calls && render_list.meshes[calls[batch_end]] == mesh && render_list.materials[calls[batch_end]] == material)
+				batch_end++;
+		int batch_size = batch_end - i;
+
+		//In a multi-view pass the batch is rendered into all the views of its calls
+		uint32 view_mask = 0;
+		if (shadow_view_masks)
+			for (int j = i; j < batch_end; ++j)
+				view_mask |= shadow_view_masks[calls[j]];
+
+		if (batch_size == 1)
+		{
+			if (depth_only) renderDepthMap(call, camera, 0, view_mask);
+			else renderDrawCall(call, camera, render_list.world_bounding_boxes[call]);
+		}
+		else
+		{
+			//Upload the models of the batch to the instance buffer
+			Matrix44* models = frame_arena.alloc<Matrix44>(batch_size);
+			BoundingBox batch_bounding_box = render_list.world_bounding_boxes[call];
+			for (int j = 0; j < batch_size; ++j)
+			{
+				models[j] = render_list.models[calls[i + j]];
+				batch_bounding_box = mergeBoundingBoxes(batch_bounding_box, render_list.world_bounding_boxes[calls[i + j]]);
+			}
+			Mesh::uploadInstancedModels(models, batch_size);
+
+			if (depth_only) renderDepthMap(call, camera, batch_size, view_mask);
+			else renderDrawCall(call, camera, batch_bounding_box, batch_size);
+			draw_calls_saved += batch_size - 1;
+		}
+
+		num_draw_calls++;
+		i = batch_end;
+	}
+
+	//set the render state as it was before to avoid problems with future renders (once for all the calls, between them the cache only lets through what changes)
+	Shader::disableShaders();
+	GLState::disable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
+	GLState::depthMask(true);
+
+	return num_draw_calls;
+}
+
+//Render the shadow casters seen by a light camera, or the ones of a list already culled against it
+void GTR::Renderer::renderShadowCasters(Camera* light_camera, eShadowCasters casters, const int* caster_calls, int num_caster_calls)
+{
+	int* calls = frame_arena.alloc<int>(render_list.size());
+	int num_calls = 0;
+	if (caster_calls)
+	{
+		memcpy(calls, caster_calls, num_caster_calls * sizeof(int));
+		num_calls = num_caster_calls;
+	}
+	else
+		num_calls = gatherFrustumCalls(light_camera, true, calls);
+
+	//Keep the static or the dynamic ones (in the same order)
+	if (casters != ALL_CASTERS)
+	{
+		int num_kept = 0;
+		for (int i = 0; i < num_calls; ++i)
+			if (render_list.statics[calls[i]] == (casters == STATIC_CASTERS))
+				calls[num_kept++] = calls[i];
+		num_calls = num_kept;
+	}
+
+	shadow_draw_calls += renderCalls(calls, num_calls, light_camera, true);
 }
 
-//renders all the prefab
-void Renderer::processPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera)
+//Writes the calls inside the frustum of a camera, in submission order
+int GTR::Renderer::gatherFrustumCalls(Camera* camera, bool skip_blended, int* calls)
 {
-	assert(prefab && "PREFAB IS NULL");
-	//assign the model to the root node
-	processNode(model, &prefab->root, camera); //For each prefab we render its nodes with the model matrix of the entity that we pass by parameter, which avoids having the same prefab in memory twice.
+	int num_calls = 0;
+
+	//The BVH rejects whole subtrees and writes the calls found, then only those are put in the sorted order
+	if (scene->bvh_culling)
+	{
+		int num_found = scene_bvh.cullFrustum(camera, calls);
+		for (int i = 0; i < num_found; ++i)
+		{
+			int call = calls[i];
+			if (!(skip_blended && render_list.materials[call]->alpha_mode == eAlphaMode::BLEND))
+				calls[num_calls++] = call;
+		}
+		const int* ranks = call_ranks;
+		std::sort(calls, calls + num_calls, [ranks](int a, int b) { return ranks[a] < ranks[b]; });
+		return num_calls;
+	}
+
+	//Linear path: all the boxes are tested in batches, then the calls found are listed in the sorted order
+	uint32* visible_mask = frame_arena.alloc<uint32>((render_list.size() + 31) / 32);
+	camera->testBoxesInFrustum(render_list.world_bounding_box_array, 0, render_list.size(), visible_mask);
+	for (int i = 0; i < render_list.size(); ++i)
+	{
+		int call = render_list.order[i];
+		if ((visible_mask[call >> 5] & (1u << (call & 31))) && !(skip_blended && render_list.materials[call]->alpha_mode == eAlphaMode::BLEND))
+			calls[num_calls++] = call;
+	}
+	return num_calls;
 }
 
-//renders a node of the prefab and its children
-void Renderer::processNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+//Times the frustum test of all the render calls with the scalar test (one box at a time) and with the batch test, and compares their masks
+void GTR::Renderer::benchmarkFrustumCulling(Camera* camera, int iterations)
 {
-	if (!node->visible)
+	int num_calls = render_list.size();
+	int mask_size = (num_calls + 31) / 32 + 1;
+	std::vector<uint32> scalar_mask(mask_size);
+	std::vector<uint32> visible_mask(mask_size);
+
+	auto scalar_start = std::chrono::high_resolution_clock::now();
+	for (int it = 0; it < iterations; ++it)
+	{
+		std::fill(scalar_mask.begin(), scalar_mask.end(), 0);
+		for (int i = 0; i < num_calls; ++i)
+		{
+			const BoundingBox& box = render_list.world_bounding_boxes[i];
+			if (camera->testBoxInFrustum(box.center, box.halfsize) != CLIP_OUTSIDE)
+				scalar_mask[i >> 5] |= 1u << (i & 31);
+		}
+	}
+	auto scalar_end = std::chrono::high_resolution_clock::now();
+
+	for (int it = 0; it < iterations; ++it)
+		camera->testBoxesInFrustum(render_list.world_bounding_box_array, 0, num_calls, visible_mask.data());
+	auto batch_end = std::chrono::high_resolution_clock::now();
+
+	//First box whose bit differs between both masks
+	culling_benchmark_mismatch = -1;
+	for (int i = 0; i < num_calls; ++i)
+	{
+		if ((scalar_mask[i >> 5] ^ visible_mask[i >> 5]) & (1u << (i & 31)))
+		{
+			culling_benchmark_mismatch = i;
+			break;
+		}
+	}
+
+	culling_benchmark_scalar = std::chrono::duration<float, std::milli>(scalar_end - scalar_start).count() / iterations;
+	culling_benchmark_batch = std::chrono::duration<float, std::milli>(batch_end - scalar_end).count() / iterations;
+	cout << "Frustum culling of " << num_calls << " boxes: scalar " << culling_benchmark_scalar << " ms, " << Camera::getBatchCullingPath() << " " << culling_benchmark_batch << " ms";
+	if (culling_benchmark_mismatch != -1)
+		cout << " (DIFFERENT RESULTS from box " << culling_benchmark_mismatch << ")";
+	cout << endl;
+}
+
+//Times the scalar and the SIMD matrix operations over the models and boxes of the render list
+void GTR::Renderer::benchmarkTransforms(int iterations)
+{
+	int num_calls = render_list.size();
+	if (num_calls == 0)
 		return;
 
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	std::vector<BoundingBox> local_boxes(num_calls);
+	for (int i = 0; i < num_calls; ++i)
+		local_boxes[i] = render_list.meshes[i]->box;
+	std::vector<Matrix44> matrices(num_calls);
+	std::vector<BoundingBox> boxes(num_calls);
+	const Matrix44* models = render_list.models.data();
 
-	//does this node have a mesh? then we must render it
-	if (node->mesh && node->material)
+	float times[2][3]; //[scalar, SIMD][multiply, inverse, transform box]
+	for (int simd = 0; simd < 2; ++simd)
 	{
-		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-		BoundingBox world_bounding = transformBoundingBox(node_model,node->mesh->box);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int it = 0; it < iterations; ++it)
+		{
+			if (simd) multiplyMatrices(models, models, matrices.data(), num_calls);
+			else for (int i = 0; i < num_calls; ++i) matrices[i] = models[i].multiplyScalar(models[i]);
+		}
+		auto multiply_end = std::chrono::high_resolution_clock::now();
 
-		//Create a render call for each node and push it back in the RenderCalls vector
-		RenderCall* rc = new RenderCall();
-		rc->mesh = node->mesh;
-		rc->material = node->material;
-		rc->model = node_model;
-		rc->world_bounding_box = world_bounding;
-		rc->distance_to_camera = world_bounding.center.distance(camera->center);
-		render_calls.push_back(rc);
+		for (int it = 0; it < iterations; ++it)
+		{
+			for (int i = 0; i < num_calls; ++i)
+			{
+				matrices[i] = models[i];
+				if (simd) matrices[i].inverse();
+				else matrices[i].inverseScalar();
+			}
+		}
+		auto inverse_end = std::chrono::high_resolution_clock::now();
 
+		for (int it = 0; it < iterations; ++it)
+		{
+			if (simd) transformBoundingBoxes(models, local_boxes.data(), boxes.data(), num_calls);
+			else for (int i = 0; i < num_calls; ++i) boxes[i] = transformBoundingBoxScalar(models[i], local_boxes[i]);
+		}
+		auto box_end = std::chrono::high_resolution_clock::now();
+
+		times[simd][0] = std::chrono::duration<float, std::milli>(multiply_end - start).count() / iterations;
+		times[simd][1] = std::chrono::duration<float, std::milli>(inverse_end - multiply_end).count() / iterations;
+		times[simd][2] = std::chrono::duration<float, std::milli>(box_end - inverse_end).count() / iterations;
 	}
 
-	//iterate recursively with children
-	for (int i = 0; i < node->children.size(); ++i)
-		processNode(prefab_model, node->children[i], camera);
+	transforms_benchmark_scalar = times[0][0] + times[0][1] + times[0][2];
+	transforms_benchmark_simd = times[1][0] + times[1][1] + times[1][2];
+	cout << "Transforms of " << num_calls << " calls (scalar / SIMD ms): multiply " << times[0][0] << " / " << times[1][0];
+	cout << ", inverse " << times[0][1] << " / " << times[1][1] << ", bounding box " << times[0][2] << " / " << times[1][2] << endl;
+}
+
+//Occlusion queries of the calls inside the frustum, against the opaque depth of this frame
+void GTR::Renderer::issueOcclusionQueries(Camera* camera)
+{
+	if (scene->occlusion_culling)
+		occlusion_culler.issueQueries(frustum_calls, num_frustum_calls, render_list, camera);
+}
+
+//Depth pre-pass of the opaque calls
+void GTR::Renderer::renderDepthPrepass(const int* opaque_calls, int num_opaque_calls, Camera* camera)
+{
+	//Only depth: the fragments that pass here are the ones the color pass would shade without the pre-pass
+	glColorMask(false, false, false, false);
+	beginFragmentsQuery(0);
+	renderCalls(opaque_calls, num_opaque_calls, camera, true);
+	endFragmentsQuery();
+	glColorMask(true, true, true, true);
+
+	depth_prepass_done = true;
+}
+
+//Counts the fragments that pass the depth test. Each counter cycles through a few queries and reads the one issued
+//FRAGMENTS_QUERY_FRAMES frames ago only if the GPU has its result, otherwise it keeps the last value (it never waits for the GPU)
+void GTR::Renderer::beginFragmentsQuery(int index)
+{
+	int& frame = fragments_query_frames[index];
+	frame = (frame + 1) % FRAGMENTS_QUERY_FRAMES;
+	unsigned int& query = fragments_queries[index][frame];
+	if (!query)
+		glGenQueries(1, &query);
+	else
+	{
+		GLuint available = 0;
+		glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available)
+		{
+			GLuint fragments = 0;
+			glGetQueryObjectuiv(query, GL_QUERY_RESULT, &fragments);
+			if (index == 0) prepass_fragments = fragments;
+			else shaded_fragments = fragments;
+		}
+	}
+	glBeginQuery(GL_SAMPLES_PASSED, query);
+}
+
+void GTR::Renderer::endFragmentsQuery()
+{
+	glEndQuery(GL_SAMPLES_PASSED);
 }
 
 //Render a draw call
-void GTR::Renderer::renderDrawCall(RenderCall* rc, Camera* camera)
+void GTR::Renderer::renderDrawCall(int call, Camera* camera, const BoundingBox& world_bounding_box, int num_instances)
 {
+	//Render call data
+	Mesh* mesh = render_list.meshes[call];
+	Material* material = render_list.materials[call];
+	const Matrix44& model = render_list.models[call];
+
 	//In case there is nothing to do
-	if (!rc->mesh || !rc->mesh->getNumVertices() || !rc->material)
+	if (!mesh || !mesh->getNumVertices() || !material)
 		return;
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -225,40 +815,28 @@ void GTR::Renderer::renderDrawCall(RenderCall* rc, Camera* camera)
 	//Texture* occlusion_texture = NULL;
 
 	//Texture loading
-	color_texture = rc->material->color_texture.texture;
-	if(scene->emissive_materials) emissive_texture = rc->material->emissive_texture.texture;
-	if(scene->specular_light || scene->occlusion) omr_texture = rc->material->metallic_roughness_texture.texture;
-	if(scene->normal_mapping) normal_texture = rc->material->normal_texture.texture;
-	//occlusion_texture = rc->material->occlusion_texture.texture;
+	color_texture = material->color_texture.texture;
+	if(scene->emissive_materials) emissive_texture = material->emissive_texture.texture;
+	if(scene->specular_light || scene->occlusion) omr_texture = material->metallic_roughness_texture.texture;
+	if(scene->normal_mapping) normal_texture = material->normal_texture.texture;
+	//occlusion_texture = material->occlusion_texture.texture;
 
 	//Texture check
 	if (color_texture == NULL)	color_texture = Texture::getWhiteTexture();
 	if (scene->emissive_materials && emissive_texture == NULL) emissive_texture = Texture::getBlackTexture();
 	if ((scene->specular_light || scene->occlusion) && omr_texture == NULL) omr_texture = Texture::getWhiteTexture();
 
-	//Normal mapping
-	int entity_has_normal_map;
-	if (scene->normal_mapping) entity_has_normal_map = (normal_texture == NULL) ? 0 : 1;
-	else entity_has_normal_map = 0;
-
 	//Select the blending
-	if (rc->material->alpha_mode == GTR::eAlphaMode::BLEND) glEnable(GL_BLEND), glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	else glDisable(GL_BLEND);
+	if (material->alpha_mode == GTR::eAlphaMode::BLEND) GLState::enable(GL_BLEND), GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	else GLState::disable(GL_BLEND);
 
 	//Select whether to render both sides of the triangles
-	if (rc->material->two_sided) glDisable(GL_CULL_FACE);
-	else glEnable(GL_CULL_FACE);
+	if (material->two_sided) GLState::disable(GL_CULL_FACE);
+	else GLState::enable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
-	//chose a shader
-	switch (scene->render_type) {
-	case(Singlepass):
-		shader = Shader::Get("singlepass");
-		break;
-	case(Multipass):
-		shader = Shader::Get("multipass");
-		break;
-	}
+	//chose a shader (the instanced variant reads u_model as an attribute)
+	shader = num_instances ? getRenderShader(material, true) : render_list.shaders[call];
 	assert(glGetError() == GL_NO_ERROR);
 
 	//no shader? then nothing to render
@@ -267,39 +845,63 @@ void GTR::Renderer::renderDrawCall(RenderCall* rc, Camera* camera)
 	shader->enable();
 
 	//Upload textures
-	if(color_texture) shader->setTexture("u_color_texture", color_texture, 0);
-	if (scene->emissive_materials) shader->setTexture("u_emissive_texture", emissive_texture, 1);
-	if (scene->specular_light || scene->occlusion) shader->setTexture("u_omr_texture", omr_texture, 2);
-	if (scene->normal_mapping && normal_texture) shader->setTexture("u_normal_texture", normal_texture, 3);
+	if(color_texture) shader->setUniform(uniforms::u_color_texture, color_texture, 0);
+	if (scene->emissive_materials) shader->setUniform(uniforms::u_emissive_texture, emissive_texture, 1);
+	if (scene->specular_light || scene->occlusion) shader->setUniform(uniforms::u_omr_texture, omr_texture, 2);
+	if (scene->normal_mapping && normal_texture) shader->setUniform(uniforms::u_normal_texture, normal_texture, 3);
 	//if(occlusion_texture) shader->setTexture("u_occlussion_texture", occlusion_texture, 4);
 
-	//Upload scene uniforms
-	shader->setUniform("u_model", rc->model);
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_color", rc->material->color);
-	shader->setUniform("u_time", getTime());
-	shader->setUniform("u_alpha_cutoff", rc->material->alpha_mode == GTR::eAlphaMode::MASK ? rc->material->alpha_cutoff : 0); //this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_ambient_light", scene->ambient_light);
-	shader->setUniform("u_normal_mapping", entity_has_normal_map);
-	shader->setUniform("u_occlusion", scene->occlusion);
-	shader->setUniform("u_specular_light", scene->specular_light);
+	//Upload the model and bind the block of the material (the camera, scene and lights are in the blocks bound once per frame)
+	if (!num_instances) shader->setUniform(uniforms::u_model, model);
+	std::unordered_map<Material*, int>::iterator material_block = material_block_offsets.find(material);
+	assert(material_block != material_block_offsets.end() && "the material block is written with the visible calls");
+	if (material_block->second != bound_material_offset)
+	{
+		uniform_ring.bindRange(MATERIAL_BLOCK_BINDING, material_block->second, sizeof(sMaterialBlock));
+		bound_material_offset = material_block->second;
+	}
+
+	//Depth test: after the depth pre-pass opaque calls are only shaded where they are the visible surface
+	bool equal_depth = depth_prepass_done && material->alpha_mode != eAlphaMode::BLEND;
+	GLState::depthFunc(equal_depth ? GL_EQUAL : GL_LEQUAL);
+	GLState::depthMask(!equal_depth);
+
+	//Lights that can reach the object (the forward loops only iterate over them)
+	LightEntity** call_lights = NULL;
+	int num_call_lights = 0;
+	if (scene->render_type == Singlepass || scene->render_type == Multipass || material->alpha_mode == eAlphaMode::BLEND)
+	{
+		call_lights = frame_arena.alloc<LightEntity*>(lights.size());
+		num_call_lights = cullLights(world_bounding_box, call_lights);
+	}
 
 	switch (scene->render_type) {
 	case(Singlepass):
-		SinglePassLoop(rc->mesh, shader);
+		SinglePassLoop(mesh, shader, num_instances, call_lights, num_call_lights);
 		break;
 	case(Multipass):
-		MultiPassLoop(rc->mesh, shader);
+		MultiPassLoop(mesh, shader, num_instances, call_lights, num_call_lights);
+		break;
+	case(Clustered):
+		ClusteredLoop(mesh, shader, num_instances);
+		break;
+	case(Deferred):
+		if (material->alpha_mode == eAlphaMode::BLEND) SinglePassLoop(mesh, shader, num_instances, call_lights, num_call_lights);
+		else GBufferPass(mesh, shader, num_instances);
 		break;
 	}
 }
 
 //Render basic draw call
-void GTR::Renderer::renderDepthMap(RenderCall* rc, Camera* light_camera)
+void GTR::Renderer::renderDepthMap(int call, Camera* light_camera, int num_instances, uint32 view_mask)
 {
+	//Render call data
+	Mesh* mesh = render_list.meshes[call];
+	Material* material = render_list.materials[call];
+	const Matrix44& model = render_list.models[call];
+
 	//In case there is nothing to do
-	if (!rc->mesh || !rc->mesh->getNumVertices() || !rc->material)
+	if (!mesh || !mesh->getNumVertices() || !material)
 		return;
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -307,8 +909,8 @@ void GTR::Renderer::renderDepthMap(RenderCall* rc, Camera* light_camera)
 	Shader* shader = NULL;
 
 	//Select whether to render both sides of the triangles
-	if (rc->material->two_sided) glDisable(GL_CULL_FACE);
-	else glEnable(GL_CULL_FACE);
+	if (material->two_sided) GLState::disable(GL_CULL_FACE);
+	else GLState::enable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
 	//Render the inner face of the triangles in order to reduce shadow acne
@@ -316,8 +918,9 @@ void GTR::Renderer::renderDepthMap(RenderCall* rc, Camera* light_camera)
 	glFrontFace(GL_CW);
 	assert(glGetError() == GL_NO_ERROR);*/
 
-	//chose a shader
-	shader = Shader::Get("depth");
+	//chose a shader (the multi-view one projects the triangles into every view of the mask)
+	if (view_mask) shader = Shader::Get(num_instances ? "depth_multiview_instanced" : "depth_multiview");
+	else shader = Shader::Get(num_instances ? "depth_instanced" : "depth");
 	assert(glGetError() == GL_NO_ERROR);
 
 	//no shader? then nothing to render
@@ -326,19 +929,30 @@ void GTR::Renderer::renderDepthMap(RenderCall* rc, Camera* light_camera)
 	shader->enable();
 
 	//Upload scene uniforms
-	shader->setUniform("u_model", rc->model);
-	shader->setUniform("u_viewprojection", light_camera->viewprojection_matrix);
-	shader->setUniform("u_alpha_cutoff", rc->material->alpha_mode == GTR::eAlphaMode::MASK ? rc->material->alpha_cutoff : 0); //this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+	if (!num_instances) shader->setUniform(uniforms::u_model, model);
+	if (view_mask)
+	{
+		shader->setMatrix44Array(uniforms::u_viewprojections, shadow_view_matrices, num_pass_shadow_views);
+		shader->setUniform(uniforms::u_num_views, num_pass_shadow_views);
+		shader->setUniform(uniforms::u_view_mask, (int)view_mask);
+	}
+	else
+		shader->setUniform(uniforms::u_viewprojection, light_camera->viewprojection_matrix);
+	shader->setUniform(uniforms::u_alpha_cutoff, material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0); //this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+	if (material->alpha_mode == GTR::eAlphaMode::MASK)
+	{
+		Texture* color_texture = material->color_texture.texture;
+		shader->setUniform(uniforms::u_color, material->color);
+		shader->setUniform(uniforms::u_color_texture, color_texture ? color_texture : Texture::getWhiteTexture(), 0);
+	}
 
 	//Disable blending
-	glDepthFunc(GL_LESS);
-	glDisable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
+	GLState::disable(GL_BLEND);
 
 	//do the draw call that renders the mesh into the screen
-	rc->mesh->render(GL_TRIANGLES);
-
-	//disable shader
-	shader->disable();
+	if (num_instances) mesh->renderInstanced(GL_TRIANGLES, num_instances);
+	else mesh->render(GL_TRIANGLES);
 
 	//Reset
 	/*
@@ -348,262 +962,484 @@ void GTR::Renderer::renderDepthMap(RenderCall* rc, Camera* light_camera)
 
 }
 
-//Singlepass lighting
-void GTR::Renderer::SinglePassLoop(Mesh* mesh, Shader* shader)
+//Cone (apex, normalized direction, angle and range) against sphere test, conservative
+static bool ConeSphereOverlap(const Vector3& apex, const Vector3& direction, float angle, float range, const Vector3& center, float radius)
 {
-	//Blending support
-	glDepthFunc(GL_LEQUAL);
+	Vector3 v = center - apex;
+	float v_length_sq = v.dot(v);
+	float v1_length = v.dot(direction);
+	float distance_closest_point = cos(angle) * sqrt(max(v_length_sq - v1_length * v1_length, 0.0f)) - v1_length * sin(angle);
+	bool angle_cull = distance_closest_point > radius;
+	bool front_cull = v1_length > radius + range;
+	bool back_cull = v1_length < -radius;
+	return !(angle_cull || front_cull || back_cull);
+}
 
-	//Loop variables
-	int const lights_size = lights.size();
-	int const max_num_lights = 5; //Single pass lighting accepts at most 5 lights
-	int starting_light = 0;
-	int final_light = min(max_num_lights - 1, lights_size - 1);
-
-	//Lights properties vectors
-	std::vector<Vector3> lights_position;
-	std::vector<Vector3> lights_color;
-	std::vector<float> lights_intensity;
-	std::vector<float> lights_max_distance;
-	std::vector<int> lights_type;
-
-	//Spot lights vectors
-	std::vector<Vector3> spots_direction;
-	std::vector<Vector2> spots_cone;
-
-	//Directional lights vectors
-	std::vector<Vector3> directionals_front;
-
-	//Shadows vectors
-	std::vector<int> cast_shadows;
-	std::vector<float> shadows_index;
-	std::vector<float> shadows_bias;
-	std::vector<Matrix44> shadows_vp;
-
-	//Reserve memory
-	lights_position.reserve(max_num_lights);
-	lights_color.reserve(max_num_lights);
-	lights_intensity.reserve(max_num_lights);
-	lights_max_distance.reserve(max_num_lights);
-	lights_type.reserve(max_num_lights);
-	spots_direction.reserve(max_num_lights);
-	spots_cone.reserve(max_num_lights);
-	directionals_front.reserve(max_num_lights);
-	cast_shadows.reserve(max_num_lights);
-	shadows_index.reserve(max_num_lights);
-	shadows_bias.reserve(max_num_lights);
-	shadows_vp.reserve(max_num_lights);
-
-	//Single pass lighting
-	while (starting_light < lights_size)
-	{
-		if (starting_light == 5)
+//Per object light culling
+int GTR::Renderer::cullLights(const BoundingBox& world_bounding_box, LightEntity** call_lights)
+{
+	int num_call_lights = 0;
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		bool reaches = true;
+		if (scene->light_culling && light->light_type != DIRECTIONAL)
 		{
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-			shader->setUniform("u_ambient_light", Vector3());
+			//Point lights and spots: sphere of influence against the AABB
+			Vector3 position = light->model.getTranslation();
+			reaches = BoundingBoxSphereOverlap(world_bounding_box, position, light->max_distance);
+
+			//Spots with a valid cone: cone against the sphere that bounds the AABB
+			bool valid_cone = !((light->cone_angle < 2.0 && light->cone_angle > -2.0) || light->cone_angle < -90.0 || light->cone_angle > 90.0);
+			if (reaches && light->light_type == SPOT && valid_cone)
+			{
+				Vector3 direction = light->model.rotateVector(Vector3(0, 0, -1));
+				direction.normalize();
+				reaches = ConeSphereOverlap(position, direction, fabs(light->cone_angle) * DEG2RAD, light->max_distance, world_bounding_box.center, world_bounding_box.halfsize.length());
+			}
 		}
-		if (final_light == lights_size - 1) shader->setUniform("u_last_iteration", 1);
-		else shader->setUniform("u_last_iteration", 0);
 
-		//Support variables
-		int num_lights = final_light - starting_light + 1;
-		int j = 0;
+		if (reaches)
+			call_lights[num_call_lights++] = light;
+	}
 
-		for (int i = starting_light; i <= final_light; i++)
-		{
-			//Current Light
-			LightEntity* light = lights[i];
+	//Passes avoided with respect to lighting the object with every light
+	int num_lights = (int)lights.size();
+	if (scene->render_type == Multipass)
+		light_passes_saved += max(num_lights, 1) - max(num_call_lights, 1);
+	else
+		light_passes_saved += max((num_lights + 4) / 5, 1) - max((num_call_lights + 4) / 5, 1);
 
-			//General light properties
-			lights_position[j] = light->model.getTranslation();
-			lights_color[j] = light->color;
-			lights_intensity[j] = light->intensity;
-			lights_max_distance[j] = light->max_distance;
+	return num_call_lights;
+}
 
-			//Specific light properties
-			switch (light->light_type)
-			{
-				case(eLightType::POINT):
-					lights_type[j] = light->light_type;
-					break;
-				case (eLightType::SPOT):
-					if ((light->cone_angle < 2.0 && light->cone_angle > -2.0) || light->cone_angle < -90.0 || light->cone_angle > 90.0) lights_type[j] = eLightType::POINT;
-					else
-					{
-						spots_direction[j] = light->model.rotateVector(Vector3(0, 0, -1));
-						spots_cone[j] = Vector2(light->cone_exp, cos(light->cone_angle * DEG2RAD));
-						lights_type[j] = light->light_type;
-					}
-					break;
-				case (eLightType::DIRECTIONAL):
-					directionals_front[j] = light->model.rotateVector(Vector3(0, 0, -1));
-					lights_type[j] = light->light_type;
-					break;
-			}
+//Singlepass lighting
+void GTR::Renderer::SinglePassLoop(Mesh* mesh, Shader* shader, int num_instances, LightEntity** call_lights, int num_call_lights)
+{
+	//Loop variables
+	int const lights_size = num_call_lights;
+	int const max_num_lights = 5; //Single pass lighting accepts at most 5 lights
+	int starting_light = 0;
+	int final_light = -1;
 
-			//Shadow properties
-			if (scene->shadow_atlas && light->cast_shadows)
-			{		
-				cast_shadows[j] = 1;
-				shadows_index[j] = (float) light->shadow_index;
-				shadows_bias[j] = light->shadow_bias;
-				shadows_vp[j] = light->light_camera->viewprojection_matrix;	
-			}
-			else
-			{
-				cast_shadows[j] = 0;
-			}
+	//Indices of the lights of each pass in the light block (transient memory from the frame arena)
+	int* light_indices = frame_arena.alloc<int>(max_num_lights);
 
-			//Update iterator
-			j++;		
-		}
+	//Shadow Atlas
+	if (scene->shadow_atlas) shader->setUniform(uniforms::u_shadow_atlas, scene->shadow_atlas, 8);
 
-		//Upload light uniforms
-		shader->setUniform3Array("u_lights_position", (float*)&lights_position[0], num_lights);
-		shader->setUniform3Array("u_lights_color", (float*)&lights_color[0], num_lights);
-		shader->setUniform1Array("u_lights_intensity", &lights_intensity[0], num_lights);
-		shader->setUniform1Array("u_lights_max_distance", &lights_max_distance[0], num_lights);
-		shader->setUniform1Array("u_lights_type", &lights_type[0], num_lights);
-		shader->setUniform3Array("u_spots_direction", (float*)&spots_direction[0], num_lights);
-		shader->setUniform2Array("u_spots_cone", (float*)&spots_cone[0], num_lights);
-		shader->setUniform3Array("u_directionals_front", (float*)&directionals_front[0], num_lights);
-		shader->setUniform("u_num_lights", num_lights);
-
-		//Upload shadow uniforms
-		shader->setUniform1Array("u_cast_shadows", &cast_shadows[0], num_lights);
-		shader->setUniform1Array("u_shadows_index", &shadows_index[0], num_lights);
-		shader->setUniform1Array("u_shadows_bias", &shadows_bias[0], num_lights);
-		shader->setMatrix44Array("u_shadows_vp", &shadows_vp[0], num_lights);
-		shader->setUniform("u_num_shadows", (float)scene->num_shadows);
-
-		//Shadow Atlas
-		if (scene->shadow_atlas) 
+	//Single pass lighting (there is always a first pass for the ambient and emissive light, even without lights)
+	do
+	{
+		//Lights of the pass: all of them must be in the same light block
+		if (lights_size)
 		{
-			shader->setTexture("u_shadow_atlas", scene->shadow_atlas, 8);
-			shader->setUniform("u_shadows", 1);
+			int light_block = call_lights[starting_light]->block_index / MAX_BLOCK_LIGHTS;
+			final_light = starting_light;
+			while (final_light + 1 < lights_size && final_light + 1 - starting_light < max_num_lights && call_lights[final_light + 1]->block_index / MAX_BLOCK_LIGHTS == light_block)
+				final_light++;
 		}
-		else
+
+		if (starting_light > 0)
 		{
-			shader->setUniform("u_shadows", 0);
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 		}
+		shader->setUniform(uniforms::u_first_iteration, starting_light == 0);
+		shader->setUniform(uniforms::u_last_iteration, final_light == lights_size - 1);
+
+		//Upload the lights of the pass
+		int num_lights = final_light - starting_light + 1;
+		for (int i = starting_light; i <= final_light; i++)
+			light_indices[i - starting_light] = bindLightBlock(call_lights[i]);
+		shader->setUniformArray(uniforms::u_light_indices, 1, light_indices, num_lights);
+		shader->setUniform(uniforms::u_num_lights, num_lights);
 
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		if (num_instances) mesh->renderInstanced(GL_TRIANGLES, num_instances);
+		else mesh->render(GL_TRIANGLES);
 
 		//Update variables
 		starting_light = final_light + 1;
-		final_light = min(max_num_lights + final_light, lights_size - 1);
-
-	}
-	//disable shader
-	shader->disable();
 
-	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS);
+	} while (starting_light < lights_size);
 }
 
 //Multipass lighting
-void GTR::Renderer::MultiPassLoop(Mesh* mesh, Shader* shader)
+void GTR::Renderer::MultiPassLoop(Mesh* mesh, Shader* shader, int num_instances, LightEntity** call_lights, int num_call_lights)
 {
-	//Blending support
-	glDepthFunc(GL_LEQUAL);
+	//Shadow Atlas
+	if (scene->shadow_atlas) shader->setUniform(uniforms::u_shadow_atlas, scene->shadow_atlas, 8);
 
-	//Multi pass lighting
-	for (int i = 0; i < lights.size(); i++) {
+	//No light reaches the object: a single pass with the ambient and emissive light
+	if (num_call_lights == 0)
+	{
+		shader->setUniform(uniforms::u_first_iteration, true);
+		shader->setUniform(uniforms::u_last_iteration, true);
+		shader->setUniform(uniforms::u_light_index, -1);
+		if (num_instances) mesh->renderInstanced(GL_TRIANGLES, num_instances);
+		else mesh->render(GL_TRIANGLES);
+	}
 
-		if (i == 0) shader->setUniform("u_last_iteration", 0);
+	//Multi pass lighting
+	for (int i = 0; i < num_call_lights; i++) {
 
 		if (i == 1)
 		{
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-			shader->setUniform("u_ambient_light", Vector3());//reset the ambient light
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 		}
-		if (i == lights.size() - 1) shader->setUniform("u_last_iteration", 1);
+		shader->setUniform(uniforms::u_first_iteration, i == 0);
+		shader->setUniform(uniforms::u_last_iteration, i == num_call_lights - 1);
 
-		//Current light
-		LightEntity* light = lights[i];
+		//Current light (its data is in one of the light blocks)
+		shader->setUniform(uniforms::u_light_index, bindLightBlock(call_lights[i]));
+
+		//do the draw call that renders the mesh into the screen
+		if (num_instances) mesh->renderInstanced(GL_TRIANGLES, num_instances);
+		else mesh->render(GL_TRIANGLES);
+	}
+}
 
-		//Light uniforms
-		shader->setUniform("u_light_position", light->model.getTranslation());
-		shader->setUniform("u_light_color", light->color);
-		shader->setUniform("u_light_intensity", light->intensity);
-		shader->setUniform("u_light_max_distance", light->max_distance);
+//Uploads the uniforms of one light (used by the passes that render a light at a time)
+void GTR::Renderer::setLightUniforms(Shader* shader, LightEntity* light)
+{
+	shader->setUniform(uniforms::u_light_position, light->model.getTranslation());
+	shader->setUniform(uniforms::u_light_color, light->color);
+	shader->setUniform(uniforms::u_light_intensity, light->intensity);
+	shader->setUniform(uniforms::u_light_max_distance, light->max_distance);
 
-		//Specific light uniforms
-		switch (light->light_type)
+	//Specific light uniforms
+	switch (light->light_type)
+	{
+	case(eLightType::POINT):
+		shader->setUniform(uniforms::u_light_type, 0);
+		break;
+	case (eLightType::SPOT):
+		if ((light->cone_angle < 2.0 && light->cone_angle > -2.0) || light->cone_angle < -90.0 || light->cone_angle > 90.0) shader->setUniform(uniforms::u_light_type, 0);
+		else
 		{
-		case(eLightType::POINT):
-			shader->setUniform("u_light_type", 0);
-			break;
-		case (eLightType::SPOT):
-			if ((light->cone_angle < 2.0 && light->cone_angle > -2.0) || light->cone_angle < -90.0 || light->cone_angle > 90.0) shader->setUniform("u_light_type", 0);
-			else
-			{
-				shader->setVector3("u_spot_direction", light->model.rotateVector(Vector3(0, 0, -1)));
-				shader->setUniform("u_spot_cone", Vector2(light->cone_exp, cos(light->cone_angle * DEG2RAD)));
-				shader->setUniform("u_light_type", 1);
-			}
-			break;
-		case (eLightType::DIRECTIONAL):
-			shader->setVector3("u_directional_front", light->model.rotateVector(Vector3(0, 0, -1)));
-			shader->setUniform("u_area_size", light->area_size);
-			shader->setUniform("u_light_type", 2);
-			break;
+			shader->setUniform(uniforms::u_spot_direction, light->model.rotateVector(Vector3(0, 0, -1)));
+			shader->setUniform(uniforms::u_spot_cone, Vector2(light->cone_exp, cos(light->cone_angle * DEG2RAD)));
+			shader->setUniform(uniforms::u_light_type, 1);
 		}
+		break;
+	case (eLightType::DIRECTIONAL):
+		shader->setUniform(uniforms::u_directional_front, light->model.rotateVector(Vector3(0, 0, -1)));
+		shader->setUniform(uniforms::u_area_size, light->area_size);
+		shader->setUniform(uniforms::u_light_type, 2);
+		break;
+	}
 
-		//Shadow uniforms
-		if (scene->shadow_atlas && light->cast_shadows)
+	//Shadow uniforms
+	if (scene->shadow_atlas && light->hasShadowMap())
+	{
+		shader->setUniform(uniforms::u_cast_shadows, 1);
+		shader->setUniformArray(uniforms::u_shadow_rect, 4, (float*)light->shadow_rect, MAX_SHADOW_MAPS);
+		shader->setUniformArray(uniforms::u_cascade_scale_offset, 4, (float*)light->cascade_scale_offset, MAX_SHADOW_CASCADES);
+		shader->setUniformArray(uniforms::u_cascade_scroll, 2, (float*)light->cascade_scroll, MAX_SHADOW_CASCADES);
+		shader->setUniform(uniforms::u_shadow_bias, light->shadow_bias);
+		shader->setUniform(uniforms::u_shadow_vp, light->getShadowMatrix());
+		shader->setUniform(uniforms::u_shadow_atlas, scene->shadow_atlas, 8);
+	}
+	else
+	{
+		shader->setUniform(uniforms::u_cast_shadows, 0);
+	}
+}
+
+//Clustered forward lighting
+void GTR::Renderer::ClusteredLoop(Mesh* mesh, Shader* shader, int num_instances)
+{
+	//Light buffers of the clusters
+	light_clusters.bind(shader, camera, 9);
+	shader->setUniform(uniforms::u_first_iteration, true);
+	shader->setUniform(uniforms::u_last_iteration, true);
+
+	//Shadow Atlas
+	if (scene->shadow_atlas) shader->setUniform(uniforms::u_shadow_atlas, scene->shadow_atlas, 8);
+
+	//do the draw call that renders the mesh into the screen (only once, whatever the number of lights)
+	if (num_instances) mesh->renderInstanced(GL_TRIANGLES, num_instances);
+	else mesh->render(GL_TRIANGLES);
+}
+
+//Deferred shading
+void GTR::Renderer::renderDeferred(const int* calls, int num_calls, Camera* camera)
+{
+	int window_width = Application::instance->window_width;
+	int window_height = Application::instance->window_height;
+
+	//(Re)create the G-buffers with the size of the window
+	if (!gbuffers_fbo || gbuffers_fbo->width != window_width || gbuffers_fbo->height != window_height)
+	{
+		if (!gbuffers_fbo) gbuffers_fbo = new FBO();
+		gbuffers_fbo->create(window_width, window_height, 4, GL_RGBA, GL_HALF_FLOAT);
+	}
+
+	//Split the calls: opaque ones go to the G-buffers, blended ones are rendered forward at the end
+	int* opaque_calls = frame_arena.alloc<int>(num_calls);
+	int* blended_calls = frame_arena.alloc<int>(num_calls);
+	int num_opaque_calls = 0;
+	int num_blended_calls = 0;
+	for (int i = 0; i < num_calls; ++i)
+	{
+		if (render_list.materials[calls[i]]->alpha_mode == eAlphaMode::BLEND) blended_calls[num_blended_calls++] = calls[i];
+		else opaque_calls[num_opaque_calls++] = calls[i];
+	}
+
+	//Geometry pass
+	gbuffers_fbo->bind();
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	renderCalls(opaque_calls, num_opaque_calls, camera, false);
+	issueOcclusionQueries(camera);
+	gbuffers_fbo->unbind();
+	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+
+	//Lighting passes: fullscreen quads that read the G-buffers
+	Mesh* quad = Mesh::getQuad();
+	Shader* shader = Shader::Get("deferred");
+	if (!shader)
+		return;
+	shader->enable();
+
+	Matrix44 inverse_viewprojection = camera->viewprojection_matrix;
+	inverse_viewprojection.inverse();
+
+	shader->setTexture("u_gb0_texture", gbuffers_fbo->color_textures[0], 0);
+	shader->setTexture("u_gb1_texture", gbuffers_fbo->color_textures[1], 1);
+	shader->setTexture("u_gb2_texture", gbuffers_fbo->color_textures[2], 2);
+	shader->setTexture("u_gb3_texture", gbuffers_fbo->color_textures[3], 3);
+	shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+	shader->setUniform("u_inverse_viewprojection", inverse_viewprojection);
+	shader->setUniform("u_iRes", Vector2(1.0f / window_width, 1.0f / window_height));
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_ambient_light", scene->ambient_light);
+	shader->setUniform("u_occlusion", scene->occlusion);
+	shader->setUniform("u_specular_light", scene->specular_light);
+	shader->setUniform("u_emissive_materials", scene->emissive_materials);
+	GLState::disable(GL_CULL_FACE);
+	GLState::disable(GL_BLEND);
+
+	//Ambient and emissive pass: it also writes the scene depth for the forward passes
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::depthFunc(GL_ALWAYS);
+	shader->setUniform("u_light_type", -1);
+	shader->setUniform("u_cast_shadows", 0);
+	quad->render(GL_TRIANGLES);
+
+	//One additive pass per light, limited to the screen region it can reach
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::depthMask(false);
+	GLState::enable(GL_BLEND);
+	GLState::blendFunc(GL_ONE, GL_ONE);
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		Vector4 rect;
+		if (light->light_type != DIRECTIONAL && getLightScissor(light, camera, rect))
 		{
-			shader->setUniform("u_cast_shadows", 1);
-			shader->setUniform("u_shadow_index", (float)light->shadow_index);
-			shader->setUniform("u_shadow_bias", light->shadow_bias);
-			shader->setMatrix44("u_shadow_vp", light->light_camera->viewprojection_matrix);
-			shader->setTexture("u_shadow_atlas", scene->shadow_atlas, 8);
-			shader->setUniform("u_num_shadows", (float)scene->num_shadows);
+			if (rect.z <= 0 || rect.w <= 0)
+				continue; //out of the screen
+			GLState::enable(GL_SCISSOR_TEST);
+			GLState::scissor((int)rect.x, (int)rect.y, (int)rect.z, (int)rect.w);
 		}
 		else
-		{
-			shader->setUniform("u_cast_shadows", 0);
-		}
-		
-		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
-	}
+			GLState::disable(GL_SCISSOR_TEST);
 
-	//disable shader
+		setLightUniforms(shader, light);
+		quad->render(GL_TRIANGLES);
+	}
 	shader->disable();
 
 	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS);
+	GLState::disable(GL_SCISSOR_TEST);
+	GLState::disable(GL_BLEND);
+	GLState::depthMask(true);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::depthFunc(GL_LESS);
+
+	//Blended materials are rendered forward on top
+	renderCalls(blended_calls, num_blended_calls, camera, false);
 }
 
-//Create a shadow atlas
-void GTR::Renderer::createShadowAtlas()
+//Writes the material properties into the G-buffers
+void GTR::Renderer::GBufferPass(Mesh* mesh, Shader* shader, int num_instances)
 {
-	//Delete the former atlas and continue
-	if (scene->fbo)
+	GLState::disable(GL_BLEND);
+
+	//do the draw call that renders the mesh into the G-buffers
+	if (num_instances) mesh->renderInstanced(GL_TRIANGLES, num_instances);
+	else mesh->render(GL_TRIANGLES);
+}
+
+//Screen rectangle of the light sphere
+bool GTR::Renderer::getLightScissor(LightEntity* light, Camera* camera, Vector4& rect)
+{
+	int window_width = Application::instance->window_width;
+	int window_height = Application::instance->window_height;
+	Vector3 center = light->model.getTranslation();
+	float radius = light->max_distance;
+
+	//Project the corners of the box that bounds the light sphere
+	Vector2 rect_min(FLT_MAX, FLT_MAX);
+	Vector2 rect_max(-FLT_MAX, -FLT_MAX);
+	for (int i = 0; i < 8; ++i)
 	{
-		delete scene->fbo;
-		scene->fbo = NULL;
-		scene->shadow_atlas = NULL;
+		Vector3 corner = center + Vector3(i & 1 ? radius : -radius, i & 2 ? radius : -radius, i & 4 ? radius : -radius);
+		Vector4 clip = camera->viewprojection_matrix * Vector4(corner, 1.0f);
 
-		if (scene->num_shadows == 0)
-			return;
+		//A corner behind the camera: the projection is not valid, so use the whole screen
+		if (clip.w <= camera->near_plane)
+			return false;
 
+		Vector2 screen((clip.x / clip.w * 0.5f + 0.5f) * window_width, (clip.y / clip.w * 0.5f + 0.5f) * window_height);
+		rect_min.set(min(rect_min.x, screen.x), min(rect_min.y, screen.y));
+		rect_max.set(max(rect_max.x, screen.x), max(rect_max.y, screen.y));
 	}
 
+	//Clip to the screen
+	rect_min.set(clamp(floor(rect_min.x), 0.0f, (float)window_width), clamp(floor(rect_min.y), 0.0f, (float)window_height));
+	rect_max.set(clamp(ceil(rect_max.x), 0.0f, (float)window_width), clamp(ceil(rect_max.y), 0.0f, (float)window_height));
+	rect.set(rect_min.x, rect_min.y, rect_max.x - rect_min.x, rect_max.y - rect_min.y);
+	return true;
+}
+
+//Create a shadow atlas
+void GTR::Renderer::createShadowAtlas(int size)
+{
+	//Delete the former atlas and continue
+	deleteShadowAtlas();
+
 	//New shadow atlas
 	scene->fbo = new FBO();
-	scene->fbo->setDepthOnly(shadow_map_resolution * scene->num_shadows, shadow_map_resolution); //We create it wide in order to save memory space and improve shadow map management
+	scene->fbo->setDepthOnly(size, size);
 	scene->shadow_atlas = scene->fbo->depth_texture;
+
+	//Static layer, with the same regions
+	if (scene->static_shadows)
+	{
+		static_shadow_fbo = new FBO();
+		static_shadow_fbo->setDepthOnly(size, size);
+	}
+}
+
+void GTR::Renderer::deleteShadowAtlas()
+{
+	if (!scene->fbo)
+		return;
+	delete scene->fbo;
+	scene->fbo = NULL;
+	scene->shadow_atlas = NULL;
+	delete static_shadow_fbo;
+	static_shadow_fbo = NULL;
+}
+
+//The atlas has space for 4 shadow maps of the chosen resolution (or 16 of the next tier...), within the texture size limit
+int GTR::Renderer::getShadowAtlasSize()
+{
+	static int max_texture_size = 0;
+	if (!max_texture_size)
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	return std::min(shadow_map_resolution * 2, max_texture_size);
+}
+
+//Finds the entities that appeared, disappeared or moved since the shadow maps saw them: their old and new boxes are the
+//only places where the shadows may have changed (in the static or the dynamic layer, depending on the entity)
+void GTR::Renderer::findShadowChanges()
+{
+	static_shadow_changes.clear();
+	dynamic_shadow_changes.clear();
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (ent->entity_type != PREFAB)
+			continue;
+
+		//The transforms of the visible entities are up to date after the traversal
+		PrefabEntity* pent = (PrefabEntity*)ent;
+		bool visible = pent->visible && pent->prefab;
+		if (visible == pent->shadow_visible && (!visible || (pent->transforms_version == pent->shadow_transforms_version && pent->is_static == pent->shadow_static)))
+			continue;
+
+		if (pent->shadow_visible) (pent->shadow_static ? static_shadow_changes : dynamic_shadow_changes).push_back(pent->shadow_bounding_box);
+		if (visible) (pent->is_static ? static_shadow_changes : dynamic_shadow_changes).push_back(pent->world_bounding_box);
+		pent->shadow_visible = visible;
+		pent->shadow_static = pent->is_static;
+		pent->shadow_transforms_version = pent->transforms_version;
+		pent->shadow_bounding_box = pent->world_bounding_box;
+	}
+}
+
+//Whether some change of the frame is inside the frustum of a shadow camera
+bool GTR::Renderer::isShadowInvalidated(Camera* light_camera, const std::vector<BoundingBox>& changes)
+{
+	for (int i = 0; i < changes.size(); ++i)
+		if (light_camera->testBoxInFrustum(changes[i].center, changes[i].halfsize) != CLIP_OUTSIDE)
+			return true;
+	return false;
+}
+
+//Renders the shadow casters seen by a light camera into a region of the atlas.
+//With the static layer, the static casters are only rendered (into the static atlas) when they changed; the map starts
+//as a copy of that region and only the dynamic casters are rendered over it
+void GTR::Renderer::renderShadowMap(Camera* light_camera, const Vector4& shadow_region, bool static_changed, const int* caster_calls, int num_caster_calls)
+{
+	int x = (int)shadow_region.x;
+	int y = (int)shadow_region.y;
+	int width = (int)shadow_region.z;
+	int height = (int)shadow_region.w;
+	shadow_texels_rendered += width * height;
+
+	//The multi-view path renders all the queued views together after the lights
+	if (queue_shadow_views)
+	{
+		ShadowView view;
+		view.camera = *light_camera;
+		view.region = shadow_region;
+		view.static_changed = static_changed;
+		view.caster_calls = caster_calls;
+		view.num_caster_calls = num_caster_calls;
+		shadow_views.push_back(view);
+		return;
+	}
+
+	GLState::scissor(x, y, width, height);
+	GLState::enable(GL_SCISSOR_TEST);
+
+	//Static layer
+	if (static_shadow_fbo && static_changed)
+	{
+		static_shadow_fbo->bind();
+		GLState::viewport(x, y, width, height);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		renderShadowCasters(light_camera, STATIC_CASTERS, caster_calls, num_caster_calls);
+		static_shadow_fbo->unbind();
+	}
+
+	//Copy the static layer into the map (the blit is limited by the scissor too)
+	scene->fbo->bind();
+	GLState::viewport(x, y, width, height);
+	if (static_shadow_fbo)
+	{
+		GLState::bindFramebuffer(GL_READ_FRAMEBUFFER, static_shadow_fbo->fbo_id);
+		glBlitFramebuffer(x, y, x + width, y + height, x, y, x + width, y + height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		GLState::bindFramebuffer(GL_READ_FRAMEBUFFER, scene->fbo->fbo_id);
+		renderShadowCasters(light_camera, DYNAMIC_CASTERS, caster_calls, num_caster_calls);
+	}
+	else
+	{
+		glClear(GL_DEPTH_BUFFER_BIT);
+		renderShadowCasters(light_camera, ALL_CASTERS, caster_calls, num_caster_calls);
+	}
+	scene->fbo->unbind();
+
+	GLState::disable(GL_SCISSOR_TEST);
 }
 
 //Compute spot shadow map into the shadow atlas
-void GTR::Renderer::computeSpotShadowMap(LightEntity* light)
+void GTR::Renderer::computeSpotShadowMap(LightEntity* light, bool static_changed)
 {
 	//Speed boost
 	glColorMask(false, false, false, false);
@@ -611,19 +1447,9 @@ void GTR::Renderer::computeSpotShadowMap(LightEntity* light)
 	//For the first render
 	if (!light->light_camera) light->light_camera = new Camera();
 
-	//Bind the fbo
-	scene->fbo->bind();
-
-	//Set the atlas region of the shadow map to work on
-	Vector4 shadow_region(light->shadow_index * shadow_map_resolution, 0, shadow_map_resolution, shadow_map_resolution);
-
-	//Activate flags on the shadow region
-	glViewport(shadow_region.x, shadow_region.y, shadow_region.z, shadow_region.w);
-	glScissor(shadow_region.x, shadow_region.y, shadow_region.z, shadow_region.w);
-	glEnable(GL_SCISSOR_TEST);
-
-	//Clear Depth Buffer on the shadow region
-	glClear(GL_DEPTH_BUFFER_BIT);
+	//A single map, the first one (not scrolled)
+	light->cascade_scale_offset[0].set(1, 1, 0, 0);
+	light->cascade_scroll[0].set(0, 0);
 
 	//Light camera
 	Camera* light_camera = light->light_camera;
@@ -646,91 +1472,385 @@ void GTR::Renderer::computeSpotShadowMap(LightEntity* light)
 	//Enable camera
 	light_camera->enable();
 
-	for (int i = 0; i < render_calls.size(); ++i)
+	//Render the shadow casters into the region of the map
+	renderShadowMap(light_camera, light->shadow_region[0], static_changed);
+
+	//Reset
+	GLState::viewport(0, 0, Application::instance->window_width, Application::instance->window_height);
+	glColorMask(true, true, true, true);
+
+}
+
+//Position of a texel of the light view in a toroidal map of the given resolution
+static int wrapShadowTexel(int texel, int resolution)
+{
+	int wrapped = texel % resolution;
+	return wrapped < 0 ? wrapped + resolution : wrapped;
+}
+
+//Front and up of the light cameras of the cube faces of a point light (the shaders rebuild the same views)
+static const Vector3 cube_face_front[MAX_SHADOW_MAPS] = { Vector3(1, 0, 0), Vector3(-1, 0, 0), Vector3(0, 1, 0), Vector3(0, -1, 0), Vector3(0, 0, 1), Vector3(0, 0, -1) };
+static const Vector3 cube_face_up[MAX_SHADOW_MAPS] = { Vector3(0, 1, 0), Vector3(0, 1, 0), Vector3(0, 0, 1), Vector3(0, 0, 1), Vector3(0, 1, 0), Vector3(0, 1, 0) };
+
+//Compute the six cube faces of a point light shadow into the shadow atlas, returns the number of faces rendered.
+//The casters reached by the light are listed once and culled against every face before drawing, so each face only
+//draws its own casters and a face without casters is just cleared (and left alone while it stays empty).
+//Unless forced, a face is only rendered again if an entity changed inside its frustum.
+int GTR::Renderer::computePointShadowMap(LightEntity* light, bool force)
+{
+	//For the first render
+	if (!light->light_camera) light->light_camera = new Camera();
+
+	//All the faces share the projection: 90 degrees, square
+	Camera* light_camera = light->light_camera;
+	Vector3 position = light->model.getTranslation();
+	light_camera->setPerspective(90.0f, 1.0f, 0.1f, light->max_distance);
+
+	//Casters inside the sphere of the light
+	int* casters = frame_arena.alloc<int>(render_list.size());
+	int num_casters = 0;
+	for (int i = 0; i < render_list.size(); ++i)
+	{
+		int call = render_list.order[i];
+		if (render_list.materials[call]->alpha_mode != eAlphaMode::BLEND && BoundingBoxSphereOverlap(render_list.world_bounding_boxes[call], position, light->max_distance))
+			casters[num_casters++] = call;
+	}
+
+	//Speed boost
+	glColorMask(false, false, false, false);
+
+	int num_rendered = 0;
+	for (int i = 0; i < MAX_SHADOW_MAPS; ++i)
 	{
-		RenderCall* rc = render_calls[i];
-		if (rc->material->alpha_mode == eAlphaMode::BLEND)
+		//Set View Matrix
+		light_camera->lookAt(position, position + cube_face_front[i], cube_face_up[i]);
+
+		//Keep the face if nothing changed in it
+		bool static_changed = force || isShadowInvalidated(light_camera, static_shadow_changes);
+		if (!static_changed && !isShadowInvalidated(light_camera, dynamic_shadow_changes))
 			continue;
 
-		if (light_camera->testBoxInFrustum(rc->world_bounding_box.center, rc->world_bounding_box.halfsize))
+		//Casters of the face (a list per face, the multi-view path renders them later)
+		int* face_casters = frame_arena.alloc<int>(num_casters);
+		int num_face_casters = 0;
+		for (int j = 0; j < num_casters; ++j)
+		{
+			const BoundingBox& box = render_list.world_bounding_boxes[casters[j]];
+			if (light_camera->testBoxInFrustum(box.center, box.halfsize) != CLIP_OUTSIDE)
+				face_casters[num_face_casters++] = casters[j];
+		}
+
+		//An empty face only has to be cleared once
+		int face_bit = 1 << i;
+		bool was_empty = (light->shadow_empty_faces & face_bit) != 0;
+		if (num_face_casters == 0)
 		{
-			renderDepthMap(rc, light_camera);
+			shadow_faces_culled++;
+			light->shadow_empty_faces |= face_bit;
+			if (was_empty && !force)
+				continue;
 		}
+		else
+			light->shadow_empty_faces &= ~face_bit;
+
+		//Enable camera
+		light_camera->enable();
+
+		//Render the casters of the face into its region of the atlas
+		renderShadowMap(light_camera, light->shadow_region[i], static_changed, face_casters, num_face_casters);
+		num_rendered++;
 	}
-	//Unbind the fbo
-	scene->fbo->unbind();
 
 	//Reset
-	glViewport(0, 0, Application::instance->window_width, Application::instance->window_height);
+	GLState::viewport(0, 0, Application::instance->window_width, Application::instance->window_height);
 	glColorMask(true, true, true, true);
-	glDisable(GL_SCISSOR_TEST);
 
+	return num_rendered;
 }
 
-//Compute directional shadow maps into the shadow atlas
-void GTR::Renderer::computeDirectionalShadowMap(LightEntity* light)
+//Renders the texels [x0,x1)x[y0,y1) of the light view into a toroidal shadow map: a texel goes to its position modulo the
+//resolution of the map, so the rectangle is split where it wraps around and every piece gets its own projection
+void GTR::Renderer::renderShadowTexels(Camera* light_camera, const Vector4& shadow_region, float texel_size, int x0, int y0, int x1, int y1, bool static_changed)
 {
-	//Speed boost
-	glColorMask(false, false, false, false);
+	int resolution = (int)shadow_region.z;
+	float near_plane = light_camera->near_plane;
+	float far_plane = light_camera->far_plane;
+	for (int y = y0; y < y1;)
+	{
+		int map_y = wrapShadowTexel(y, resolution);
+		int height = std::min(y1 - y, resolution - map_y);
+		for (int x = x0; x < x1;)
+		{
+			int map_x = wrapShadowTexel(x, resolution);
+			int width = std::min(x1 - x, resolution - map_x);
+			light_camera->setOrthographic(x * texel_size, (x + width) * texel_size, y * texel_size, (y + height) * texel_size, near_plane, far_plane);
+			renderShadowMap(light_camera, Vector4(shadow_region.x + map_x, shadow_region.y + map_y, width, height), static_changed);
+			x += width;
+		}
+		y += height;
+	}
+}
 
+//Compute the shadow cascades of a directional light into the shadow atlas, returns the number of cascades rendered
+//The view frustum (up to area_size) is split mixing logarithmic and uniform partitions. Each cascade is an orthographic
+//projection around the bounding sphere of its slice: the sphere only depends on the camera lens, so the size of the
+//texels doesn't change when the camera rotates, and its center is snapped to the texels so the shadows don't shimmer
+//when it moves. All the cascades share the light view and depth range, so the shader goes from the clip space of the
+//first cascade to the others with a scale and an offset.
+//The cascades are clipmaps addressed toroidally: the map keeps the texels of the window that are still inside when it
+//scrolls, so only the strips that entered it are rendered (and the shaders sample it with the scroll offset).
+//Unless forced, a cascade is only rendered again if its bounds moved (a texel or more) or an entity changed inside it.
+int GTR::Renderer::computeDirectionalShadowMap(LightEntity* light, bool force)
+{
 	//For the first render
 	if (!light->light_camera) light->light_camera = new Camera();
 
-	//Bind the fbo
-	scene->fbo->bind();
+	//Light view: the light travels against the front used for shading, the origin is fixed so the snapping is stable
+	Camera* light_camera = light->light_camera;
+	Vector3 light_direction = -1 * light->model.rotateVector(Vector3(0, 0, -1));
+	Vector3 light_up = light->model.rotateVector(Vector3(0, 1, 0));
+	Vector3 light_origin;
+	Matrix44 light_view;
+	light_view.lookAt(light_origin, light_direction, light_up);
+
+	//Split distances of the view frustum
+	int num_cascades = light->getNumShadowMaps();
+	float view_near = camera->near_plane;
+	float view_far = std::max(std::min(camera->far_plane, light->area_size), view_near * 2.0f);
+	float splits[MAX_SHADOW_CASCADES + 1];
+	splits[0] = view_near;
+	for (int i = 1; i <= num_cascades; ++i)
+	{
+		float t = i / (float)num_cascades;
+		float log_split = view_near * pow(view_far / view_near, t);
+		float uniform_split = view_near + (view_far - view_near) * t;
+		splits[i] = light->cascade_lambda * log_split + (1.0f - light->cascade_lambda) * uniform_split;
+	}
 
-	//Set the atlas region of the shadow map to work on
-	Vector4 shadow_region(light->shadow_index * shadow_map_resolution, 0, shadow_map_resolution, shadow_map_resolution);
+	//Bounding spheres of the slices, in light view space
+	Vector3 view_front = camera->center - camera->eye;
+	view_front.normalize();
+	float tan_y = tan(camera->fov * 0.5f * DEG2RAD);
+	float tan_x = tan_y * camera->aspect;
+	float k2 = tan_x * tan_x + tan_y * tan_y; //squared distance from the axis to the corners, per unit of depth
+	Vector4 bounds[MAX_SHADOW_CASCADES];
+	float min_depth = 1e30f;
+	float max_depth = -1e30f;
+	for (int i = 0; i < num_cascades; ++i)
+	{
+		float n = splits[i];
+		float f = splits[i + 1];
+		float center_depth = std::min(f, 0.5f * (n + f) * (1.0f + k2));
+		float r = std::max(sqrt((center_depth - n) * (center_depth - n) + n * n * k2), sqrt((f - center_depth) * (f - center_depth) + f * f * k2));
+		r = ceil(r * 16.0f) / 16.0f; //avoids changes of the size due to rounding errors
+
+		//Snap the center to the texels of the cascade
+		float texel_size = 2.0f * r / light->shadow_region[i].z;
+		Vector3 center = light_view * (camera->eye + view_front * center_depth);
+		bounds[i].set(floor(center.x / texel_size) * texel_size, floor(center.y / texel_size) * texel_size, r, light->shadow_region[i].z);
+		min_depth = std::min(min_depth, -center.z - r);
+		max_depth = std::max(max_depth, -center.z + r);
+	}
 
-	//Activate flags on the shadow region
-	glViewport(shadow_region.x, shadow_region.y, shadow_region.z, shadow_region.w);
-	glScissor(shadow_region.x, shadow_region.y, shadow_region.z, shadow_region.w);
-	glEnable(GL_SCISSOR_TEST);
+	//The casters between the light and the slices (up to max_distance) are rendered too. The range is snapped to steps
+	//of the biggest radius, so it only changes (and all the cascades with it) after moving that far
+	float depth_step = bounds[num_cascades - 1].z;
+	Vector2 depth_range(floor((min_depth - light->max_distance) / depth_step) * depth_step, ceil(max_depth / depth_step) * depth_step);
+	if (depth_range.x != light->cascade_depth_range.x || depth_range.y != light->cascade_depth_range.y)
+		force = true;
+	light->cascade_depth_range = depth_range;
 
-	//Clear Depth Buffer on the shadow region
-	glClear(GL_DEPTH_BUFFER_BIT);
+	//Speed boost
+	glColorMask(false, false, false, false);
 
-	//Light camera
-	Camera* light_camera = light->light_camera;
+	//From the last cascade to the first, so the light camera ends with the first one (the one used by the shaders)
+	int num_rendered = 0;
+	for (int i = num_cascades - 1; i >= 0; --i)
+	{
+		//Orthographic Matrix
+		const Vector4& b = bounds[i];
+		light_camera->setOrthographic(b.x - b.z, b.x + b.z, b.y - b.z, b.y + b.z, depth_range.x, depth_range.y);
+
+		//Set View Matrix
+		light_camera->lookAt(light_origin, light_direction, light_up);
+
+		//Clip space of the first cascade to the clip space of this one
+		float scale = bounds[0].z / b.z;
+		light->cascade_scale_offset[i].set(scale, scale, (bounds[0].x - b.x) / b.z, (bounds[0].y - b.y) / b.z);
+
+		//Window of the cascade and the one it had when it was rendered, in texels of the light view
+		int resolution = (int)b.w;
+		float texel_size = 2.0f * b.z / resolution;
+		const Vector4& last = light->cascade_bounds[i];
+		int window_x = (int)lround(b.x / texel_size) - resolution / 2;
+		int window_y = (int)lround(b.y / texel_size) - resolution / 2;
+		int last_x = (int)lround(last.x / texel_size) - resolution / 2;
+		int last_y = (int)lround(last.y / texel_size) - resolution / 2;
+		int dx = window_x - last_x;
+		int dy = window_y - last_y;
+
+		//A change of the static casters or of the cascade size renders the whole window, a small move only the new strips
+		bool resized = b.z != last.z || b.w != last.w;
+		bool scrolled = dx != 0 || dy != 0;
+		bool full = force || resized || abs(dx) >= resolution || abs(dy) >= resolution || isShadowInvalidated(light_camera, static_shadow_changes);
+		bool dynamic_changed = isShadowInvalidated(light_camera, dynamic_shadow_changes);
+		if (!full && !scrolled && !dynamic_changed)
+			continue;
+		light->cascade_bounds[i] = b;
+		light->cascade_scroll[i].set(wrapShadowTexel(window_x, resolution) / (float)resolution, wrapShadowTexel(window_y, resolution) / (float)resolution);
 
-	//Camera properties
-	float halfarea = light->area_size / 2;
-	float camera_aspect = shadow_map_resolution / shadow_map_resolution;
-	float camera_near = 0.1f;
-	float camera_far = light->max_distance;
-	float camera_factor = 1.0f;
-	Vector3 camera_position = camera->center;
-	Vector3 camera_front = camera->center - camera_factor*(camera->eye - camera->center);
-	Vector3 camera_up = -1 * camera->up;
+		//Enable camera
+		light_camera->enable();
 
-	//Orthographic Matrix
-	light_camera->setOrthographic(-halfarea, halfarea, halfarea * camera_aspect, -halfarea * camera_aspect, camera_near, camera_far);
+		//Render the shadow casters into the region of the cascade
+		const Vector4& region = light->shadow_region[i];
+		if (full)
+			renderShadowTexels(light_camera, region, texel_size, window_x, window_y, window_x + resolution, window_y + resolution, true);
+		else
+		{
+			if (scrolled)
+			{
+				//Columns that entered the window, then the rows that entered it (without the corner already rendered)
+				if (dx > 0) renderShadowTexels(light_camera, region, texel_size, last_x + resolution, window_y, window_x + resolution, window_y + resolution, true);
+				if (dx < 0) renderShadowTexels(light_camera, region, texel_size, window_x, window_y, last_x, window_y + resolution, true);
+				int x0 = std::max(window_x, last_x);
+				int x1 = std::min(window_x, last_x) + resolution;
+				if (dy > 0) renderShadowTexels(light_camera, region, texel_size, x0, last_y + resolution, x1, window_y + resolution, true);
+				if (dy < 0) renderShadowTexels(light_camera, region, texel_size, x0, window_y, x1, last_y, true);
+			}
 
-	//Set View Matrix
-	light_camera->lookAt(camera_position, camera_front, camera_up);
+			//The dynamic casters can be anywhere in the window
+			if (dynamic_changed)
+				renderShadowTexels(light_camera, region, texel_size, window_x, window_y, window_x + resolution, window_y + resolution, false);
+		}
 
-	//Enable camera
-	light_camera->enable();
+		//Back to the whole window, the projection used by the shaders
+		light_camera->setOrthographic(b.x - b.z, b.x + b.z, b.y - b.z, b.y + b.z, depth_range.x, depth_range.y);
+		num_rendered++;
+	}
 
-	for (int i = 0; i < render_calls.size(); ++i)
-	{
-		RenderCall* rc = render_calls[i];
-		if (rc->material->alpha_mode == eAlphaMode::BLEND)
-			continue;
+	//Reset
+	GLState::viewport(0, 0, Application::instance->window_width, Application::instance->window_height);
+	glColorMask(true, true, true, true);
+
+	return num_rendered;
+}
+
+//Whether the driver has viewport arrays, needed by the multi-view shadow path
+bool GTR::Renderer::supportsMultiViewShadows()
+{
+	static int supported = -1;
+	if (supported == -1)
+		supported = SDL_GL_ExtensionSupported("GL_ARB_viewport_array") ? 1 : 0;
+	return supported == 1;
+}
+
+//Renders the shadow views queued by the lights in the current frame.
+//The clears and the copies of the static layer are still done per view (they draw nothing), but every caster is drawn
+//once per pass of up to MAX_SHADOW_VIEWS views: a geometry shader projects its triangles into the views whose frustum
+//contains it and routes them to their viewports (regions of the atlas)
+void GTR::Renderer::renderShadowViews()
+{
+	if (shadow_views.empty())
+		return;
 
-		if (light_camera->testBoxInFrustum(rc->world_bounding_box.center, rc->world_bounding_box.halfsize))
+	//Speed boost
+	glColorMask(false, false, false, false);
+	GLState::enable(GL_SCISSOR_TEST);
+	int num_views = (int)shadow_views.size();
+	int* views = frame_arena.alloc<int>(num_views);
+
+	//Static layer: clear the views whose static casters changed and render them again
+	if (static_shadow_fbo)
+	{
+		int num_static_views = 0;
+		static_shadow_fbo->bind();
+		for (int i = 0; i < num_views; ++i)
 		{
-			renderDepthMap(rc, light_camera);
+			if (!shadow_views[i].static_changed)
+				continue;
+			const Vector4& region = shadow_views[i].region;
+			GLState::scissor((int)region.x, (int)region.y, (int)region.z, (int)region.w);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			views[num_static_views++] = i;
 		}
+		renderShadowViewCasters(views, num_static_views, STATIC_CASTERS);
+		static_shadow_fbo->unbind();
 	}
-	//Unbind the fbo
+
+	//Maps: start from a copy of the static layer (or empty) and render the rest of the casters
+	scene->fbo->bind();
+	if (static_shadow_fbo) GLState::bindFramebuffer(GL_READ_FRAMEBUFFER, static_shadow_fbo->fbo_id);
+	for (int i = 0; i < num_views; ++i)
+	{
+		int x = (int)shadow_views[i].region.x;
+		int y = (int)shadow_views[i].region.y;
+		int width = (int)shadow_views[i].region.z;
+		int height = (int)shadow_views[i].region.w;
+		GLState::scissor(x, y, width, height);
+		if (static_shadow_fbo) glBlitFramebuffer(x, y, x + width, y + height, x, y, x + width, y + height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		else glClear(GL_DEPTH_BUFFER_BIT);
+		views[i] = i;
+	}
+	if (static_shadow_fbo) GLState::bindFramebuffer(GL_READ_FRAMEBUFFER, scene->fbo->fbo_id);
+	renderShadowViewCasters(views, num_views, static_shadow_fbo ? DYNAMIC_CASTERS : ALL_CASTERS);
 	scene->fbo->unbind();
 
-	//Reset
-	glViewport(0, 0, Application::instance->window_width, Application::instance->window_height);
+	//Reset (glViewport and glScissor set all the viewports of the array)
+	GLState::disable(GL_SCISSOR_TEST);
+	GLState::viewport(0, 0, Application::instance->window_width, Application::instance->window_height);
 	glColorMask(true, true, true, true);
-	glDisable(GL_SCISSOR_TEST);
+	shadow_views.clear();
+}
 
+//Draws the casters of some queued views into the bound framebuffer, each caster once per pass with the mask of its views
+void GTR::Renderer::renderShadowViewCasters(const int* views, int num_views, eShadowCasters casters)
+{
+	uint32* masks = frame_arena.alloc<uint32>(render_list.size());
+	int* calls = frame_arena.alloc<int>(render_list.size());
+	for (int first = 0; first < num_views; first += MAX_SHADOW_VIEWS)
+	{
+		//Viewports, matrices and casters of the views of the pass
+		num_pass_shadow_views = std::min(num_views - first, MAX_SHADOW_VIEWS);
+		memset(masks, 0, render_list.size() * sizeof(uint32));
+		for (int i = 0; i < num_pass_shadow_views; ++i)
+		{
+			ShadowView& view = shadow_views[views[first + i]];
+			const Vector4& region = view.region;
+			glViewportIndexedf(i, region.x, region.y, region.z, region.w);
+			glScissorIndexed(i, (int)region.x, (int)region.y, (int)region.z, (int)region.w);
+			if (i == 0) //the first one is also the viewport and scissor of the cache
+			{
+				GLState::invalidate(GLState::VIEWPORT);
+				GLState::invalidate(GLState::SCISSOR);
+			}
+			shadow_view_matrices[i] = view.camera.viewprojection_matrix;
+
+			const int* view_calls = view.caster_calls;
+			int num_view_calls = view.num_caster_calls;
+			if (!view_calls)
+			{
+				num_view_calls = gatherFrustumCalls(&view.camera, true, calls);
+				view_calls = calls;
+			}
+			for (int j = 0; j < num_view_calls; ++j)
+				masks[view_calls[j]] |= 1u << i;
+		}
+
+		//Casters of any view of the pass (in submission order, so the instancing batches are kept)
+		int num_calls = 0;
+		for (int i = 0; i < render_list.size(); ++i)
+		{
+			int call = render_list.order[i];
+			if (masks[call] && (casters == ALL_CASTERS || render_list.statics[call] == (casters == STATIC_CASTERS)))
+				calls[num_calls++] = call;
+		}
+
+		shadow_view_masks = masks;
+		shadow_draw_calls += renderCalls(calls, num_calls, NULL, true);
+		shadow_view_masks = NULL;
+		multiview_passes++;
+	}
 }
 
 //Print shadow map in the screen
@@ -753,23 +1873,28 @@ void GTR::Renderer::showShadowAtlas()
 
 	for (int i = 0; i < lights.size(); ++i) 
 	{
-		if (lights[i]->cast_shadows) 
+		if (lights[i]->hasShadowMap()) 
 		{
-			//Only render if lights are in the right scope
-			if (starting_shadow <= lights[i]->shadow_index && lights[i]->shadow_index < final_shadow)
+			//Current Light
+			LightEntity* light = lights[i];
+
+			//Each map of the light (one per cascade) is shown apart
+			for (int j = 0; j < light->getNumShadowMaps(); ++j)
 			{
-				//Current Light
-				LightEntity* light = lights[i];
+				//Only render if the maps are in the right scope
+				int index = light->shadow_index + j;
+				if (index < starting_shadow || index >= final_shadow)
+					continue;
 
 				//Map shadow map into screen coordinates
-				glViewport((light->shadow_index - starting_shadow) * SHOW_ATLAS_RESOLUTION + shadow_offset, 0, SHOW_ATLAS_RESOLUTION, SHOW_ATLAS_RESOLUTION);
+				GLState::viewport((index - starting_shadow) * SHOW_ATLAS_RESOLUTION + shadow_offset, 0, SHOW_ATLAS_RESOLUTION, SHOW_ATLAS_RESOLUTION);
 
-				//Render the shadow map with the linearized shader
+				//Render the shadow map with the linearized shader (orthographic depth is already linear)
 				Shader* shader = Shader::getDefaultShader("linearize");
 				shader->enable();
-				shader->setUniform("u_camera_nearfar", Vector2(light->light_camera->near_plane, light->light_camera->far_plane));
-				shader->setUniform("u_shadow_index", (float)light->shadow_index);
-				shader->setUniform("u_num_shadows", (float)num_shadows);
+				if (light->light_camera->type == Camera::ORTHOGRAPHIC) shader->setUniform("u_camera_nearfar", Vector2(0, 1));
+				else shader->setUniform("u_camera_nearfar", Vector2(light->light_camera->near_plane, light->light_camera->far_plane));
+				shader->setUniform("u_shadow_rect", light->shadow_rect[j]);
 				scene->shadow_atlas->toViewport(shader);
 				shader->disable();
 			}
@@ -780,7 +1905,7 @@ void GTR::Renderer::showShadowAtlas()
 	scene->atlas_scope = shadow_scope;
 
 	//Reset
-	glViewport(0, 0, window_width, window_height);
+	GLState::viewport(0, 0, window_width, window_height);
 
 }
 
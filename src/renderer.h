@@ -1,26 +1,67 @@
 #pragma once
 #include "prefab.h"
 #include "shader.h"
+#include "renderlist.h"
+#include "clusters.h"
+#include "occlusion.h"
+#include "bvh.h"
+#include "shadowatlas.h"
+#include "camera.h"
+#include "uniformbuffer.h"
+#include <unordered_map>
 
 //forward declarations
-class Camera;
+class FBO;
 
 namespace GTR {
 
 	class Prefab;
 	class Material;
 
-	class RenderCall {
-	public:
-		Mesh* mesh;
-		Material* material;
-		Matrix44 model;
-		BoundingBox world_bounding_box;
-		float distance_to_camera;
+	//Which shadow casters of the render list are rendered into a shadow map
+	enum eShadowCasters {
+		ALL_CASTERS = 0,
+		STATIC_CASTERS = 1,
+		DYNAMIC_CASTERS = 2
+	};
+
+	//Views rendered together by each pass of the multi-view shadow path (viewports of the depth_multiview shader)
+	const int MAX_SHADOW_VIEWS = 16;
+
+	//A shadow map (or a piece of one) queued for the multi-view shadow path
+	struct ShadowView {
+		Camera camera; //Copy of the light camera when the view was queued (matrices and frustum)
+		Vector4 region; //Rectangle in the atlas, in pixels
+		bool static_changed; //The static layer of the region has to be rendered again
+		const int* caster_calls; //Casters already culled against the view (transient), NULL to find them in the render list
+		int num_caster_calls;
+	};
+
+	//std140 layout of the uniform blocks of the shader atlas (\blocks and \lights)
+	struct sFrameBlock {
+		Matrix44 viewprojection;
+		Vector3 camera_position;
+		float time;
+		Vector3 ambient_light;
+		int occlusion;
+		int specular_light;
+		int shadows;
+		int padding[2];
+	};
 
-		RenderCall() { distance_to_camera = 10.0f;}
+	struct sMaterialBlock {
+		Vector4 color;
+		float alpha_cutoff;
+		int normal_mapping;
+		int padding[2];
 	};
 
+	//Lights of each light block (16KB, the minimum size of a uniform block that GL grants), the frame uses as many blocks as it needs
+	const int MAX_BLOCK_LIGHTS = 50;
+
+	//Frames in flight of the fragment counters: a query is only read back when its result is available
+	const int FRAGMENTS_QUERY_FRAMES = 3;
+
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
 	class Renderer
@@ -34,36 +75,156 @@ namespace GTR {
 
 		//Render variables
 		std::vector<LightEntity*> lights; //Here we store each Light to be sent to the Shadder.
-		std::vector<RenderCall*> render_calls; // Here we store each RenderCall to be sent to the Shadder.
+		RenderList render_list; // Here we store each render call to be sent to the Shadder. It keeps its memory between frames.
+		std::vector<RenderList> worker_render_lists; // Render calls found by each worker of the parallel traversal
+		std::vector<Prefab*> updated_prefabs; // Prefabs updated in the current frame
+		FrameArena frame_arena; // Transient memory of the current frame, rewinded at the beginning of each frame.
+		LightClusters light_clusters; // Lights binned in the froxels of the view camera (Clustered render type)
+		OcclusionCuller occlusion_culler; // Hardware occlusion queries of the render calls, read with a frame of latency
+		SceneBVH scene_bvh; // Hierarchy of the world bounding boxes of the render calls, refit when the entities move
+		ShadowAtlas shadow_atlas; // Tiers and rectangles of the shadow maps in the atlas
+		UniformBufferRing uniform_ring; // Frame, light and material blocks written every frame
+		std::unordered_map<Material*, int> material_block_offsets; // Offset in the ring of the block of each material of the current frame
+		int bound_material_offset = -1; // Material block bound to the last draw call
+		std::vector<int> light_block_offsets; // Offset in the ring of each light block of the current frame (MAX_BLOCK_LIGHTS lights each)
+		int bound_light_block = -1; // Light block bound to the last lighting pass
+		std::vector<BoundingBox> static_shadow_changes; // Old and new boxes of the static entities that changed in the current frame
+		std::vector<BoundingBox> dynamic_shadow_changes; // Same for the dynamic entities
+		FBO* static_shadow_fbo = NULL; // Atlas with only the static casters, copied into the maps before rendering the dynamic ones
+		std::vector<ShadowView> shadow_views; // Shadow maps queued in the current frame for the multi-view path
+		bool queue_shadow_views = false; // renderShadowMap queues the views instead of rendering them
+		const uint32* shadow_view_masks = NULL; // Views of each call in the current multi-view pass (transient, NULL outside the pass)
+		Matrix44 shadow_view_matrices[MAX_SHADOW_VIEWS]; // Viewprojections of the views of the current multi-view pass
+		int num_pass_shadow_views = 0;
+		int* frustum_calls = NULL; // Calls inside the view frustum in the current frame (transient, from the frame arena)
+		int num_frustum_calls = 0;
+		int* call_ranks = NULL; // Position of each call in the submission order (transient, from the frame arena)
+		FBO* gbuffers_fbo = NULL; // Albedo, normal, occlusion/roughness/metalness, emissive and depth (Deferred render type)
 
 		//Shadow Resolution
 		int shadow_map_resolution = 2048; //Default Resolution
 
+		//Stats
+		float traversal_time = 0; //Milliseconds spent generating the render calls in the last frame
+		int instances_updated = 0; //Prefab entities whose node transforms were recomputed in the last frame
+		float culling_benchmark_scalar = 0; //Milliseconds of each pass of the last culling benchmark
+		float culling_benchmark_batch = 0;
+		int culling_benchmark_mismatch = -1; //First box whose scalar and batch results differ (-1 if the masks match)
+		float transforms_benchmark_scalar = 0; //Milliseconds of each pass of the last transforms benchmark
+		float transforms_benchmark_simd = 0;
+		int state_changes_saved = 0; //Shader, material and mesh changes avoided by the sort key ordering in the last frame
+		int draw_calls_saved = 0; //Draw calls merged into instanced draw calls in the last frame (color and shadow passes)
+		int light_passes_saved = 0; //Forward lighting passes avoided by the per object light culling in the last frame
+		int prepass_fragments = 0; //Fragments that passed the depth test in the depth pre-pass (what the color pass would shade without it)
+		int shaded_fragments = 0; //Fragments shaded by the opaque forward color passes, every lighting pass of an object counts (multi-pass, additive passes)
+		int shadow_maps_rendered = 0; //Shadow maps (spots and cascades) rendered again in the last frame
+		int shadow_texels_rendered = 0; //Texels of those maps that were rendered (scrolled cascades only render the new strips)
+		int shadow_faces_culled = 0; //Point light cube faces checked in the last frame that had no casters
+		int shadow_draw_calls = 0; //Draw calls of the shadow casters in the last frame
+		int multiview_passes = 0; //Multi-view passes of the shadow casters in the last frame
+		std::vector<LightEntity*> shadow_lights_rendered; //Lights with some shadow map rendered again in the last frame
+
+		//Depth pre-pass
+		bool depth_prepass_done = false; //The opaque depth is in the depth buffer: opaque calls are drawn with GL_EQUAL and no depth writes
+		unsigned int fragments_queries[2][FRAGMENTS_QUERY_FRAMES] = {}; //GL_SAMPLES_PASSED queries of the pre-pass and the color pass
+		int fragments_query_frames[2] = { 0, 0 }; //Query of each counter used in the current frame
+
 		//Renders several elements of the scene
 		void renderScene(GTR::Scene* scene, Camera* camera);
 	
-		//Processes a whole prefab (with all its nodes)
-		void processPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
+		//Updates the global matrices of the prefabs of the visible entities
+		void updatePrefabs();
+
+		//Processes the prefab entities in [first_entity, last_entity) into a render list
+		int processEntities(int first_entity, int last_entity, Camera* camera, RenderList& list);
+
+		//Processes all the entities in the worker pool (one render list per worker, merged into render_list)
+		int processEntitiesParallel(Camera* camera);
+
+		//Processes the nodes of a prefab entity (with the transforms cached in the entity)
+		bool processPrefab(GTR::PrefabEntity* entity, Camera* camera, RenderList& list);
+
+		//Chooses the shader that renders a material with the current render type
+		Shader* getRenderShader(Material* material, bool instanced = false);
+
+		//Packs pass, blend bucket, shader, material, mesh and quantized depth of each render call into its sort key
+		void computeSortKeys(Camera* camera);
 
-		//Processes one node from the prefab and its children
-		void processNode(const Matrix44& model, GTR::Node* node, Camera* camera);
+		//Writes the frame, light and material blocks of the calls into the uniform ring and binds the frame and light ones
+		void writeUniformBlocks(const int* calls, int num_calls, Camera* camera);
 
-		//Render a draw call
-		void renderDrawCall(RenderCall* rc, Camera* camera);
+		//Binds the light block that contains a light (if it isn't bound yet) and returns the index of the light in the block
+		int bindLightBlock(LightEntity* light);
 
-		//Render a basic draw call
-		void renderDepthMap(RenderCall* rc, Camera* light_camera);
+		//Renders a list of render calls, merging consecutive calls with the same mesh and material into instanced draw calls. Returns the number of draw calls
+		int renderCalls(const int* calls, int num_calls, Camera* camera, bool depth_only);
+
+		//Renders the depth of the opaque calls, so the color pass shades every pixel once
+		void renderDepthPrepass(const int* opaque_calls, int num_opaque_calls, Camera* camera);
+
+		//Issues the occlusion queries of the calls inside the frustum (after the opaque calls, before the blended ones)
+		void issueOcclusionQueries(Camera* camera);
+
+		//Fragment counters of the pre-pass (0) and the color pass (1), read with one frame of latency
+		void beginFragmentsQuery(int index);
+		void endFragmentsQuery();
+
+		//Writes the calls inside the frustum of a camera (BVH or linear test), in submission order, and returns how many
+		int gatherFrustumCalls(Camera* camera, bool skip_blended, int* calls);
+
+		//Compares the scalar and the batch frustum tests over the boxes of the render list (average ms per pass)
+		void benchmarkFrustumCulling(Camera* camera, int iterations);
+
+		//Compares the scalar and the SIMD matrix multiply, inverse and bounding box transform (average ms per pass)
+		void benchmarkTransforms(int iterations);
+
+		//Renders the shadow casters of the render list seen by a light camera (or the given calls, already culled against it)
+		void renderShadowCasters(Camera* light_camera, eShadowCasters casters = ALL_CASTERS, const int* caster_calls = NULL, int num_caster_calls = 0);
+
+		//Render a draw call of the render list (num_instances > 0 draws the models uploaded to the instance buffer instead, world_bounding_box covers them all)
+		void renderDrawCall(int call, Camera* camera, const BoundingBox& world_bounding_box, int num_instances = 0);
+
+		//Fills call_lights with the lights that can reach a world bounding box and returns how many there are
+		int cullLights(const BoundingBox& world_bounding_box, LightEntity** call_lights);
+
+		//Render a basic draw call of the render list (a view mask renders it into those views of the current multi-view pass instead)
+		void renderDepthMap(int call, Camera* light_camera, int num_instances = 0, uint32 view_mask = 0);
 
 		//Singlepass lighting
-		void SinglePassLoop(Mesh* mesh, Shader* shader);
+		void SinglePassLoop(Mesh* mesh, Shader* shader, int num_instances, LightEntity** call_lights, int num_call_lights);
 
 		//Multipass lighting
-		void MultiPassLoop(Mesh* mesh, Shader* shader);
+		void MultiPassLoop(Mesh* mesh, Shader* shader, int num_instances, LightEntity** call_lights, int num_call_lights);
+
+		//Clustered forward lighting: one pass, each fragment iterates the lights of its cluster
+		void ClusteredLoop(Mesh* mesh, Shader* shader, int num_instances);
+
+		//Deferred shading: opaque calls fill the G-buffers, lights are applied in screen space and blended calls are rendered forward
+		void renderDeferred(const int* calls, int num_calls, Camera* camera);
+
+		//Writes the material properties of a mesh into the G-buffers
+		void GBufferPass(Mesh* mesh, Shader* shader, int num_instances);
+
+		//Screen rectangle that bounds the influence of a point or spot light, false if it covers the whole screen
+		bool getLightScissor(LightEntity* light, Camera* camera, Vector4& rect);
+
+		//Uploads the uniforms of one light and its shadow
+		void setLightUniforms(Shader* shader, LightEntity* light);
 
 		//Shadow Atlas
-		void createShadowAtlas();
-		void computeSpotShadowMap(LightEntity* light);
-		void computeDirectionalShadowMap(LightEntity* light);
+		void createShadowAtlas(int size);
+		void deleteShadowAtlas();
+		int getShadowAtlasSize();
+		void findShadowChanges();
+		bool isShadowInvalidated(Camera* light_camera, const std::vector<BoundingBox>& changes);
+		void renderShadowMap(Camera* light_camera, const Vector4& shadow_region, bool static_changed, const int* caster_calls = NULL, int num_caster_calls = 0);
+		void computeSpotShadowMap(LightEntity* light, bool static_changed);
+		int computeDirectionalShadowMap(LightEntity* light, bool force);
+		int computePointShadowMap(LightEntity* light, bool force);
+		void renderShadowTexels(Camera* light_camera, const Vector4& shadow_region, float texel_size, int x0, int y0, int x1, int y1, bool static_changed);
+		bool supportsMultiViewShadows();
+		void renderShadowViews();
+		void renderShadowViewCasters(const int* views, int num_views, eShadowCasters casters);
 		void showShadowAtlas();
 
 	};
@@ -0,0 +1,193 @@
+#include "renderlist.h"
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+using namespace GTR;
+
+GTR::FrameArena::FrameArena()
+{
+	current_block = 0;
+	offset = 0;
+}
+
+GTR::FrameArena::~FrameArena()
+{
+	for (int i = 0; i < blocks.size(); ++i)
+		free(blocks[i].data);
+	blocks.clear();
+}
+
+void* GTR::FrameArena::allocBytes(size_t size, size_t alignment)
+{
+	assert(alignment && (alignment & (alignment - 1)) == 0 && "alignment must be a power of two");
+	assert(alignment <= 16 && "the blocks come from malloc, which only guarantees an alignment of 16");
+
+	while (current_block < blocks.size())
+	{
+		Block& block = blocks[current_block];
+		size_t start = (offset + alignment - 1) & ~(alignment - 1);
+		if (start + size <= block.size)
+		{
+			offset = start + size;
+			return block.data + start;
+		}
+
+		//Doesn't fit, try with the next block
+		current_block++;
+		offset = 0;
+	}
+
+	//No block left: request a new one (big requests get their own block)
+	Block block;
+	block.size = size + alignment > BLOCK_SIZE ? size + alignment : BLOCK_SIZE;
+	block.data = (char*)malloc(block.size);
+	blocks.push_back(block);
+	current_block = (int)blocks.size() - 1;
+
+	size_t start = ((size_t)block.data + alignment - 1) & ~(alignment - 1);
+	start -= (size_t)block.data;
+	offset = start + size;
+	return block.data + start;
+}
+
+void GTR::FrameArena::reset()
+{
+	current_block = 0;
+	offset = 0;
+}
+
+size_t GTR::FrameArena::getCapacity() const
+{
+	size_t capacity = 0;
+	for (int i = 0; i < blocks.size(); ++i)
+		capacity += blocks[i].size;
+	return capacity;
+}
+
+int GTR::RenderList::add(Mesh* mesh, Material* material, const Matrix44& model, const BoundingBox& world_bounding_box, float distance_to_camera, bool is_static)
+{
+	int index = size();
+	meshes.push_back(mesh);
+	materials.push_back(material);
+	shaders.push_back(NULL);
+	models.push_back(model);
+	world_bounding_boxes.push_back(world_bounding_box);
+	world_bounding_box_array.push_back(world_bounding_box);
+	distances_to_camera.push_back(distance_to_camera);
+	statics.push_back(is_static);
+	sort_keys.push_back(0);
+	order.push_back(index);
+	return index;
+}
+
+void GTR::RenderList::clear()
+{
+	//std::vector::clear keeps the capacity, so the memory is reused next frame
+	meshes.clear();
+	materials.clear();
+	shaders.clear();
+	models.clear();
+	world_bounding_boxes.clear();
+	world_bounding_box_array.clear();
+	distances_to_camera.clear();
+	statics.clear();
+	sort_keys.clear();
+	order.clear();
+	groups.clear();
+	group_owners.clear();
+	changed_groups.clear();
+}
+
+void GTR::RenderList::append(const RenderList& other)
+{
+	int first = size();
+	meshes.insert(meshes.end(), other.meshes.begin(), other.meshes.end());
+	materials.insert(materials.end(), other.materials.begin(), other.materials.end());
+	shaders.insert(shaders.end(), other.shaders.begin(), other.shaders.end());
+	models.insert(models.end(), other.models.begin(), other.models.end());
+	world_bounding_boxes.insert(world_bounding_boxes.end(), other.world_bounding_boxes.begin(), other.world_bounding_boxes.end());
+	world_bounding_box_array.append(other.world_bounding_box_array);
+	distances_to_camera.insert(distances_to_camera.end(), other.distances_to_camera.begin(), other.distances_to_camera.end());
+	statics.insert(statics.end(), other.statics.begin(), other.statics.end());
+	sort_keys.insert(sort_keys.end(), other.sort_keys.begin(), other.sort_keys.end());
+	for (int i = 0; i < other.order.size(); ++i)
+		order.push_back(first + other.order[i]);
+	int first_group = (int)groups.size();
+	for (int i = 0; i < other.changed_groups.size(); ++i)
+		changed_groups.push_back(first_group + other.changed_groups[i]);
+	for (int i = 0; i < other.groups.size(); ++i)
+		groups.push_back(first + other.groups[i]);
+	group_owners.insert(group_owners.end(), other.group_owners.begin(), other.group_owners.end());
+}
+
+void GTR::RenderList::sortByKeys()
+{
+	int num_calls = size();
+	if (num_calls < 2)
+		return;
+
+	//Keys in submission order, so the sort is stable with respect to the current order
+	std::vector<uint64>& keys = keys_buffer[0];
+	std::vector<uint64>& keys_tmp = keys_buffer[1];
+	keys.resize(num_calls);
+	keys_tmp.resize(num_calls);
+	order_buffer.resize(num_calls);
+	for (int i = 0; i < num_calls; ++i)
+		keys[i] = sort_keys[order[i]];
+
+	uint64* src_keys = &keys[0];
+	uint64* dst_keys = &keys_tmp[0];
+	int* src_order = &order[0];
+	int* dst_order = &order_buffer[0];
+
+	//One pass per byte, from the least significant to the most significant one
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		int count[256] = { 0 };
+		for (int i = 0; i < num_calls; ++i)
+			count[(src_keys[i] >> shift) & 0xFF]++;
+
+		//All the keys share this byte: nothing to reorder
+		if (count[(src_keys[0] >> shift) & 0xFF] == num_calls)
+			continue;
+
+		//Prefix sum to get the first position of each bucket
+		int position = 0;
+		for (int b = 0; b < 256; ++b)
+		{
+			int bucket_size = count[b];
+			count[b] = position;
+			position += bucket_size;
+		}
+
+		for (int i = 0; i < num_calls; ++i)
+		{
+			int dst = count[(src_keys[i] >> shift) & 0xFF]++;
+			dst_keys[dst] = src_keys[i];
+			dst_order[dst] = src_order[i];
+		}
+
+		std::swap(src_keys, dst_keys);
+		std::swap(src_order, dst_order);
+	}
+
+	//The result may have ended in the scratch buffer
+	if (src_order != &order[0])
+		memcpy(&order[0], src_order, num_calls * sizeof(int));
+}
+
+int GTR::RenderList::countStateChanges() const
+{
+	int changes = 0;
+	for (int i = 1; i < size(); ++i)
+	{
+		int previous = order[i - 1];
+		int current = order[i];
+		if (shaders[previous] != shaders[current]) changes++;
+		if (materials[previous] != materials[current]) changes++;
+		if (meshes[previous] != meshes[current]) changes++;
+	}
+	return changes;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+//forward declarations
+class Mesh;
+class Shader;
+
+namespace GTR {
+
+	class Material;
+
+	//Linear allocator for data that only lives during one frame (light arrays, temporal lists...).
+	//Memory is requested in big blocks that are never freed: reset() just rewinds them for the next frame.
+	class FrameArena
+	{
+	public:
+		static const int BLOCK_SIZE = 64 * 1024;
+
+		FrameArena();
+		~FrameArena();
+
+		//The arena owns its blocks: copies would free them twice
+		FrameArena(const FrameArena&) = delete;
+		FrameArena& operator=(const FrameArena&) = delete;
+
+		//Returns uninitialized memory for count elements of type T, valid until the next reset
+		template<typename T> T* alloc(int count) { return (T*)allocBytes(count * sizeof(T), alignof(T)); }
+
+		void* allocBytes(size_t size, size_t alignment = 16); //alignment up to 16, the one of the malloc'd blocks
+		void reset();
+
+		size_t getCapacity() const; //Bytes reserved by the arena (it only grows)
+
+	private:
+		struct Block {
+			char* data;
+			size_t size;
+		};
+		std::vector<Block> blocks;
+		int current_block;
+		size_t offset;
+	};
+
+	//Structure-of-arrays store of the render calls of a frame.
+	//It is cleared every frame but keeps its memory, so after the first frames no allocation is done.
+	class RenderList
+	{
+	public:
+		std::vector<Mesh*> meshes;
+		std::vector<Material*> materials;
+		std::vector<Shader*> shaders;
+		std::vector<Matrix44> models;
+		std::vector<BoundingBox> world_bounding_boxes;
+		BoundingBoxArray world_bounding_box_array; //Same boxes as separated arrays, for the batch frustum tests
+		std::vector<float> distances_to_camera;
+		std::vector<uint8> statics; //Whether the call belongs to a static entity
+		std::vector<uint64> sort_keys;
+		std::vector<int> order; //Submission order: indices to the arrays above
+		std::vector<int> groups; //First call of each group (the calls of one entity are contiguous)
+		std::vector<const void*> group_owners; //Entity of each group
+		std::vector<int> changed_groups; //Groups whose boxes were recomputed in this frame
+
+		int size() const { return (int)meshes.size(); }
+		bool empty() const { return meshes.empty(); }
+
+		//Adds a render call and returns its index
+		int add(Mesh* mesh, Material* material, const Matrix44& model, const BoundingBox& world_bounding_box, float distance_to_camera, bool is_static);
+
+		//Starts a new group: the next calls belong to it
+		void beginGroup(const void* owner) { groups.push_back(size()); group_owners.push_back(owner); }
+
+		//The boxes of the current group changed since the last frame
+		void markGroupChanged() { changed_groups.push_back((int)groups.size() - 1); }
+
+		//Removes all render calls without freeing memory
+		void clear();
+
+		//Adds all the render calls of another list at the end (in its submission order)
+		void append(const RenderList& other);
+
+		//Sorts the submission order by sort key with a LSD radix sort (stable, linear in the number of calls)
+		void sortByKeys();
+
+		//Number of shader, material or mesh changes when following the submission order
+		int countStateChanges() const;
+
+	private:
+		std::vector<uint64> keys_buffer[2];
+		std::vector<int> order_buffer;
+	};
+
+};
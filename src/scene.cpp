@@ -2,6 +2,7 @@
 #include "utils.h"
 
 #include "prefab.h"
+#include "mesh.h"
 #include "extra/cJSON.h"
 
 GTR::Scene* GTR::Scene::instance = NULL;
@@ -18,12 +19,21 @@ GTR::Scene::Scene()
 
 	//Scene properties
 	alpha_sorting = true;
+	key_sorting = true;
+	instancing = true;
+	multithreaded_traversal = true;
+	bvh_culling = true;
+	light_culling = true;
+	depth_prepass = false;
+	occlusion_culling = false;
 	emissive_materials = true;
 	occlusion = true;
 	specular_light = true;
 	normal_mapping = true;
 	render_type = Singlepass;
 	shadow_sorting = false;
+	static_shadows = true;
+	multiview_shadows = true;
 	num_shadows = 0;
 
 	//Shadow atlas debugging
@@ -32,7 +42,6 @@ GTR::Scene::Scene()
 	atlas_scope = 0;
 
 	//Scene trackers: We set them true just for the first iteration
-	entity_tracker = true;
 	shadow_visibility_tracker = true;
 	
 }
@@ -137,6 +146,8 @@ bool GTR::Scene::load(const char* filename)
 			Vector3 scale = readJSONVector3(entity_json, "scale", Vector3(1, 1, 1));
 			ent->model.scale(scale.x, scale.y, scale.z);
 		}
+		ent->is_static = readJSONBoolean(entity_json, "static", ent->is_static);
+
 		if (cJSON_GetObjectItem(entity_json, "custom_rotation"))
 		{
 			//Hardcoded
@@ -168,6 +179,7 @@ void GTR::BaseEntity::renderInMenu()
 
 	ImGui::Text("Name: %s", name.c_str()); // Edit 3 floats representing a color
 	visibility_changed = ImGui::Checkbox("Visible", &visible); // Edit 3 floats representing a color
+	ImGui::Checkbox("Static", &is_static);
 	//Model edit
 	ImGuiMatrix44(model, "Model");
 
@@ -176,7 +188,6 @@ void GTR::BaseEntity::renderInMenu()
 		LightEntity* light = (LightEntity*)this;
 		if(light->cast_shadows)	scene->shadow_visibility_tracker = true;
 	}
-	if (this->entity_type == PREFAB && visibility_changed) scene->entity_tracker = true;
 #endif
 }
 
@@ -184,6 +195,43 @@ GTR::PrefabEntity::PrefabEntity()
 {
 	entity_type = PREFAB;
 	prefab = NULL;
+	cached_prefab = NULL;
+	cached_prefab_version = -1;
+	transforms_version = 0;
+	shadow_visible = false;
+	shadow_static = false;
+	shadow_transforms_version = -1;
+}
+
+bool GTR::PrefabEntity::updateNodeTransforms()
+{
+	if (prefab == cached_prefab && prefab->version == cached_prefab_version && memcmp(model.m, cached_model.m, sizeof(Matrix44)) == 0)
+		return false;
+
+	int num_nodes = (int)prefab->flat_nodes.size();
+	node_models.resize(num_nodes);
+	node_bounding_boxes.resize(num_nodes);
+	bool empty = true;
+	for (int i = 0; i < num_nodes; ++i)
+	{
+		Node* node = prefab->flat_nodes[i];
+		node_models[i] = node->global_model * model;
+		if (!node->mesh)
+			continue;
+		node_bounding_boxes[i] = transformBoundingBox(node_models[i], node->mesh->box);
+		if (!prefab->flat_visible[i])
+			continue;
+		world_bounding_box = empty ? node_bounding_boxes[i] : mergeBoundingBoxes(world_bounding_box, node_bounding_boxes[i]);
+		empty = false;
+	}
+	if (empty)
+		world_bounding_box = BoundingBox();
+
+	transforms_version++;
+	cached_model = model;
+	cached_prefab = prefab;
+	cached_prefab_version = prefab->version;
+	return true;
 }
 
 void GTR::PrefabEntity::configure(cJSON* json)
@@ -222,15 +270,28 @@ GTR::LightEntity::LightEntity()
 	cone_exp = 30;
 	spot_shadow_tracker = true;
 
+	//Point light
+	point_shadow_tracker = true;
+	shadow_empty_faces = 0;
+	block_index = -1;
 	
 	//Directional light
 	area_size = 1000;
+	num_cascades = 3;
+	cascade_lambda = 0.8f;
 	directional_shadow_tracker = true;
 
 	//Shadows
 	cast_shadows = false;
 	shadow_index = 0;
 	shadow_bias = 0.001;
+	shadow_priority = 1.0f;
+	shadow_tier = -1;
+	for (int i = 0; i < MAX_SHADOW_CASCADES; ++i)
+	{
+		cascade_scale_offset[i].set(1, 1, 0, 0);
+		cascade_scroll[i].set(0, 0);
+	}
 	light_camera = NULL;
 
 }
@@ -252,12 +313,18 @@ void GTR::LightEntity::renderInMenu()
 			ImGui::DragFloat("Cone exponent", &cone_exp);
 			scene->shadow_visibility_tracker |= ImGui::Checkbox("Cast shadow", &cast_shadows);
 			spot_shadow_tracker |= ImGui::DragFloat("Shadow bias", &shadow_bias, 0.001f);
+			ImGui::DragFloat("Shadow priority", &shadow_priority, 0.01f, 0.0f, 10.0f);
+			if (cast_shadows) ImGui::Text("Shadow tier: %d", shadow_tier);
 			break;
 		case eLightType::POINT:
 			ImGui::Text("Light type: %s", "Point");
 			ImGui::ColorEdit3("Color", color.v);
 			ImGui::DragFloat("Intensity", &intensity, 0.1f);
-			ImGui::DragFloat("Max distance", &max_distance, 1);
+			point_shadow_tracker |= ImGui::DragFloat("Max distance", &max_distance, 1);
+			scene->shadow_visibility_tracker |= ImGui::Checkbox("Cast shadow", &cast_shadows);
+			point_shadow_tracker |= ImGui::DragFloat("Shadow bias", &shadow_bias, 0.001f);
+			ImGui::DragFloat("Shadow priority", &shadow_priority, 0.01f, 0.0f, 10.0f);
+			if (cast_shadows) ImGui::Text("Shadow tier: %d", shadow_tier);
 			break;
 		case eLightType::DIRECTIONAL: 
 			ImGui::Text("Light type: %s", "Directional");
@@ -265,14 +332,49 @@ void GTR::LightEntity::renderInMenu()
 			ImGui::DragFloat("Intensity", &intensity, 0.1f);
 			directional_shadow_tracker |= ImGui::DragFloat("Max distance", &max_distance, 1);
 			directional_shadow_tracker |= ImGui::DragFloat("Area size", &area_size);
+			directional_shadow_tracker |= ImGui::SliderInt("Cascades", &num_cascades, 1, MAX_SHADOW_CASCADES);
+			directional_shadow_tracker |= ImGui::SliderFloat("Cascade lambda", &cascade_lambda, 0.0f, 1.0f);
 			scene->shadow_visibility_tracker |= ImGui::Checkbox("Cast shadow", &cast_shadows);
 			directional_shadow_tracker |= ImGui::DragFloat("Shadow bias", &shadow_bias, 0.001f);
+			ImGui::DragFloat("Shadow priority", &shadow_priority, 0.01f, 0.0f, 10.0f);
+			if (cast_shadows) ImGui::Text("Shadow tier: %d", shadow_tier);
 			break;
 	}
 
 #endif
 }
 
+const Matrix44& GTR::LightEntity::getShadowMatrix() const
+{
+	return light_type == POINT ? light_camera->projection_matrix : light_camera->viewprojection_matrix;
+}
+
+void GTR::LightEntity::writeShaderData(Vector4* data, bool shadows) const
+{
+	//Spots with a degenerate cone are rendered as point lights
+	int type = light_type;
+	if (type == SPOT && ((cone_angle < 2.0 && cone_angle > -2.0) || cone_angle < -90.0 || cone_angle > 90.0))
+		type = POINT;
+
+	bool shadowed = shadows && hasShadowMap();
+	Vector3 direction = model.rotateVector(Vector3(0, 0, -1));
+
+	data[0] = Vector4(model.getTranslation(), max_distance);
+	data[1] = Vector4(color, intensity);
+	data[2] = Vector4(direction, (float)type);
+	data[3] = Vector4(cone_exp, cos(cone_angle * DEG2RAD), shadowed ? 1.0f : 0.0f, shadow_bias);
+	Matrix44 shadow_vp;
+	if (shadowed) shadow_vp = getShadowMatrix();
+	for (int k = 0; k < 4; ++k)
+		data[4 + k] = Vector4(shadow_vp.m[k * 4], shadow_vp.m[k * 4 + 1], shadow_vp.m[k * 4 + 2], shadow_vp.m[k * 4 + 3]); //one column per vec4
+	for (int k = 0; k < MAX_SHADOW_MAPS; ++k)
+		data[8 + k] = shadow_rect[k];
+	for (int k = 0; k < MAX_SHADOW_CASCADES; ++k)
+		data[14 + k] = cascade_scale_offset[k];
+	for (int k = 0; k < MAX_SHADOW_CASCADES; k += 2)
+		data[18 + k / 2] = Vector4(cascade_scroll[k].x, cascade_scroll[k].y, cascade_scroll[k + 1].x, cascade_scroll[k + 1].y); //two cascades per vec4
+}
+
 void GTR::LightEntity::configure(cJSON* json) {
 
 	color = readJSONVector3(json, "color", color);
@@ -280,6 +382,7 @@ void GTR::LightEntity::configure(cJSON* json) {
 	max_distance = readJSONNumber(json, "max_dist", max_distance);
 	cast_shadows = readJSONBoolean(json, "cast_shadows", cast_shadows);
 	shadow_bias = readJSONNumber(json, "shadow_bias", shadow_bias);
+	shadow_priority = readJSONNumber(json, "shadow_priority", shadow_priority);
 	std::string type_field = readJSONString(json, "light_type", "");
 
 	if (type_field == "SPOT") {
@@ -293,5 +396,7 @@ void GTR::LightEntity::configure(cJSON* json) {
 	else if (type_field == "DIRECTIONAL") {
 		light_type = eLightType::DIRECTIONAL;
 		area_size = readJSONNumber(json, "area_size", area_size);
+		num_cascades = readJSONNumber(json, "num_cascades", num_cascades);
+		cascade_lambda = readJSONNumber(json, "cascade_lambda", cascade_lambda);
 	}
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "framework.h"
 #include "camera.h"
 #include <string>
+#include <algorithm>
 
 //forward declaration
 class cJSON; 
@@ -29,9 +30,18 @@ namespace GTR {
 		DIRECTIONAL = 2
 	};
 
+	//Maximum number of shadow maps of a light (the cascades of a directional light)
+	const int MAX_SHADOW_CASCADES = 4;
+	const int MAX_SHADOW_MAPS = 6; //Shadow maps of a light: one for spots, one per cascade for directional lights and one per cube face for point lights
+
+	//vec4 used by the data of a light in the shaders (same layout in the light block and in the clustered light buffer)
+	const int LIGHT_DATA_TEXELS = 20;
+
 	enum RenderType {
 		Singlepass = 0,
 		Multipass = 1,
+		Clustered = 2,
+		Deferred = 3
 	};
 
 	class Scene;
@@ -46,7 +56,8 @@ namespace GTR {
 		eEntityType entity_type;
 		Matrix44 model;
 		bool visible;
-		BaseEntity() { entity_type = NONE; visible = true;}
+		bool is_static; //Never moves: its shadows are cached in the static layer of the shadow maps
+		BaseEntity() { entity_type = NONE; visible = true; is_static = false; }
 		virtual ~BaseEntity() {}
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json) {}
@@ -58,10 +69,31 @@ namespace GTR {
 	public:
 		std::string filename;
 		Prefab* prefab;
+
+		//World matrices and bounding boxes of the prefab nodes for this instance (indexed like Prefab::flat_nodes).
+		//They are reused until the model of the entity or the prefab changes
+		std::vector<Matrix44> node_models;
+		std::vector<BoundingBox> node_bounding_boxes;
+		BoundingBox world_bounding_box; //Box of the visible nodes with a mesh
+		int transforms_version; //Incremented every time the transforms are recomputed
+
+		//Last state seen by the shadow maps, to find the changes that invalidate them
+		bool shadow_visible;
+		bool shadow_static;
+		int shadow_transforms_version;
+		BoundingBox shadow_bounding_box;
 		
 		PrefabEntity();
+
+		//Recomputes the world transforms of the nodes if they are outdated. Returns true if it had to
+		bool updateNodeTransforms();
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
+
+	private:
+		Matrix44 cached_model;
+		Prefab* cached_prefab;
+		int cached_prefab_version;
 	};
 
 	class LightEntity : public GTR::BaseEntity
@@ -79,17 +111,41 @@ namespace GTR {
 		float cone_exp;
 		bool spot_shadow_tracker;// Tracks changes in spotlight properties that affect shadows for atlas rebuilding task.
 
+		//Point Light
+		bool point_shadow_tracker; //Tracks changes of the point light properties that affect its shadows
+		int shadow_empty_faces; //Cube faces without casters when they were rendered (one bit per face)
+
 		//Directional Light
-		float area_size; 
+		float area_size; //View distance covered by the shadow cascades
+		int num_cascades; //Shadow cascades that split the view frustum
+		float cascade_lambda; //Split scheme of the cascades, from uniform (0) to logarithmic (1)
 		bool directional_shadow_tracker;// Tracks changes in spotlight properties that affect shadows for atlas rebuilding task.
 
 		//Shadows
 		bool cast_shadows;
-		int shadow_index;
+		Matrix44 shadow_model; //Model of the light when its shadow maps were rendered
+		Vector4 cascade_bounds[MAX_SHADOW_CASCADES]; //Center (xy), radius (z) and resolution (w) of the cascades in light view when they were rendered
+		Vector2 cascade_depth_range; //Near and far planes shared by the cascades when they were rendered
+		int shadow_index; //Order of the first shadow map of the light in the atlas
 		float shadow_bias;
+		float shadow_priority; //Scales the screen coverage used to choose the resolution tier of the shadow map
+		int shadow_tier; //Resolution tier in the shadow atlas, -1 if the light has no shadow map
+		Vector4 shadow_region[MAX_SHADOW_MAPS]; //Rectangles of the shadow maps in the atlas, in pixels
+		Vector4 shadow_rect[MAX_SHADOW_MAPS]; //Same rectangles in texture coordinates (empty after the last map)
+		Vector4 cascade_scale_offset[MAX_SHADOW_CASCADES]; //From the clip space of the first cascade to each cascade (xy scale, zw offset)
+		Vector2 cascade_scroll[MAX_SHADOW_CASCADES]; //Origin of the cascades in their toroidal maps, in texture coordinates
 		Camera* light_camera;
+		int block_index; //Index of the light in the lights of the frame (light block block_index / MAX_BLOCK_LIGHTS)
 
 		LightEntity();
+
+		//Whether the light has a shadow map in the atlas (it may cast shadows but have no space)
+		bool hasShadowMap() const { return cast_shadows && shadow_tier != -1 && light_camera; }
+		int getNumShadowMaps() const { return light_type == DIRECTIONAL ? std::max(1, std::min(num_cascades, MAX_SHADOW_CASCADES)) : light_type == POINT ? MAX_SHADOW_MAPS : 1; }
+		//Matrix used by the shaders to project into the shadow maps: the light camera, or only its projection for point lights (the shaders rotate into each face)
+		const Matrix44& getShadowMatrix() const;
+		//Writes the LIGHT_DATA_TEXELS vec4 read by the getLight function of the shaders
+		void writeShaderData(Vector4* data, bool shadows) const;
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
 	};
@@ -109,13 +165,22 @@ namespace GTR {
 		Texture* shadow_atlas; //Shadow map of the lights of the scene
 
 		//Scene properties
-		bool alpha_sorting; //Whether we sort render calls or not.
+		bool alpha_sorting; //Whether we sort render calls or not (with sort keys, whether blended calls are ordered back to front).
+		bool key_sorting; //Whether we sort render calls by packed state and depth keys (radix sort) instead of only by alpha and distance.
+		bool multithreaded_traversal; //Whether the entities are traversed by a pool of threads, each one filling its own render list.
+		bool bvh_culling; //Whether the render calls are culled against the camera frustums with a bounding volume hierarchy.
+		bool instancing; //Whether consecutive render calls that share mesh and material are drawn with a single instanced draw call.
+		bool occlusion_culling; //Whether render calls hidden in the last occlusion query are skipped.
+		bool depth_prepass; //Whether the opaque depth is rendered first so the forward color passes test with GL_EQUAL.
+		bool light_culling; //Whether the forward loops only iterate over the lights whose volume reaches the object.
 		bool emissive_materials; //Whether we enable prefab's emissive texture or not.
 		bool occlusion; //Whether we enable prefab's occlusion texture or not.
 		bool specular_light; //Whether we enable prefab's roughness metallic texture or not.
 		bool normal_mapping; //Whether we are redering with normal map or interpolated normals.
-		int render_type; //Whether we are rendering with Single Pass or Multi Pass. By deafult we set the flag to Single Pass.
+		int render_type; //Whether we are rendering with Single Pass, Multi Pass, Clustered forward lighting or Deferred shading. By deafult we set the flag to Single Pass.
 		bool shadow_sorting; //Whether we sort light by shadows or not.
+		bool static_shadows; //Whether the static casters are cached in a separate atlas, so only the dynamic ones are rendered when they move.
+		bool multiview_shadows; //Whether the shadow maps are rendered together, drawing each caster once into all the maps that see it (needs viewport arrays).
 		int num_shadows; //The number of shadows in the scene.
 
 		//Shadow atlas
@@ -124,7 +189,6 @@ namespace GTR {
 		bool show_atlas; //Enables or disables the display of the shadow atlas.
 
 		//Scene trackers
-		bool entity_tracker; //Tracks if an entity has changed his visibility or a visible entity has changed its model.
 		bool shadow_visibility_tracker; //Tracks changes in shadow casting or light visibility for lights that cast shadows.
 		bool shadow_resolution_tracker; //Tracks if shadow resolution has been changed.
 
@@ -8,6 +8,9 @@
 #include <locale>
 
 #include "texture.h"
+#include "mesh.h"
+#include "uniformbuffer.h"
+#include "glstate.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
@@ -56,14 +59,33 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+int Shader::s_ShaderID = 0;
+
+//macros are placed after the #version directive (it must be the first statement of the code)
+static std::string addMacros(const std::string& code, const std::string& macros)
+{
+	if (macros.empty())
+		return code;
+	size_t start = code.find_first_not_of(" \t\r\n");
+	if (start != std::string::npos && code.compare(start, 8, "#version") == 0)
+	{
+		size_t endline = code.find('\n', start);
+		if (endline != std::string::npos)
+			return code.substr(0, endline + 1) + macros + "\n" + code.substr(endline + 1);
+	}
+	return macros + "\n" + code;
+}
 
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
-	vs = fs = 0;
+	m_Id = s_ShaderID++;
+	vs = fs = gs = 0;
+	program = 0;
 	compiled = false;
 	from_atlas = false;
+	uniform_uploads = uniform_uploads_skipped = last_frame_uniform_uploads = last_frame_uniform_uploads_skipped = 0;
 }
 
 Shader::~Shader()
@@ -97,8 +119,8 @@ bool Shader::load(const std::string& vsf, const std::string& psf, const char* ma
 	//printf("Fragment shader from memory:\n%s\n", psm.c_str());
 	if (macros)
 	{
-		vsm = macros + vsm;
-		psm = macros + psm;
+		vsm = addMacros(vsm, macros);
+		psm = addMacros(psm, macros);
 		this->macros = macros;
 	}
 
@@ -231,16 +253,33 @@ bool Shader::LoadAtlas(const char* filename)
 		std::string macros = "";
 		if(pos3 != std::string::npos)
 			macros = line.substr(pos3+1);
+
+		//an optional geometry shader goes after the fragment shader ("name a.vs b.fs c.gs #define A")
+		std::string gs_filename = "";
+		if (!macros.empty() && macros[0] != '#')
+		{
+			int pos4 = macros.find_first_of(' ');
+			gs_filename = trim(macros.substr(0, pos4));
+			macros = pos4 == std::string::npos ? "" : macros.substr(pos4 + 1);
+		}
+
+		//several macros can be set in the same line ("#define A #define B"), each one needs its own line
+		size_t macro_pos;
+		while ((macro_pos = macros.find(" #")) != std::string::npos)
+			macros[macro_pos] = '\n';
 		std::string vs_code = s_shaders_atlas[vs_filename];
 		std::string fs_code = s_shaders_atlas[fs_filename];
-		if(!vs_code.size() || !fs_code.size())
+		std::string gs_code = gs_filename.size() ? s_shaders_atlas[gs_filename] : "";
+		if(!vs_code.size() || !fs_code.size() || (gs_filename.size() && !gs_code.size()))
 		{
 			std::cout << " * Error in shader atlas, couldnt find files for " << name << std::endl;
 			continue;
 		}
 
-		vs_code = macros + "\n" + vs_code;
-		fs_code = macros + "\n" + fs_code;
+		vs_code = addMacros(vs_code, macros);
+		fs_code = addMacros(fs_code, macros);
+		if (gs_code.size())
+			gs_code = addMacros(gs_code, macros);
 
 		Shader* shader = NULL;
 		auto it = s_Shaders.find( name );
@@ -252,16 +291,18 @@ bool Shader::LoadAtlas(const char* filename)
 		else
 			shader = it->second;
 	
-		if (!shader->compileFromMemory(vs_code,fs_code))
+		//a shader that doesn't compile (like one that needs an unsupported extension) is skipped, the rest are still loaded
+		if (!shader->compileFromMemory(vs_code,fs_code,gs_code))
 		{
+			s_Shaders.erase(name);
 			delete shader;
 			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
-            return false; //stop here
 			continue;
 		}
 
 		shader->vs_filename = vs_filename;
 		shader->ps_filename = fs_filename;
+		shader->gs_filename = gs_filename;
 		shader->from_atlas = true;
 		std::cout << " + Shader from atlas: " << name << std::endl;
 	}
@@ -295,7 +336,7 @@ bool Shader::hasInfoLog() const
 
 // ******************************************
 
-bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
+bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm)
 {
 	if (glCreateProgram == 0)
 	{
@@ -318,6 +359,15 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	if (gsm.size() && !createGeometryShaderObject(gsm))
+	{
+		printf("Geometry shader compilation failed\n");
+		return false;
+	}
+
+	//same attribute locations in all the shaders, so the vertex arrays of the meshes work with any of them
+	Mesh::bindAttributeLocations(program);
+
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
@@ -337,6 +387,12 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	validate();
 #endif
 
+	//resolve the interned uniforms once
+	fillUniformLocations();
+
+	//the uniform blocks read the ranges bound to their fixed binding points
+	GTR::UniformBufferRing::bindUniformBlocks(program);
+
 	compiled = true;
 
 	return true;
@@ -371,6 +427,11 @@ bool Shader::createFragmentShaderObject(const std::string& shader)
 	return createShaderObject(GL_FRAGMENT_SHADER,fs,shader);
 }
 
+bool Shader::createGeometryShaderObject(const std::string& shader)
+{
+	return createShaderObject(GL_GEOMETRY_SHADER,gs,shader);
+}
+
 bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code)
 {
 	handle = glCreateShader(type);
@@ -425,14 +486,24 @@ void Shader::release()
 		fs = 0;
 	}
 
+	if (gs)
+	{
+		glDeleteShader(gs);
+		assert (glGetError() == GL_NO_ERROR);
+		gs = 0;
+	}
+
 	if (program)
 	{
 		glDeleteProgram(program);
 		assert (glGetError() == GL_NO_ERROR);
 		program = 0;
+		GLState::invalidate(GLState::PROGRAM); //its id can be reused
 	}
 
 	locations.clear();
+	uniform_locations.clear();
+	location_elements.clear();
 
 	compiled = false;
 }
@@ -445,7 +516,7 @@ void Shader::enable()
 
 	current = this;
 
-	glUseProgram(program);
+	GLState::useProgram(program);
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -457,14 +528,15 @@ void Shader::disable()
 {
 	current = NULL;
 
-	glUseProgram(0);
+	GLState::useProgram(0);
 	//glActiveTexture(GL_TEXTURE0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
-	glUseProgram(0);
+	current = NULL;
+	GLState::useProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
@@ -564,10 +636,13 @@ int Shader::getUniformLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	bindTexture(tex, slot);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
+}
+
+void Shader::bindTexture(Texture* tex, int slot)
+{
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
 }
 
 /*
@@ -581,164 +656,319 @@ void Shader::setTexture(const char* varname, unsigned int tex)
 }
 */
 
-void Shader::setUniform1(const char* varname, bool input1)
+void Shader::setUniform1(const char* varname, bool input1) { uploadUniform1(getLocation(varname, &locations), varname, (int)input1); }
+void Shader::setUniform1(const char* varname, int input1) { uploadUniform1(getLocation(varname, &locations), varname, input1); }
+void Shader::setUniform2(const char* varname, int input1, int input2) { uploadUniform2(getLocation(varname, &locations), varname, input1, input2); }
+void Shader::setUniform3(const char* varname, int input1, int input2, int input3) { uploadUniform3(getLocation(varname, &locations), varname, input1, input2, input3); }
+void Shader::setUniform4(const char* varname, const int input1, const int input2, const int input3, const int input4) { uploadUniform4(getLocation(varname, &locations), varname, input1, input2, input3, input4); }
+void Shader::setUniform1Array(const char* varname, const int* input, const int count) { uploadUniformArray(getLocation(varname, &locations), varname, 1, input, count); }
+void Shader::setUniform2Array(const char* varname, const int* input, const int count) { uploadUniformArray(getLocation(varname, &locations), varname, 2, input, count); }
+void Shader::setUniform3Array(const char* varname, const int* input, const int count) { uploadUniformArray(getLocation(varname, &locations), varname, 3, input, count); }
+void Shader::setUniform4Array(const char* varname, const int* input, const int count) { uploadUniformArray(getLocation(varname, &locations), varname, 4, input, count); }
+void Shader::setUniform1(const char* varname, const float input1) { uploadUniform1(getLocation(varname, &locations), varname, input1); }
+void Shader::setUniform2(const char* varname, const float input1, const float input2) { uploadUniform2(getLocation(varname, &locations), varname, input1, input2); }
+void Shader::setUniform3(const char* varname, const float input1, const float input2, const float input3) { uploadUniform3(getLocation(varname, &locations), varname, input1, input2, input3); }
+void Shader::setUniform4(const char* varname, const float input1, const float input2, const float input3, const float input4) { uploadUniform4(getLocation(varname, &locations), varname, input1, input2, input3, input4); }
+void Shader::setUniform1Array(const char* varname, const float* input, const int count) { uploadUniformArray(getLocation(varname, &locations), varname, 1, input, count); }
+void Shader::setUniform2Array(const char* varname, const float* input, const int count) { uploadUniformArray(getLocation(varname, &locations), varname, 2, input, count); }
+void Shader::setUniform3Array(const char* varname, const float* input, const int count) { uploadUniformArray(getLocation(varname, &locations), varname, 3, input, count); }
+void Shader::setUniform4Array(const char* varname, const float* input, const int count) { uploadUniformArray(getLocation(varname, &locations), varname, 4, input, count); }
+void Shader::setMatrix44(const char* varname, const float* m) { uploadMatrix44Array(getLocation(varname, &locations), varname, m, 1); }
+void Shader::setMatrix44(const char* varname, const Matrix44 &m) { uploadMatrix44Array(getLocation(varname, &locations), varname, m.m, 1); }
+void Shader::setMatrix44Array(const char* varname, Matrix44* m_array, int num) { uploadMatrix44Array(getLocation(varname, &locations), varname, m_array[0].m, num); }
+
+//bytes of one element of a uniform type (0 for the types that are not cached)
+static int getUniformTypeSize(GLenum type)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
-	glUniform1i(loc, input1);
-	assert(glGetError() == GL_NO_ERROR);
+	switch (type)
+	{
+	case GL_FLOAT: case GL_INT: case GL_UNSIGNED_INT: case GL_BOOL: return 4;
+	case GL_FLOAT_VEC2: case GL_INT_VEC2: case GL_BOOL_VEC2: return 8;
+	case GL_FLOAT_VEC3: case GL_INT_VEC3: case GL_BOOL_VEC3: return 12;
+	case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_BOOL_VEC4: case GL_FLOAT_MAT2: return 16;
+	case GL_FLOAT_MAT3: return 36;
+	case GL_FLOAT_MAT4: return 64;
+	case GL_SAMPLER_2D: case GL_SAMPLER_3D: case GL_SAMPLER_CUBE: case GL_SAMPLER_2D_SHADOW: case GL_SAMPLER_2D_ARRAY: case GL_SAMPLER_BUFFER:
+	case GL_INT_SAMPLER_BUFFER: case GL_UNSIGNED_INT_SAMPLER_BUFFER: return 4;
+	}
+	return 0;
 }
 
-void Shader::setUniform1(const char* varname, int input1)
+bool Shader::isUniformCached(GLint loc, const void* data, int element_size, int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform1i(loc, input1);
-	assert (glGetError() == GL_NO_ERROR);
+	if (loc >= location_elements.size() || location_elements[loc] == -1)
+		return false;
+
+	//only uploads that match the declared type are cached, anything else forgets the values of the elements
+	int element = location_elements[loc];
+	count = std::min(count, elements_left[element]);
+	if (element_sizes[element] != element_size)
+	{
+		for (int i = 0; i < count; ++i)
+			element_known[element + i] = false;
+		return false;
+	}
+
+	int offset = element_offsets[element];
+	int size = element_size * count;
+	bool known = true;
+	for (int i = 0; i < count && known; ++i)
+		known = element_known[element + i] != 0;
+	if (known && memcmp(&uniform_values[offset], data, size) == 0)
+	{
+		uniform_uploads_skipped++;
+		return true;
+	}
+
+	memcpy(&uniform_values[offset], data, size);
+	for (int i = 0; i < count; ++i)
+		element_known[element + i] = true;
+	return false;
 }
 
-void Shader::setUniform2(const char* varname, int input1, int input2)
+void Shader::uploadUniform1(GLint loc, const char* name, int input1)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform2i(loc, input1, input2);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	if (isUniformCached(loc, &input1, sizeof(int), 1))
+		return;
+	glUniform1i(loc, input1);
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3(const char* varname, int input1, int input2, int input3)
+void Shader::uploadUniform1(GLint loc, const char* name, float input1)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform3i(loc, input1, input2, input3);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	if (isUniformCached(loc, &input1, sizeof(float), 1))
+		return;
+	glUniform1f(loc, input1);
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4(const char* varname, const int input1, const int input2, const int input3, const int input4)
+void Shader::uploadUniform2(GLint loc, const char* name, int input1, int input2)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform4i(loc, input1, input2, input3, input4);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	int values[2] = { input1, input2 };
+	if (isUniformCached(loc, values, sizeof(values), 1))
+		return;
+	glUniform2i(loc, input1, input2);
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1Array(const char* varname, const int* input, const int count)
+void Shader::uploadUniform2(GLint loc, const char* name, float input1, float input2)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform1iv(loc,count,input);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	float values[2] = { input1, input2 };
+	if (isUniformCached(loc, values, sizeof(values), 1))
+		return;
+	glUniform2f(loc, input1, input2);
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform2Array(const char* varname, const int* input, const int count)
+void Shader::uploadUniform3(GLint loc, const char* name, int input1, int input2, int input3)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform2iv(loc,count,input);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	int values[3] = { input1, input2, input3 };
+	if (isUniformCached(loc, values, sizeof(values), 1))
+		return;
+	glUniform3i(loc, input1, input2, input3);
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3Array(const char* varname, const int* input, const int count)
+void Shader::uploadUniform3(GLint loc, const char* name, float input1, float input2, float input3)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform3iv(loc,count,input);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	float values[3] = { input1, input2, input3 };
+	if (isUniformCached(loc, values, sizeof(values), 1))
+		return;
+	glUniform3f(loc, input1, input2, input3);
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4Array(const char* varname, const int* input, const int count)
+void Shader::uploadUniform4(GLint loc, const char* name, int input1, int input2, int input3, int input4)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform4iv(loc,count,input);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	int values[4] = { input1, input2, input3, input4 };
+	if (isUniformCached(loc, values, sizeof(values), 1))
+		return;
+	glUniform4i(loc, input1, input2, input3, input4);
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1(const char* varname, const float input1)
+void Shader::uploadUniform4(GLint loc, const char* name, float input1, float input2, float input3, float input4)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform1f(loc, input1);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	float values[4] = { input1, input2, input3, input4 };
+	if (isUniformCached(loc, values, sizeof(values), 1))
+		return;
+	glUniform4f(loc, input1, input2, input3, input4);
+	uniform_uploads++;
+	checkGLErrors();
 }
 
-void Shader::setUniform2(const char* varname, const float input1, const float input2)
+void Shader::uploadUniformArray(GLint loc, const char* name, int size, const int* input, int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform2f(loc, input1, input2);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	if (isUniformCached(loc, input, size * sizeof(int), count))
+		return;
+	switch (size)
+	{
+	case 1: glUniform1iv(loc, count, input); break;
+	case 2: glUniform2iv(loc, count, input); break;
+	case 3: glUniform3iv(loc, count, input); break;
+	case 4: glUniform4iv(loc, count, input); break;
+	default: assert(0 && "uniform arrays have 1 to 4 components");
+	}
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform3(const char* varname, const float input1, const float input2, const float input3)
+void Shader::uploadUniformArray(GLint loc, const char* name, int size, const float* input, int count)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform3f(loc, input1, input2, input3);
-	assert (glGetError() == GL_NO_ERROR);
+	CHECK_SHADER_VAR(loc, name);
+	if (isUniformCached(loc, input, size * sizeof(float), count))
+		return;
+	switch (size)
+	{
+	case 1: glUniform1fv(loc, count, input); break;
+	case 2: glUniform2fv(loc, count, input); break;
+	case 3: glUniform3fv(loc, count, input); break;
+	case 4: glUniform4fv(loc, count, input); break;
+	default: assert(0 && "uniform arrays have 1 to 4 components");
+	}
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform4(const char* varname, const float input1, const float input2, const float input3, const float input4)
+void Shader::uploadMatrix44Array(GLint loc, const char* name, const float* m, int num)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform4f(loc, input1, input2, input3, input4);
-	checkGLErrors();
+	CHECK_SHADER_VAR(loc, name);
+	if (isUniformCached(loc, m, sizeof(Matrix44), num))
+		return;
+	glUniformMatrix4fv(loc, num, GL_FALSE, m);
+	uniform_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setUniform1Array(const char* varname, const float* input, const int count)
+//Interned uniform names (function statics, so UniformIDs can be created during the static initialization)
+static std::map<std::string, int>& getUniformIndices()
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform1fv(loc,count,input);
-	assert (glGetError() == GL_NO_ERROR);
+	static std::map<std::string, int> indices;
+	return indices;
 }
 
-void Shader::setUniform2Array(const char* varname, const float* input, const int count)
+static std::vector<const char*>& getUniformNames()
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform2fv(loc,count,input);
-	assert (glGetError() == GL_NO_ERROR);
+	static std::vector<const char*> names;
+	return names;
 }
 
-void Shader::setUniform3Array(const char* varname, const float* input, const int count)
+static int internUniform(const char* name)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform3fv(loc,count,input);
-	assert (glGetError() == GL_NO_ERROR);
+	std::map<std::string, int>& indices = getUniformIndices();
+	std::map<std::string, int>::iterator it = indices.find(name);
+	if (it != indices.end())
+		return it->second;
+
+	std::vector<const char*>& names = getUniformNames();
+	int index = (int)names.size();
+	it = indices.insert(std::make_pair(std::string(name), index)).first;
+	names.push_back(it->first.c_str());
+	return index;
 }
 
-void Shader::setUniform4Array(const char* varname, const float* input, const int count)
+UniformID::UniformID(const char* name)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform4fv(loc,count,input);
-	assert (glGetError() == GL_NO_ERROR);
+	index = internUniform(name);
+	this->name = getUniformNames()[index];
 }
 
-void Shader::setMatrix44(const char* varname, const float* m)
+void Shader::fillUniformLocations()
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniformMatrix4fv(loc, 1, GL_FALSE, m);
-	assert (glGetError() == GL_NO_ERROR);
+	GLint num_uniforms = 0;
+	GLint max_length = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &num_uniforms);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+	std::vector<char> buffer(max_length + 1);
+
+	//every active uniform is interned, so the names missing from the table are not used by this program
+	std::vector<int> indices(num_uniforms);
+	std::vector<GLint> locs(num_uniforms);
+	location_elements.clear();
+	element_offsets.clear();
+	element_sizes.clear();
+	elements_left.clear();
+	int values_size = 0;
+	for (int i = 0; i < num_uniforms; ++i)
+	{
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(program, i, max_length + 1, &length, &size, &type, &buffer[0]);
+		std::string name(&buffer[0], length);
+
+		//arrays are reported as "name[0]" but they are set with the name of the array
+		bool is_array = name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0;
+		if (is_array)
+			name.resize(name.size() - 3);
+		indices[i] = internUniform(name.c_str());
+		locs[i] = glGetUniformLocation(program, name.c_str());
+		if (locs[i] == -1) //in a uniform block
+			continue;
+
+		//one element per location of the uniform (the elements of an array are not granted to have consecutive locations)
+		int element_size = getUniformTypeSize(type);
+		for (int j = 0; j < size; ++j)
+		{
+			GLint loc = j == 0 ? locs[i] : glGetUniformLocation(program, (name + "[" + std::to_string(j) + "]").c_str());
+			if (loc == -1)
+				continue;
+			if (loc >= location_elements.size())
+				location_elements.resize(loc + 1, -1);
+			location_elements[loc] = (int)element_offsets.size();
+			element_offsets.push_back(values_size);
+			element_sizes.push_back(element_size);
+			elements_left.push_back(size - j);
+			values_size += element_size;
+		}
+	}
+	element_known.assign(element_offsets.size(), false);
+	uniform_values.assign(values_size, 0);
+
+	uniform_locations.assign(getUniformNames().size(), -1);
+	for (int i = 0; i < num_uniforms; ++i)
+		uniform_locations[indices[i]] = locs[i];
+	assert(glGetError() == GL_NO_ERROR);
 }
 
-void Shader::setMatrix44( const char* varname, const Matrix44 &m )
+GLint Shader::resolveLocation(const UniformID& id)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniformMatrix4fv(loc, 1, GL_FALSE, m.m);
-	assert (glGetError() == GL_NO_ERROR);
+	if (!program)
+		return -1;
+
+	//a name interned after linking can still be an element of an array ("u_lights[3]")
+	std::vector<const char*>& names = getUniformNames();
+	int first = (int)uniform_locations.size();
+	uniform_locations.resize(names.size());
+	for (int i = first; i < names.size(); ++i)
+		uniform_locations[i] = glGetUniformLocation(program, names[i]);
+	return uniform_locations[id.index];
 }
 
-void Shader::setMatrix44Array( const char* varname, Matrix44* m_array, int num )
+void Shader::resetUniformStats()
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
-	glUniformMatrix4fv(loc, num, GL_FALSE, (GLfloat*)m_array);
-	assert(glGetError() == GL_NO_ERROR);
+	for (std::map<std::string, Shader*>::iterator it = s_Shaders.begin(); it != s_Shaders.end(); ++it)
+	{
+		it->second->last_frame_uniform_uploads = it->second->uniform_uploads;
+		it->second->last_frame_uniform_uploads_skipped = it->second->uniform_uploads_skipped;
+		it->second->uniform_uploads = it->second->uniform_uploads_skipped = 0;
+	}
 }
 
 void Shader::init()
@@ -8,6 +8,7 @@
 #include "includes.h"
 #include <string>
 #include <map>
+#include <vector>
 #include "framework.h"
 #include <cassert>
 
@@ -20,6 +21,15 @@
 
 class Texture;
 
+//Uniform name interned once into a global index, the shaders find its location with an array lookup instead of searching the name
+//Declare them once (static) where they are used every frame: static const UniformID u_model("u_model");
+struct UniformID
+{
+	int index;
+	const char* name;
+	explicit UniformID(const char* name);
+};
+
 class Shader
 {
 	int last_slot;
@@ -28,6 +38,8 @@ class Shader
 
 public:
 	static Shader* current;
+	static int s_ShaderID;
+	int m_Id; //used to batch render calls that share the shader
 
 	Shader();
 	virtual ~Shader();
@@ -39,7 +51,7 @@ public:
 	virtual bool load(const std::string& vsf, const std::string& psf, const char* macros);
 
 	//internal functions
-	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm);
+	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm = ""); //the geometry shader is optional
 	virtual void release();
 	virtual void enable();
 	virtual void disable();
@@ -64,6 +76,19 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//upload with interned names (no name lookup)
+	void setUniform(const UniformID& id, bool input) { assert(current == this); uploadUniform1(getLocation(id), id.name, (int)input); }
+	void setUniform(const UniformID& id, int input) { assert(current == this); uploadUniform1(getLocation(id), id.name, input); }
+	void setUniform(const UniformID& id, float input) { assert(current == this); uploadUniform1(getLocation(id), id.name, input); }
+	void setUniform(const UniformID& id, const Vector2& input) { assert(current == this); uploadUniform2(getLocation(id), id.name, input.x, input.y); }
+	void setUniform(const UniformID& id, const Vector3& input) { assert(current == this); uploadUniform3(getLocation(id), id.name, input.x, input.y, input.z); }
+	void setUniform(const UniformID& id, const Vector4& input) { assert(current == this); uploadUniform4(getLocation(id), id.name, input.x, input.y, input.z, input.w); }
+	void setUniform(const UniformID& id, const Matrix44& input) { assert(current == this); uploadMatrix44Array(getLocation(id), id.name, input.m, 1); }
+	void setUniform(const UniformID& id, Texture* texture, int slot) { assert(current == this); bindTexture(texture, slot); uploadUniform1(getLocation(id), id.name, slot); }
+	void setUniformArray(const UniformID& id, int size, const float* input, int count) { assert(current == this); uploadUniformArray(getLocation(id), id.name, size, input, count); } //size is the number of components (1 to 4)
+	void setUniformArray(const UniformID& id, int size, const int* input, int count) { assert(current == this); uploadUniformArray(getLocation(id), id.name, size, input, count); }
+	void setMatrix44Array(const UniformID& id, const Matrix44* m_array, int num) { assert(current == this); uploadMatrix44Array(getLocation(id), id.name, m_array[0].m, num); }
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -120,24 +145,63 @@ public:
 
 	static Shader* getDefaultShader(std::string name);
 
+	//Stats
+	int uniform_uploads; //glUniform calls since the start of the frame
+	int uniform_uploads_skipped; //uploads of the same value the program already had, since the start of the frame
+	int last_frame_uniform_uploads; //same counters in the last frame
+	int last_frame_uniform_uploads_skipped;
+	static void resetUniformStats(); //called at the start of every frame
+
 protected:
 
 	std::string info_log;
 	std::string vs_filename;
 	std::string ps_filename;
+	std::string gs_filename;
 	std::string macros;
 	bool from_atlas;
 
 	bool createVertexShaderObject(const std::string& shader);
 	bool createFragmentShaderObject(const std::string& shader);
+	bool createGeometryShaderObject(const std::string& shader);
 	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
 	void saveShaderInfoLog(GLuint obj);
 	void saveProgramInfoLog(GLuint obj);
 
 	bool validate();
 
+	//location of every interned uniform in this program (-1 if not used), filled after linking
+	std::vector<GLint> uniform_locations;
+	void fillUniformLocations();
+	GLint resolveLocation(const UniformID& id); //for the names interned after linking
+	GLint getLocation(const UniformID& id) { return id.index < uniform_locations.size() ? uniform_locations[id.index] : resolveLocation(id); }
+
+	//copy of the last value uploaded to every element of the active uniforms, so uploads of the same value are skipped
+	std::vector<int> location_elements; //element of each location (-1 if unknown)
+	std::vector<int> element_offsets; //offset of the element in uniform_values
+	std::vector<int> element_sizes; //bytes of the element (0 if its type is not cached)
+	std::vector<int> elements_left; //elements from this one to the end of its array
+	std::vector<char> element_known; //uniform_values has the value of the element
+	std::vector<uint8> uniform_values;
+	bool isUniformCached(GLint loc, const void* data, int element_size, int count); //true if the elements already had these values, otherwise stores them
+
+	//uploads to a location, ignored when it is -1 (the name is only used to report the missing uniform)
+	void uploadUniform1(GLint loc, const char* name, int input);
+	void uploadUniform1(GLint loc, const char* name, float input);
+	void uploadUniform2(GLint loc, const char* name, int input1, int input2);
+	void uploadUniform2(GLint loc, const char* name, float input1, float input2);
+	void uploadUniform3(GLint loc, const char* name, int input1, int input2, int input3);
+	void uploadUniform3(GLint loc, const char* name, float input1, float input2, float input3);
+	void uploadUniform4(GLint loc, const char* name, int input1, int input2, int input3, int input4);
+	void uploadUniform4(GLint loc, const char* name, float input1, float input2, float input3, float input4);
+	void uploadUniformArray(GLint loc, const char* name, int size, const int* input, int count);
+	void uploadUniformArray(GLint loc, const char* name, int size, const float* input, int count);
+	void uploadMatrix44Array(GLint loc, const char* name, const float* m, int num);
+	void bindTexture(Texture* texture, int slot);
+
 	GLuint vs;
 	GLuint fs;
+	GLuint gs;
 	GLuint program;
 	std::string log;
 
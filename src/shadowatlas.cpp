@@ -0,0 +1,189 @@
+#include "shadowatlas.h"
+#include "camera.h"
+#include "scene.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace GTR;
+
+//A light changes of tier only when its score is this factor away from the limits of its current tier (avoids repacking
+//the atlas every frame when the camera moves around a limit)
+static const float TIER_HYSTERESIS = 1.2f;
+
+//Tier 0 for scores above 0.5, tier 1 above 0.25...
+static int getTierFromScore(float score)
+{
+	if (score <= 0.0f)
+		return ShadowAtlas::NUM_TIERS - 1;
+	int tier = (int)floor(-log2(std::min(score, 1.0f)));
+	return std::min(std::max(tier, 0), ShadowAtlas::NUM_TIERS - 1);
+}
+
+//Takes the even bits of a Morton code
+static int compactBits(int code)
+{
+	code &= 0x55555555;
+	code = (code | (code >> 1)) & 0x33333333;
+	code = (code | (code >> 2)) & 0x0F0F0F0F;
+	code = (code | (code >> 4)) & 0x00FF00FF;
+	code = (code | (code >> 8)) & 0x0000FFFF;
+	return code;
+}
+
+GTR::ShadowAtlas::ShadowAtlas()
+{
+	num_maps = 0;
+	num_dropped = 0;
+	num_repacks = 0;
+	for (int i = 0; i < NUM_TIERS; ++i)
+		maps_per_tier[i] = 0;
+	last_top_resolution = 0;
+	last_atlas_size = 0;
+}
+
+float GTR::ShadowAtlas::computeScore(LightEntity* light, Camera* camera)
+{
+	if (light->light_type == DIRECTIONAL)
+		return light->shadow_priority;
+
+	//Bounding sphere of the light volume against the vertical field of view
+	Vector3 position = light->model.getTranslation();
+	float distance = position.distance(camera->eye);
+	float radius = light->max_distance;
+	if (distance <= radius)
+		return light->shadow_priority;
+	float coverage = radius / (distance * tan(camera->fov * 0.5f * DEG2RAD));
+	return std::min(coverage, 1.0f) * light->shadow_priority;
+}
+
+bool GTR::ShadowAtlas::update(std::vector<LightEntity*>& lights, Camera* camera, int top_resolution, int atlas_size)
+{
+	top_resolution = std::min(top_resolution, atlas_size);
+
+	//Lights that need shadow maps in the atlas
+	candidates.clear();
+	scores.clear();
+	tiers.clear();
+	num_light_maps.clear();
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		if (!light->cast_shadows)
+		{
+			light->shadow_tier = -1;
+			continue;
+		}
+
+		float score = computeScore(light, camera);
+		int tier = getTierFromScore(score);
+
+		//Keep the current tier while the score is close to it
+		int current_tier = light->shadow_tier;
+		if (current_tier != -1 && getTierFromScore(score * TIER_HYSTERESIS) <= current_tier && current_tier <= getTierFromScore(score / TIER_HYSTERESIS))
+			tier = current_tier;
+
+		candidates.push_back(light);
+		scores.push_back(score);
+		tiers.push_back(tier);
+		num_light_maps.push_back(light->getNumShadowMaps());
+	}
+
+	//The atlas is measured in tiles of the smallest tier: a map of tier t uses 4^(NUM_TIERS - 1 - t) tiles
+	int min_tile = std::max(top_resolution >> (NUM_TIERS - 1), 1);
+	int tiles_per_side = atlas_size / min_tile;
+	long long capacity = (long long)tiles_per_side * tiles_per_side;
+	long long used = 0;
+	for (int i = 0; i < tiers.size(); ++i)
+		used += (long long)num_light_maps[i] << (2 * (NUM_TIERS - 1 - tiers[i]));
+
+	//Too many maps: demote the lights from the least to the most important until they fit, and drop the least important ones if needed
+	std::vector<int> by_score(candidates.size());
+	for (int i = 0; i < by_score.size(); ++i)
+		by_score[i] = i;
+	std::stable_sort(by_score.begin(), by_score.end(), [&](int a, int b) { return scores[a] < scores[b]; });
+	bool demoted = true;
+	while (used > capacity && demoted)
+	{
+		demoted = false;
+		for (int i = 0; i < by_score.size() && used > capacity; ++i)
+		{
+			int& tier = tiers[by_score[i]];
+			long long maps = num_light_maps[by_score[i]];
+			if (tier == NUM_TIERS - 1)
+				continue;
+			used -= maps << (2 * (NUM_TIERS - 1 - tier));
+			tier++;
+			used += maps << (2 * (NUM_TIERS - 1 - tier));
+			demoted = true;
+		}
+	}
+	for (int i = 0; i < by_score.size() && used > capacity; ++i)
+	{
+		int& tier = tiers[by_score[i]];
+		used -= (long long)num_light_maps[by_score[i]] << (2 * (NUM_TIERS - 1 - tier));
+		tier = -1;
+	}
+
+	//Repack only if something changed
+	bool changed = atlas_size != last_atlas_size || top_resolution != last_top_resolution || candidates != last_lights || tiers != last_tiers || num_light_maps != last_num_maps;
+	if (!changed)
+		return false;
+
+	last_atlas_size = atlas_size;
+	last_top_resolution = top_resolution;
+	last_lights = candidates;
+	last_tiers = tiers;
+	last_num_maps = num_light_maps;
+	pack(top_resolution, atlas_size);
+	num_repacks++;
+	return true;
+}
+
+void GTR::ShadowAtlas::pack(int top_resolution, int atlas_size)
+{
+	int min_tile = std::max(top_resolution >> (NUM_TIERS - 1), 1);
+
+	//From the biggest maps to the smallest, so the Morton cursor is always aligned to the size of the next map
+	std::vector<int> order(candidates.size());
+	for (int i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return tiers[a] < tiers[b]; });
+
+	num_maps = 0;
+	num_dropped = 0;
+	for (int i = 0; i < NUM_TIERS; ++i)
+		maps_per_tier[i] = 0;
+
+	int cursor = 0;
+	for (int i = 0; i < order.size(); ++i)
+	{
+		LightEntity* light = candidates[order[i]];
+		int tier = tiers[order[i]];
+		light->shadow_tier = tier;
+		for (int j = 0; j < MAX_SHADOW_MAPS; ++j)
+		{
+			light->shadow_region[j] = Vector4();
+			light->shadow_rect[j] = Vector4();
+		}
+		if (tier == -1)
+		{
+			num_dropped++;
+			continue;
+		}
+
+		//All the maps of the light are consecutive
+		int resolution = top_resolution >> tier;
+		light->shadow_index = num_maps;
+		for (int j = 0; j < num_light_maps[order[i]]; ++j)
+		{
+			float x = (float)(compactBits(cursor) * min_tile);
+			float y = (float)(compactBits(cursor >> 1) * min_tile);
+			cursor += 1 << (2 * (NUM_TIERS - 1 - tier));
+
+			light->shadow_region[j] = Vector4(x, y, (float)resolution, (float)resolution);
+			light->shadow_rect[j] = Vector4(x / atlas_size, y / atlas_size, resolution / (float)atlas_size, resolution / (float)atlas_size);
+			num_maps++;
+			maps_per_tier[tier]++;
+		}
+	}
+}
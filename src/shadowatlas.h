@@ -0,0 +1,52 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+
+namespace GTR {
+
+	class LightEntity;
+
+	//Allocator of the shadow maps in a square depth atlas of fixed size.
+	//Each shadowed light gets a resolution tier (shared by all its maps: one per cascade for directional lights, one per cube face for point lights) from its projected screen coverage and its shadow priority: tier t is
+	//top_resolution >> t pixels wide. As all the tiers are powers of two, the maps are packed like a quadtree: sorted from
+	//the biggest to the smallest and placed following the Z-order (Morton) curve, every map falls in an aligned quadrant and
+	//nothing overlaps. If the maps don't fit, the least important lights are demoted (and dropped as a last resort).
+	//The rectangles are only repacked when a tier (or the set of shadowed lights) changes.
+	class ShadowAtlas
+	{
+	public:
+		static const int NUM_TIERS = 4;
+
+		//Stats
+		int num_maps; //Shadow maps in the atlas
+		int num_dropped; //Lights that cast shadows but had no space left
+		int num_repacks; //Total times the atlas has been repacked
+		int maps_per_tier[NUM_TIERS];
+
+		ShadowAtlas();
+
+		//Assigns the tiers and the atlas rectangles of the lights (shadow_tier, shadow_region, shadow_rect, shadow_index).
+		//Returns true if the rectangles changed, so all the shadow maps must be rendered again
+		bool update(std::vector<LightEntity*>& lights, Camera* camera, int top_resolution, int atlas_size);
+
+		//Importance of the shadow of a light: projected screen coverage scaled by its priority (directional lights cover everything)
+		static float computeScore(LightEntity* light, Camera* camera);
+
+	private:
+		int last_top_resolution;
+		int last_atlas_size;
+		std::vector<LightEntity*> last_lights; //Shadowed lights and tiers of the last packing
+		std::vector<int> last_tiers;
+		std::vector<int> last_num_maps;
+		std::vector<LightEntity*> candidates; //Temporal storage
+		std::vector<float> scores;
+		std::vector<int> tiers;
+		std::vector<int> num_light_maps; //Shadow maps of each candidate
+
+		void pack(int top_resolution, int atlas_size);
+	};
+
+};
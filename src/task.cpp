@@ -76,4 +76,83 @@ void TaskManager::addTask(Task* task)
 	const std::lock_guard<std::mutex> lock(tasks_mutex);
 	pending_tasks.push_back(task);
 	//release pending_tasks automatically
+}
+
+WorkerPool WorkerPool::global;
+
+WorkerPool::WorkerPool()
+{
+	generation = 0;
+	pending_workers = 0;
+	must_exit = false;
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		must_exit = true;
+	}
+	start_condition.notify_all();
+	for (int i = 0; i < threads.size(); ++i)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	threads.clear();
+}
+
+void WorkerPool::start(int num_threads)
+{
+	assert(threads.empty() && "WorkerPool already started");
+	for (int i = 1; i < num_threads; ++i)
+		threads.push_back(new std::thread(&WorkerPool::workerLoop, this, i));
+}
+
+void WorkerPool::workerLoop(int worker_index)
+{
+	int last_generation = 0;
+	while (true)
+	{
+		std::function<void(int)> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_condition.wait(lock, [&] { return must_exit || generation != last_generation; });
+			if (must_exit)
+				return;
+			last_generation = generation;
+			job = current_job;
+		}
+
+		job(worker_index);
+
+		{
+			const std::lock_guard<std::mutex> lock(mutex);
+			pending_workers--;
+		}
+		done_condition.notify_one();
+	}
+}
+
+void WorkerPool::run(std::function<void(int)> job)
+{
+	if (threads.empty())
+	{
+		job(0);
+		return;
+	}
+
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		current_job = job;
+		pending_workers = (int)threads.size();
+		generation++;
+	}
+	start_condition.notify_all();
+
+	//the calling thread does its part too
+	job(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done_condition.wait(lock, [&] { return pending_workers == 0; });
 }
\ No newline at end of file
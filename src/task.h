@@ -5,6 +5,7 @@
 #include <mutex>
 #include <thread>         // std::thread
 #include <functional>
+#include <condition_variable>
 
 //any task executed in BG should inherit from this one
 class Task {
@@ -31,4 +32,31 @@ public:
 	void fetchTask();
 	void loop();
 	void startThread();
+};
+
+//pool of threads that run the same job in parallel (fork-join), the calling thread works as worker 0
+class WorkerPool {
+public:
+	static WorkerPool global;
+
+	WorkerPool();
+	~WorkerPool();
+
+	void start(int num_threads); //total number of workers, including the calling thread
+	int getNumWorkers() { return (int)threads.size() + 1; }
+
+	//runs job(worker_index) in every worker and waits until all of them have finished
+	void run(std::function<void(int)> job);
+
+private:
+	std::vector<std::thread*> threads;
+	std::mutex mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	std::function<void(int)> current_job;
+	int generation; //incremented for every job, so the workers know there is a new one
+	int pending_workers;
+	bool must_exit;
+
+	void workerLoop(int worker_index);
 };
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include "transformstest.h"
+#include "framework.h"
+#include <vector>
+#include <random>
+#include <iostream>
+#include <cmath>
+
+//Relative tolerances: the near singular matrices lose some digits with both inverse methods
+static const float TOLERANCE = 1e-4f;
+static const float INVERSE_TOLERANCE = 1e-3f;
+
+struct TestMatrix {
+	Matrix44 matrix;
+	const char* name;
+};
+
+//Largest difference between two arrays, relative to the magnitude of the reference (at least 1)
+static float relativeDifference(const float* values, const float* reference, int count)
+{
+	float magnitude = 1.0f;
+	float difference = 0.0f;
+	for (int i = 0; i < count; ++i)
+	{
+		magnitude = std::max(magnitude, fabsf(reference[i]));
+		difference = std::max(difference, fabsf(values[i] - reference[i]));
+	}
+	return difference / magnitude;
+}
+
+static void addMatrix(std::vector<TestMatrix>& matrices, const Matrix44& matrix, const char* name)
+{
+	TestMatrix test_matrix;
+	test_matrix.matrix = matrix;
+	test_matrix.name = name;
+	matrices.push_back(test_matrix);
+}
+
+//Singular matrices have exact entries, so both methods find a zero determinant
+static void addHardCases(std::vector<TestMatrix>& matrices)
+{
+	Matrix44 matrix;
+	addMatrix(matrices, Matrix44::IDENTITY, "identity");
+	matrix.clear();
+	addMatrix(matrices, matrix, "zero");
+	matrix.setScale(1, 1, 0);
+	addMatrix(matrices, matrix, "flat scale");
+	const float repeated_rows[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 1, 2, 3, 4, 0, 0, 0, 1 };
+	addMatrix(matrices, Matrix44(repeated_rows), "repeated rows");
+
+	matrix.setRotation(0.7f, Vector3(1, 2, 3).normalize());
+	matrix.scale(1, 1, 0.001f);
+	matrix.translateGlobal(10, -5, 3);
+	addMatrix(matrices, matrix, "near flat scale");
+	const float near_repeated_rows[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 1, 2, 3.001f, 4, 0, 0, 0, 1 };
+	addMatrix(matrices, Matrix44(near_repeated_rows), "near repeated rows");
+
+	Matrix44 projection;
+	projection.perspective(60.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
+	addMatrix(matrices, projection, "perspective");
+	Matrix44 view;
+	Vector3 eye(10, 20, 30), center(0, 0, 0), up(0, 1, 0);
+	view.lookAt(eye, center, up);
+	addMatrix(matrices, view * projection, "view projection");
+	matrix.ortho(-100, 100, -100, 100, -50, 500);
+	addMatrix(matrices, matrix, "ortho");
+}
+
+//Translation, rotation and non uniform scale
+static Matrix44 randomTRS(std::mt19937& generator)
+{
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> scale(0.1f, 10.0f);
+
+	Vector3 axis(unit(generator), unit(generator), unit(generator));
+	if (axis.length() < 0.01f)
+		axis.set(0, 1, 0);
+
+	Matrix44 matrix;
+	matrix.setRotation(unit(generator) * (float)PI, axis.normalize());
+	matrix.scale(scale(generator), scale(generator), scale(generator));
+	matrix.translateGlobal(unit(generator) * 100.0f, unit(generator) * 100.0f, unit(generator) * 100.0f);
+	return matrix;
+}
+
+int testTransforms(unsigned int seed, int num_random)
+{
+	std::vector<TestMatrix> matrices;
+	addHardCases(matrices);
+	int num_hard_cases = (int)matrices.size();
+
+	std::mt19937 generator(seed);
+	for (int i = 0; i < num_random; ++i)
+		addMatrix(matrices, randomTRS(generator), "random TRS");
+
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> size(0.01f, 50.0f);
+
+	int mismatches = 0;
+	auto report = [&](const char* operation, int index, float difference) {
+		mismatches++;
+		std::cout << "Transforms test: " << operation << " of " << matrices[index].name << " " << index << " differs (" << difference << ")" << std::endl;
+	};
+
+	for (int i = 0; i < (int)matrices.size(); ++i)
+	{
+		const Matrix44& m = matrices[i].matrix;
+
+		//Multiply: by itself, by every hard case and by the next matrix
+		for (int j = 0; j <= num_hard_cases; ++j)
+		{
+			const Matrix44& other = j == 0 ? m : (j < num_hard_cases ? matrices[j].matrix : matrices[(i + 1) % matrices.size()].matrix);
+			Matrix44 simd = m * other;
+			Matrix44 scalar = m.multiplyScalar(other);
+			float difference = relativeDifference(simd.m, scalar.m, 16);
+			if (!(difference <= TOLERANCE))
+				report("multiply", i, difference);
+		}
+
+		//Inverse: same result when both succeed, and both leave the matrix as it was when it is singular
+		Matrix44 simd = m;
+		Matrix44 scalar = m;
+		bool simd_ok = simd.inverse();
+		bool scalar_ok = scalar.inverseScalar();
+		float difference = relativeDifference(simd.m, scalar.m, 16);
+		if (simd_ok != scalar_ok || !(difference <= INVERSE_TOLERANCE))
+			report(simd_ok == scalar_ok ? "inverse" : (simd_ok ? "inverse (only SIMD succeeds)" : "inverse (only scalar succeeds)"), i, difference);
+
+		//Bounding box: Arvo's method against the eight corners (both ignore the projective row)
+		BoundingBox box(Vector3(unit(generator), unit(generator), unit(generator)) * 100.0f, Vector3(size(generator), size(generator), size(generator)));
+		BoundingBox simd_box = transformBoundingBox(m, box);
+		BoundingBox scalar_box = transformBoundingBoxScalar(m, box);
+		float box_values[6] = { simd_box.center.x, simd_box.center.y, simd_box.center.z, simd_box.halfsize.x, simd_box.halfsize.y, simd_box.halfsize.z };
+		float box_reference[6] = { scalar_box.center.x, scalar_box.center.y, scalar_box.center.z, scalar_box.halfsize.x, scalar_box.halfsize.y, scalar_box.halfsize.z };
+		difference = relativeDifference(box_values, box_reference, 6);
+		if (!(difference <= TOLERANCE))
+			report("bounding box", i, difference);
+	}
+
+	std::cout << "Transforms test of " << matrices.size() << " matrices (seed " << seed << "): " << mismatches << " mismatches" << std::endl;
+	return mismatches;
+}
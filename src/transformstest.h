@@ -0,0 +1,6 @@
+#pragma once
+
+//Checks the SIMD matrix multiply, inverse and bounding box transform against the scalar versions, over some hard cases
+//(singular, near singular and projective matrices) and num_random affine TRS matrices generated from seed.
+//It needs no scene nor GL context (main runs it with --test-transforms). Prints every mismatch and returns how many there were.
+int testTransforms(unsigned int seed = 1234, int num_random = 1000);
@@ -0,0 +1,155 @@
+#include "uniformbuffer.h"
+#include "utils.h"
+#include <cassert>
+#include <algorithm>
+
+using namespace GTR;
+
+GTR::UniformBufferRing::UniformBufferRing()
+{
+	buffer_id = 0;
+	persistent = false;
+	frame_size = 0;
+	alignment = 256;
+	used = 0;
+	waits = 0;
+	frame = 0;
+	frame_offset = 0;
+	mapped = NULL;
+	for (int i = 0; i < NUM_FRAMES; ++i)
+		fences[i] = 0;
+}
+
+GTR::UniformBufferRing::~UniformBufferRing()
+{
+	release();
+}
+
+void GTR::UniformBufferRing::release()
+{
+	for (int i = 0; i < NUM_FRAMES; ++i)
+	{
+		if (fences[i])
+			glDeleteSync(fences[i]);
+		fences[i] = 0;
+	}
+
+	if (buffer_id)
+	{
+		if (mapped)
+		{
+			glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+			glUnmapBuffer(GL_UNIFORM_BUFFER);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		}
+		glDeleteBuffers(1, &buffer_id);
+	}
+	buffer_id = 0;
+	mapped = NULL;
+	frame_size = 0;
+}
+
+void GTR::UniformBufferRing::create(int size)
+{
+	//deleting the old buffer is safe: GL keeps its storage until the draw calls that read it have finished
+	release();
+
+	GLint offset_alignment = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+	alignment = std::max((int)offset_alignment, 16);
+	frame_size = (size + alignment - 1) / alignment * alignment;
+
+	glGenBuffers(1, &buffer_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+	persistent = SDL_GL_ExtensionSupported("GL_ARB_buffer_storage") == SDL_TRUE;
+	if (persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_UNIFORM_BUFFER, frame_size * NUM_FRAMES, NULL, flags);
+		mapped = (uint8*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, frame_size * NUM_FRAMES, flags);
+		assert(mapped && "the uniform ring couldn't be mapped");
+	}
+	else
+		glBufferData(GL_UNIFORM_BUFFER, frame_size * NUM_FRAMES, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	checkGLErrors();
+}
+
+void GTR::UniformBufferRing::beginFrame(int size)
+{
+	if (!buffer_id || size > frame_size)
+	{
+		create(std::max(size, frame_size * 2));
+		frame = 0;
+	}
+
+	//the GPU may still be reading this region (NUM_FRAMES frames ago)
+	GLsync& fence = fences[frame];
+	if (fence)
+	{
+		GLenum result = glClientWaitSync(fence, 0, 0);
+		if (result == GL_TIMEOUT_EXPIRED)
+		{
+			waits++;
+			while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		}
+		glDeleteSync(fence);
+		fence = 0;
+	}
+
+	frame_offset = frame * frame_size;
+	used = 0;
+	if (!persistent)
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+		mapped = (uint8*)glMapBufferRange(GL_UNIFORM_BUFFER, frame_offset, frame_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		assert(mapped && "the uniform ring couldn't be mapped");
+	}
+}
+
+int GTR::UniformBufferRing::alloc(int size, void** data)
+{
+	assert(mapped && "beginFrame must be called before alloc");
+	int offset = (used + alignment - 1) / alignment * alignment;
+	assert(offset + size <= frame_size && "the size passed to beginFrame is too small");
+	used = offset + size;
+	*data = mapped + (persistent ? frame_offset : 0) + offset;
+	return frame_offset + offset;
+}
+
+void GTR::UniformBufferRing::flush()
+{
+	//the persistent mapping is coherent: the writes are visible to the next draw calls
+	if (persistent)
+		return;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	mapped = NULL;
+}
+
+void GTR::UniformBufferRing::bindRange(int binding, int offset, int size)
+{
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer_id, offset, size);
+}
+
+void GTR::UniformBufferRing::endFrame()
+{
+	assert(!fences[frame]);
+	fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	frame = (frame + 1) % NUM_FRAMES;
+}
+
+void GTR::UniformBufferRing::bindUniformBlocks(unsigned int program)
+{
+	const char* names[3] = { "FrameBlock", "MaterialBlock", "LightBlock" };
+	const int bindings[3] = { FRAME_BLOCK_BINDING, MATERIAL_BLOCK_BINDING, LIGHT_BLOCK_BINDING };
+	for (int i = 0; i < 3; ++i)
+	{
+		GLuint index = glGetUniformBlockIndex(program, names[i]);
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, index, bindings[i]);
+	}
+}
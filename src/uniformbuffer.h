@@ -0,0 +1,64 @@
+#pragma once
+#include "includes.h"
+#include "framework.h"
+
+namespace GTR {
+
+	//Binding points of the uniform blocks of the shader atlas (bound by name when the shaders are linked)
+	enum eUniformBlockBinding {
+		FRAME_BLOCK_BINDING = 0,
+		MATERIAL_BLOCK_BINDING = 1,
+		LIGHT_BLOCK_BINDING = 2
+	};
+
+	//Uniform buffer written by the CPU once per frame and read by the GPU while it renders that frame.
+	//The buffer is split in NUM_FRAMES regions used in turns, with a fence per region: the CPU only waits for the GPU
+	//if it gets NUM_FRAMES frames ahead. With GL_ARB_buffer_storage the buffer is mapped once (persistent and coherent),
+	//otherwise the region of the frame is mapped unsynchronized (the fence already protects it) and unmapped before drawing.
+	class UniformBufferRing
+	{
+	public:
+		static const int NUM_FRAMES = 3;
+
+		unsigned int buffer_id;
+		bool persistent; //mapped once with GL_ARB_buffer_storage
+		int frame_size; //bytes of each region
+		int alignment; //GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+
+		//Stats
+		int used; //bytes allocated in the current frame
+		int waits; //frames that had to wait for the GPU to release their region
+
+		UniformBufferRing();
+		~UniformBufferRing();
+
+		//Waits until the GPU doesn't read the next region and maps it (the buffer grows if the frame needs more than a region)
+		void beginFrame(int size);
+
+		//Space for size bytes in the region of the frame, returns its offset in the buffer (for glBindBufferRange)
+		int alloc(int size, void** data);
+
+		//Must be called after writing the data of the frame and before the draw calls that read it
+		void flush();
+
+		//Binds a range of the buffer to a block binding point
+		void bindRange(int binding, int offset, int size);
+
+		//Fences the region after the draw calls of the frame
+		void endFrame();
+
+		void release();
+
+		//Sets the binding points of the blocks of a program (called after linking it)
+		static void bindUniformBlocks(unsigned int program);
+
+	private:
+		int frame; //region of the current frame
+		int frame_offset; //start of that region
+		uint8* mapped; //pointer to the start of the buffer (persistent) or the region (mapped every frame)
+		GLsync fences[NUM_FRAMES];
+
+		void create(int size);
+	};
+
+};